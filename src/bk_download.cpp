@@ -15,10 +15,13 @@
 */
 #include "bk_download.h"
 #include <errno.h>
+#include <algorithm>
 #include <list>
+#include <map>
 #include <set>
 #include <string>
 #include <thread>
+#include <vector>
 #include <sys/file.h>
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
@@ -26,12 +29,14 @@
 #include <photon/fs/localfs.h>
 #include <photon/fs/throttled-file.h>
 #include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "switch_file.h"
 #include "image_file.h"
 #include "tools/sha256file.h"
+#include "metrics_fs.h"
 
 using namespace photon::fs;
 
@@ -73,16 +78,18 @@ bool BkDownload::download_done() {
     old_name = dir + "/" + DOWNLOAD_TMP_NAME;
     new_name = dir + "/" + COMMIT_FILE_NAME;
 
-    // verify sha256
-    photon::semaphore done;
-    std::string shares;
-    std::thread sha256_thread([&]() {
-        shares = sha256sum(old_name.c_str());
-        done.signal(1);
-    });
-    sha256_thread.detach();
-    // wait verify finish
-    done.wait(1);
+    // verify sha256, hashed while downloading if possible
+    std::string shares = streamed_digest;
+    if (shares.empty()) {
+        photon::semaphore done;
+        std::thread sha256_thread([&]() {
+            shares = sha256sum(old_name.c_str());
+            done.signal(1);
+        });
+        sha256_thread.detach();
+        // wait verify finish
+        done.wait(1);
+    }
 
     if (shares != digest) {
         LOG_ERROR("verify checksum ` failed (expect: `, got: `)", old_name, digest, shares);
@@ -126,11 +133,48 @@ void BkDownload::unlock_file() {
     lock_files.erase(dir);
 }
 
+bool BkDownload::link_from(const std::string &src_dir) {
+    std::string src = src_dir + "/" + COMMIT_FILE_NAME;
+    std::string dst = dir + "/" + COMMIT_FILE_NAME;
+    if (::link(src.c_str(), dst.c_str()) != 0) {
+        LOG_ERRNO_RETURN(0, false, "failed to link ` to `", src, dst);
+    }
+    LOG_INFO("reuse downloaded layer ` of `", digest, src_dir);
+    switch_to_local_file();
+    return true;
+}
+
+uint64_t BkDownload::heat() {
+    return heat_file ? heat_file->read_bytes : 0;
+}
+
+// Blocks are claimed in order by the workers, and written out of order. They are hashed in
+// order, and a block fetched ahead of the hashed offset is kept in `pending` until its turn.
+// Workers don't claim blocks beyond a window of the hashed offset, bounding the memory.
+struct BkDownload::DownloadContext {
+    IFile *src;
+    IFile *dst;
+    off_t offset = 0;   // next block to claim
+    size_t fetched = 0; // bytes fetched from source
+    bool failed = false;
+    SHA256File *sha = nullptr;
+    off_t hashed = 0;
+    size_t window = 0;
+    std::map<off_t, std::pair<void *, size_t>> pending;
+    photon::condition_variable cond;
+
+    void fail() {
+        failed = true;
+        cond.notify_all();
+    }
+};
+
 bool BkDownload::download_blob() {
     std::string dl_file_path = dir + "/" + DOWNLOAD_TMP_NAME;
     try_cnt--;
     IFile *src = src_file;
     if (limit_MB_ps > 0) {
+        // shared by all the workers, limiting the whole task
         ThrottleLimits limits;
         limits.R.throughput = limit_MB_ps * 1024UL * 1024; // MB
         limits.R.block_size = 1024UL * 1024;
@@ -149,42 +193,100 @@ bool BkDownload::download_blob() {
     DEFER(delete dst;);
     dst->ftruncate(file_size);
 
+    DownloadContext ctx;
+    ctx.src = src;
+    ctx.dst = dst;
+    auto n = std::max(concurrency, 1);
+    auto sha = new_sha256_file(nullptr, false);
+    DEFER(delete sha);
+    ctx.sha = sha;
+    ctx.window = 2 * n;
+    DEFER({
+        for (auto &x : ctx.pending)
+            free(x.second.first);
+    });
+    streamed_digest.clear();
+    auto start = photon::now;
+    LOG_INFO("download blob start. (`), concurrency `", url, n);
+    std::vector<photon::join_handle *> jhs;
+    for (int i = 1; i < n; i++) {
+        auto th = photon::thread_create11(&BkDownload::download_blocks, this, &ctx);
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    download_blocks(&ctx);
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    if (ctx.failed)
+        return false;
+    if (ctx.hashed == (off_t)file_size)
+        streamed_digest = sha->sha256_checksum();
+
+    auto elapsed = std::max(photon::now - start, 1UL);
+    LOG_INFO("download blob done. (`), fetched ` bytes in ` ms, ` MB/s", dl_file_path,
+             ctx.fetched, elapsed / 1000, ctx.fetched * 1000000 / elapsed / (1024 * 1024));
+    return true;
+}
+
+void BkDownload::download_blocks(DownloadContext *ctx) {
     size_t bs = block_size;
-    off_t offset = 0;
-    void *buff = nullptr;
-    // buffer allocate, with 4K alignment
-    ::posix_memalign(&buff, ALIGNMENT, bs);
-    if (buff == nullptr)
-        LOG_ERRNO_RETURN(0, false, "failed to allocate buffer with ", VALUE(bs));
-    DEFER(free(buff));
-
-    LOG_INFO("download blob start. (`)", url);
-    while (offset < (ssize_t)file_size) {
+    while (!ctx->failed) {
         if (running != 1) {
+            ctx->fail();
             LOG_INFO("image file exit when background downloading");
-            return false;
+            return;
+        }
+        if (scheduler && !scheduler->admit(this)) {
+            ctx->fail();
+            LOG_INFO("background downloading is stopped");
+            return;
         }
+        while (!ctx->failed && ctx->offset >= ctx->hashed + (off_t)(ctx->window * bs))
+            ctx->cond.wait_no_lock();
+        if (ctx->failed || ctx->offset >= (ssize_t)file_size)
+            return;
+        off_t offset = ctx->offset;
+        ctx->offset += bs;
+        auto count = bs;
+        if (offset + count > file_size)
+            count = file_size - offset;
+
+        void *buff = nullptr;
+        // buffer allocate, with 4K alignment
+        ::posix_memalign(&buff, ALIGNMENT, bs);
+        if (buff == nullptr) {
+            ctx->fail();
+            LOG_ERRNO_RETURN(0, , "failed to allocate buffer with ", VALUE(bs));
+        }
+        bool kept = false;
+        DEFER({
+            if (!kept)
+                free(buff);
+        });
+
         if (!force_download) {
             // check aleady downloaded.
-            auto hole_pos = dst->lseek(offset, SEEK_HOLE);
+            auto hole_pos = ctx->dst->lseek(offset, SEEK_HOLE);
             if (hole_pos >= offset + (ssize_t)bs) {
-                // alread downloaded
-                offset += bs;
+                // alread downloaded, read back only for hashing
+                if (ctx->dst->pread(buff, count, offset) != (ssize_t)count) {
+                    ctx->fail();
+                    LOG_ERRNO_RETURN(0, , "failed to read back at ", VALUE(offset), VALUE(count));
+                }
+                kept = hash_block(ctx, offset, buff, count);
                 continue;
             }
         }
 
         int retry = 2;
-        auto count = bs;
-        if (offset + count > file_size)
-            count = file_size - offset;
     again_read:
-        if (!(retry--))
-            LOG_ERROR_RETURN(EIO, false, "failed to read at ", VALUE(offset), VALUE(count));
+        if (!(retry--)) {
+            ctx->fail();
+            LOG_ERROR_RETURN(EIO, , "failed to read at ", VALUE(offset), VALUE(count));
+        }
         ssize_t rlen;
         {
             SCOPE_AUDIT("bk_download", AU_FILEOP(url, offset, rlen));
-            rlen = src->pread(buff, bs, offset);
+            rlen = ctx->src->pread(buff, bs, offset);
         }
         if (rlen < 0) {
             LOG_WARN("failed to read at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
@@ -192,74 +294,173 @@ bool BkDownload::download_blob() {
         }
         retry = 2;
     again_write:
-        if (!(retry--))
-            LOG_ERROR_RETURN(EIO, false, "failed to write at ", VALUE(offset), VALUE(count));
-        auto wlen = dst->pwrite(buff, count, offset);
+        if (!(retry--)) {
+            ctx->fail();
+            LOG_ERROR_RETURN(EIO, , "failed to write at ", VALUE(offset), VALUE(count));
+        }
+        auto wlen = ctx->dst->pwrite(buff, count, offset);
         // but once write lenth larger than read length treats as OK
         if (wlen < rlen) {
             LOG_WARN("failed to write at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
             goto again_write;
         }
-        offset += count;
+        ctx->fetched += count;
+        kept = hash_block(ctx, offset, buff, count);
     }
-    LOG_INFO("download blob done. (`)", dl_file_path);
-    return true;
 }
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec, int &running) {
-    LOG_INFO("BACKGROUND DOWNLOAD THREAD STARTED.");
-    uint64_t time_st = photon::now;
-    while (photon::now - time_st < delay_sec * 1000000) {
-        photon::thread_usleep(200 * 1000);
-        if (running != 1)
-            break;
+// returns true if `buf` is kept in pending, to be hashed and freed later
+bool BkDownload::hash_block(DownloadContext *ctx, off_t offset, void *buf, size_t count) {
+    if (offset != ctx->hashed) {
+        ctx->pending[offset] = {buf, count};
+        return true;
+    }
+    if (ctx->sha->sha256_update(buf, count) != 0) {
+        ctx->fail();
+        return false;
     }
+    ctx->hashed += count;
+    for (auto it = ctx->pending.begin(); it != ctx->pending.end() && it->first == ctx->hashed;
+         it = ctx->pending.erase(it)) {
+        auto ret = ctx->sha->sha256_update(it->second.first, it->second.second);
+        ctx->hashed += it->second.second;
+        free(it->second.first);
+        if (ret != 0) {
+            ctx->fail();
+            ctx->pending.erase(it);
+            return false;
+        }
+    }
+    ctx->cond.notify_all();
+    return false;
+}
 
-    while (!dl_list.empty()) {
-        if (running != 1) {
-            LOG_WARN("image exited, background download exit...");
-            break;
+DownloadScheduler::~DownloadScheduler() {
+    m_stop = true;
+    m_cond.notify_all();
+    if (m_th != nullptr)
+        photon::thread_join(m_th);
+    for (auto &t : m_tasks)
+        delete t.dl;
+}
+
+void DownloadScheduler::submit(std::list<BkDownload *> &tasks, uint64_t delay_sec) {
+    for (auto dl : tasks)
+        m_tasks.push_back({dl, photon::now + delay_sec * 1000000});
+    tasks.clear();
+    if (m_th == nullptr) {
+        m_th = photon::thread_enable_join(photon::thread_create11(&DownloadScheduler::run, this));
+    }
+    m_cond.notify_all();
+}
+
+void DownloadScheduler::cancel(const ImageFile *image) {
+    while (m_current != nullptr && m_current->owned_by(image))
+        m_cond.wait_no_lock();
+    for (auto it = m_tasks.begin(); it != m_tasks.end();) {
+        if (it->dl->owned_by(image)) {
+            delete it->dl;
+            it = m_tasks.erase(it);
+        } else {
+            ++it;
         }
+    }
+}
+
+bool DownloadScheduler::admit(BkDownload *task) {
+    bool paused = false;
+    while (!m_stop && !task->exited()) {
+        if (m_foreground == nullptr || m_pause_latency_us == 0 ||
+            (uint64_t)m_foreground->latency.val() <= m_pause_latency_us) {
+            if (paused)
+                LOG_INFO("resume background downloading of `", task->dir);
+            return true;
+        }
+        if (!paused)
+            LOG_INFO("pause background downloading of ` for slow foreground reads", task->dir);
+        paused = true;
         photon::thread_usleep(200 * 1000);
+    }
+    return false;
+}
 
-        BKDL::BkDownload *dl_item = dl_list.front();
-        dl_list.pop_front();
+// Ready tasks of layers downloaded already come first, as they are only linked, and then the
+// one read the most in foreground.
+std::list<DownloadScheduler::Task>::iterator DownloadScheduler::pick() {
+    auto best = m_tasks.end();
+    uint64_t best_heat = 0;
+    for (auto it = m_tasks.begin(); it != m_tasks.end(); ++it) {
+        if (it->ready_time > photon::now || it->dl->exited())
+            continue;
+        if (m_downloaded.count(it->dl->get_digest()))
+            return it;
+        auto heat = it->dl->heat();
+        if (best == m_tasks.end() || heat > best_heat) {
+            best = it;
+            best_heat = heat;
+        }
+    }
+    return best;
+}
 
-        LOG_INFO("start downloading for dir `", dl_item->dir);
+// the earliest time that a waiting task gets ready, or UINT64_MAX if there is none
+uint64_t DownloadScheduler::next_ready_time() const {
+    uint64_t next = UINT64_MAX;
+    for (auto &t : m_tasks) {
+        if (!t.dl->exited())
+            next = std::min(next, t.ready_time);
+    }
+    return next;
+}
 
+void DownloadScheduler::run() {
+    LOG_INFO("BACKGROUND DOWNLOAD SCHEDULER STARTED.");
+    while (!m_stop) {
+        auto it = pick();
+        if (it == m_tasks.end()) {
+            // sleeps till the next task gets ready, or new ones are submitted
+            auto next = next_ready_time();
+            if (next == UINT64_MAX)
+                m_cond.wait_no_lock();
+            else if (next > photon::now)
+                m_cond.wait_no_lock(next - photon::now);
+            continue;
+        }
+        BkDownload *dl_item = it->dl;
+        m_tasks.erase(it);
         if (!dl_item->lock_file()) {
-            dl_list.push_back(dl_item);
+            m_tasks.push_back({dl_item, photon::now + 200 * 1000});
             continue;
         }
 
-        bool succ = dl_item->download();
+        LOG_INFO("start downloading for dir `, heat `", dl_item->dir, dl_item->heat());
+        m_current = dl_item;
+        dl_item->scheduler = this;
+        // one layer at a time, so the budget is shared by all the images
+        auto &limit = dl_item->limit_MB_ps;
+        if (m_limit_MB_ps > 0 && (limit <= 0 || limit > m_limit_MB_ps))
+            limit = m_limit_MB_ps;
+        auto done = m_downloaded.find(dl_item->get_digest());
+        bool succ = (done != m_downloaded.end() && !check_downloaded(dl_item->dir) &&
+                     dl_item->link_from(done->second)) ||
+                    dl_item->download();
         dl_item->unlock_file();
+        if (succ)
+            m_downloaded[dl_item->get_digest()] = dl_item->dir;
 
-        if (running != 1) {
-            LOG_WARN("image exited, background download exit...");
-            delete dl_item;
-            break;
-        }
-
-        if (!succ && dl_item->try_cnt > 0) {
-            dl_list.push_back(dl_item);
+        if (!succ && dl_item->try_cnt > 0 && !dl_item->exited() && !m_stop) {
+            m_tasks.push_back({dl_item, photon::now});
             LOG_WARN("download failed, push back to download queue and retry `", dl_item->dir);
-            continue;
-        }
-        LOG_DEBUG("finish downloading or no retry any more: `, retry_cnt: `", dl_item->dir,
-                  dl_item->try_cnt);
-        delete dl_item;
-    }
-
-    if (!dl_list.empty()) {
-        LOG_INFO("DOWNLOAD THREAD EXITED in advance, delete dl_list.");
-        while (!dl_list.empty()) {
-            BKDL::BkDownload *dl_item = dl_list.front();
-            dl_list.pop_front();
+        } else {
+            LOG_DEBUG("finish downloading or no retry any more: `, retry_cnt: `", dl_item->dir,
+                      dl_item->try_cnt);
             delete dl_item;
         }
+        // the image of the task may be gone once notified
+        m_current = nullptr;
+        m_cond.notify_all();
     }
-    LOG_INFO("BACKGROUND DOWNLOAD THREAD EXIT.");
+    LOG_INFO("BACKGROUND DOWNLOAD SCHEDULER EXIT.");
 }
 
 } // namespace BKDL
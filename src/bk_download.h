@@ -15,12 +15,16 @@
 */
 #pragma once
 #include <list>
+#include <map>
 #include <string>
 #include <cstdint>
 #include <photon/fs/filesystem.h>
+#include <photon/thread/thread.h>
 
 class ImageFile;
 class ISwitchFile;
+struct MetricMeta;
+class MetricFile;
 
 namespace BKDL {
 
@@ -28,6 +32,8 @@ static std::string DOWNLOAD_TMP_NAME = ".download";
 
 bool check_downloaded(const std::string &dir);
 
+class DownloadScheduler;
+
 class BkDownload {
 public:
     std::string dir;
@@ -36,6 +42,29 @@ public:
     bool download();
     bool lock_file();
     void unlock_file();
+    // takes the layer downloaded in another dir by a hard link, instead of downloading it
+    bool link_from(const std::string &src_dir);
+
+    const std::string &get_digest() const {
+        return digest;
+    }
+    // the digest hashed while downloading by the last download(), if it didn't read back the
+    // whole file to hash it
+    const std::string &get_streamed_digest() const {
+        return streamed_digest;
+    }
+    bool owned_by(const ImageFile *image) const {
+        return owner == image;
+    }
+    bool exited() const {
+        return running != 1;
+    }
+    // the file of the layer read in foreground, to rank the downloads, or nullptr if the reads
+    // aren't counted by a MetricFS
+    void set_heat_source(MetricFile *file) {
+        heat_file = file;
+    }
+    uint64_t heat();
 
     BkDownload() = delete;
     ~BkDownload() {
@@ -44,15 +73,20 @@ public:
     }
     BkDownload(ISwitchFile *sw_file, photon::fs::IFile *src_file, size_t file_size,
                const std::string &dir, const std::string &digest, const std::string &url,
-               int &running, int32_t limit_MB_ps, int32_t try_cnt, uint32_t bs)
+               int &running, const ImageFile *owner, int32_t limit_MB_ps, int32_t try_cnt,
+               uint32_t bs, int32_t concurrency = 1)
         : dir(dir), try_cnt(try_cnt), sw_file(sw_file), src_file(src_file),
-          file_size(file_size), digest(digest), url(url), running(running),
-          limit_MB_ps(limit_MB_ps), block_size(bs) {
+          file_size(file_size), digest(digest), url(url), running(running), owner(owner),
+          limit_MB_ps(limit_MB_ps), block_size(bs), concurrency(concurrency) {
     }
 
 private:
+    struct DownloadContext;
+
     void switch_to_local_file();
     bool download_blob();
+    void download_blocks(DownloadContext *ctx);
+    bool hash_block(DownloadContext *ctx, off_t offset, void *buf, size_t count);
     bool download_done();
 
     ISwitchFile *sw_file = nullptr;
@@ -61,11 +95,55 @@ private:
     std::string digest;
     std::string url;
     int &running;
+    const ImageFile *owner;
     int32_t limit_MB_ps;
     uint32_t block_size;
+    int32_t concurrency;
     bool force_download = false;
+    MetricFile *heat_file = nullptr;    // owned by external class
+    DownloadScheduler *scheduler = nullptr;
+    friend class DownloadScheduler;
+    std::string streamed_digest; // of the last download_blob()
 };
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &, uint64_t, int &);
+// Runs the background downloads of all the images on a node, one layer at a time within the
+// bandwidth budget, so the hottest layers are downloaded first. A layer is downloaded only once
+// even if several images use it, and the download is paused while the latency of foreground
+// reads is over `pause_latency_us`.
+class DownloadScheduler {
+public:
+    DownloadScheduler(int32_t limit_MB_ps, uint64_t pause_latency_us, MetricMeta *foreground)
+        : m_limit_MB_ps(limit_MB_ps), m_pause_latency_us(pause_latency_us),
+          m_foreground(foreground) {
+    }
+    ~DownloadScheduler();
+
+    // takes the ownership of the tasks, which are ready after `delay_sec`
+    void submit(std::list<BkDownload *> &tasks, uint64_t delay_sec);
+    // drops the tasks of an image, waiting for the running one to exit
+    void cancel(const ImageFile *image);
+    // blocks while foreground reads are slow, returns false if `task` should stop
+    bool admit(BkDownload *task);
+
+private:
+    struct Task {
+        BkDownload *dl;
+        uint64_t ready_time;
+    };
+    std::list<Task> m_tasks;
+    BkDownload *m_current = nullptr;
+    // dirs of the layers downloaded, by digest
+    std::map<std::string, std::string> m_downloaded;
+    int32_t m_limit_MB_ps;
+    uint64_t m_pause_latency_us;
+    MetricMeta *m_foreground;
+    photon::join_handle *m_th = nullptr;
+    photon::condition_variable m_cond;
+    bool m_stop = false;
+
+    void run();
+    std::list<Task>::iterator pick();
+    uint64_t next_ready_time() const;
+};
 
 } // namespace BKDL
\ No newline at end of file
@@ -53,6 +53,8 @@ struct DownloadConfig : public ConfigUtils::Config {
     APPCFG_PARA(maxMBps, int, 100);
     APPCFG_PARA(tryCnt, int, 5);
     APPCFG_PARA(blockSize, uint32_t, 262144);
+    APPCFG_PARA(concurrency, int, 4);
+    APPCFG_PARA(pauseLatencyUs, uint32_t, 0);
 };
 
 struct ImageConfig : public ConfigUtils::Config {
@@ -65,6 +67,7 @@ struct ImageConfig : public ConfigUtils::Config {
     APPCFG_PARA(download, DownloadConfig);
     APPCFG_PARA(accelerationLayer, bool, false);
     APPCFG_PARA(recordTracePath, std::string, "");
+    APPCFG_PARA(zfileCacheSizeMB, uint32_t, 0);
 };
 
 struct P2PConfig : public ConfigUtils::Config {
@@ -107,6 +110,9 @@ struct CacheConfig : public ConfigUtils::Config {
     APPCFG_PARA(cacheSizeGB, uint32_t, 4);
     APPCFG_PARA(refillSize, uint32_t, 262144);
     APPCFG_PARA(blockSize, uint32_t, 65536);
+    APPCFG_PARA(evictionPolicy, std::string, "lru");
+    APPCFG_PARA(memoryCacheSizeMB, uint32_t, 0);
+    APPCFG_PARA(maxRefillSize, uint32_t, 0);
 };
 
 struct LogConfig : public ConfigUtils::Config {
@@ -124,6 +130,20 @@ struct PrefetchConfig : public ConfigUtils::Config {
     APPCFG_PARA(concurrency, int, 16);
 };
 
+struct ZFileConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(decompressWorkers, int, 0);
+};
+
+struct LsmtConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(readConcurrency, int, 1);
+    APPCFG_PARA(mmapIndex, bool, false);
+    APPCFG_PARA(shareIndex, bool, false);
+};
+
 struct CertConfig : public ConfigUtils::Config {
     APPCFG_CLASS
 
@@ -149,10 +169,15 @@ struct GlobalConfig : public ConfigUtils::Config {
     APPCFG_PARA(exporterConfig, ExporterConfig);
     APPCFG_PARA(auditPath, std::string, "/var/log/overlaybd-audit.log");
     APPCFG_PARA(registryFsVersion, std::string, "v2");
+    APPCFG_PARA(registryRangeGap, uint32_t, 65536);
+    APPCFG_PARA(registryMultiRange, bool, true);
+    APPCFG_PARA(registryMaxConnsPerHost, uint32_t, 0);
     APPCFG_PARA(cacheConfig, CacheConfig);
     APPCFG_PARA(gzipCacheConfig, GzipCacheConfig);
     APPCFG_PARA(logConfig, LogConfig);
     APPCFG_PARA(prefetchConfig, PrefetchConfig);
+    APPCFG_PARA(lsmtConfig, LsmtConfig);
+    APPCFG_PARA(zfileConfig, ZFileConfig);
     APPCFG_PARA(certConfig, CertConfig);
     APPCFG_PARA(userAgent, std::string, OVERLAYBD_VERSION);
 };
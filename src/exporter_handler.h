@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <functional>
+#include <vector>
 #include <photon/common/conststr.h>
 #include <photon/common/estring.h>
 #include <photon/common/metric-meter/metrics.h>
@@ -49,11 +51,20 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
     EXPOSE_PHOTON_METRICLIST(latency, Metric::MaxLatencyCounter);
     EXPOSE_PHOTON_METRICLIST(count, Metric::AddCounter);
     EXPOSE_PHOTON_METRICLIST(cache, Metric::ValueCounter);
+    EXPOSE_PHOTON_METRICLIST(conn, Metric::ValueCounter);
+    // update the gauges before rendering
+    std::vector<std::function<void()>> refreshers;
+
+    void add_refresh(std::function<void()> fn) {
+        refreshers.push_back(std::move(fn));
+    }
 
     template <typename... Args>
     ExposeRender(Args&&... args) {}
 
     std::string render() {
+        for (auto &refresh : refreshers)
+            refresh();
         EXPOSE_TEMPLATE(alive, OverlayBD_Alive : gauge{node});
         EXPOSE_TEMPLATE(throughput, OverlayBD_Read_Throughtput
                         : gauge{node, type, mode} #Bytes / sec);
@@ -61,6 +72,8 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
         EXPOSE_TEMPLATE(latency, OverlayBD_MaxLatency
                         : gauge{node, type, mode} #us);
         EXPOSE_TEMPLATE(count, OverlayBD_Count : gauge{node, type} #Bytes);
+        EXPOSE_TEMPLATE(cache, OverlayBD_Cache : gauge{node, type} #Bytes);
+        EXPOSE_TEMPLATE(conn, OverlayBD_Registry_Connection : gauge{node, type});
         std::string ret(alive.help_str());
         ret.append("\n")
             .append(alive.type_str())
@@ -71,6 +84,8 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
         LOOP_APPEND_METRIC(ret, qps);
         LOOP_APPEND_METRIC(ret, latency);
         LOOP_APPEND_METRIC(ret, count);
+        LOOP_APPEND_METRIC(ret, cache);
+        LOOP_APPEND_METRIC(ret, conn);
         return ret;
     }
 
@@ -29,6 +29,8 @@
 class OverlayBDMetric {
 public:
     MetricMeta pread, download;
+    Metric::ValueCounter refill_window;
+    Metric::ValueCounter pool_hit, handshake;
 
     ExposeMetrics::ExposeRender exporter;
 
@@ -41,6 +43,9 @@ public:
         exporter.add_latency("download", download.latency);
         exporter.add_qps("download", download.qps);
         exporter.add_count("download", download.total);
+        exporter.add_cache("refill_window", refill_window);
+        exporter.add_conn("pool_hit", pool_hit);
+        exporter.add_conn("handshake", handshake);
     }
 };
 
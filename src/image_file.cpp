@@ -24,6 +24,7 @@
 
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
+#include <photon/common/utility.h>
 #include <photon/fs/filesystem.h>
 #include <photon/fs/aligned-file.h>
 #include <photon/fs/localfs.h>
@@ -33,6 +34,7 @@
 #include "config.h"
 #include "image_file.h"
 #include "switch_file.h"
+#include "metrics_fs.h"
 #include "overlaybd/gzip/gz.h"
 #include "overlaybd/gzindex/gzfile.h"
 #include "overlaybd/tar/tar_file.h"
@@ -82,7 +84,8 @@ IFile *ImageFile::__open_ro_file(const std::string &path) {
     }
     file = tar_file;
     // set to local, no need to switch, for zfile and audit
-    ISwitchFile *switch_file = new_switch_file(file, true, path.c_str());
+    ISwitchFile *switch_file = new_switch_file(file, true, path.c_str(),
+                                               (size_t)conf.zfileCacheSizeMB() << 20);
     if (!switch_file) {
         set_failed("failed to open switch file " + path);
         delete file;
@@ -182,7 +185,8 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
         LOG_ERRNO_RETURN(0, nullptr, "failed to open remote file as tar file `: `", url, err_msg);
     }
 
-    ISwitchFile *switch_file = new_switch_file(tar_file, false, url.c_str());
+    ISwitchFile *switch_file = new_switch_file(tar_file, false, url.c_str(),
+                                               (size_t)conf.zfileCacheSizeMB() << 20);
     if (!switch_file) {
         set_failed("failed to open switch file ", url);
         delete tar_file;
@@ -196,8 +200,11 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
             LOG_WARN("failed to open source file, ignore download");
         } else {
             BKDL::BkDownload *obj = new BKDL::BkDownload(
-                switch_file, srcfile, size, dir, digest, url, m_status, conf.download().maxMBps(),
-                conf.download().tryCnt(), conf.download().blockSize());
+                switch_file, srcfile, size, dir, digest, url, m_status, this,
+                conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize(),
+                conf.download().concurrency());
+            // reads are counted only if the remote fs is wrapped by a MetricFS
+            obj->set_heat_source(dynamic_cast<MetricFile *>(remote_file));
             LOG_DEBUG("add to download list for `", dir);
             dl_list.push_back(obj);
         }
@@ -215,10 +222,10 @@ void ImageFile::start_bk_dl_thread() {
     uint64_t extra_range = conf.download().delayExtra();
     extra_range = (extra_range <= 0) ? 30 : extra_range;
     uint64_t delay_sec = (rand() % extra_range) + conf.download().delay();
-    LOG_INFO("background download is enabled, delay `, maxMBps `, tryCnt `, blockSize `", delay_sec,
-             conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize());
-    dl_thread_jh = photon::thread_enable_join(
-        photon::thread_create11(&BKDL::bk_download_proc, dl_list, delay_sec, m_status));
+    LOG_INFO("background download is enabled, delay `, maxMBps `, tryCnt `, blockSize `, "
+             "concurrency `", delay_sec, conf.download().maxMBps(), conf.download().tryCnt(),
+             conf.download().blockSize(), conf.download().concurrency());
+    image_service.dl_scheduler->submit(dl_list, delay_sec);
 }
 
 struct ParallelOpenTask {
@@ -226,6 +233,8 @@ struct ParallelOpenTask {
     int eno = 0;
     int i = 0, nlayers;
     std::vector<ImageConfigNS::LayerConfig> &layers;
+    std::vector<int> &index_fds;
+    std::vector<LSMT::LayerIndex *> &layer_indexes;
 
     int get_next_job_index() {
         LOG_DEBUG("create job, layer_id: `", i);
@@ -241,8 +250,10 @@ struct ParallelOpenTask {
     }
 
     ParallelOpenTask(std::vector<IFile *> &files, size_t nlayers,
-                     std::vector<ImageConfigNS::LayerConfig> &layers)
-        : files(files), nlayers(nlayers), layers(layers) {
+                     std::vector<ImageConfigNS::LayerConfig> &layers, std::vector<int> &index_fds,
+                     std::vector<LSMT::LayerIndex *> &layer_indexes)
+        : files(files), nlayers(nlayers), layers(layers), index_fds(index_fds),
+          layer_indexes(layer_indexes) {
     }
 };
 
@@ -253,7 +264,8 @@ void *do_parallel_open_files(ImageFile *imgfile, ParallelOpenTask &tm) {
             // error occured from another threads.
             return nullptr;
         }
-        int ret = imgfile->open_lower_layer(tm.files[idx], tm.layers[idx], idx);
+        int ret = imgfile->open_lower_layer(tm.files[idx], tm.layers[idx], idx, &tm.index_fds[idx],
+                                            &tm.layer_indexes[idx]);
         if (ret < 0) {
             tm.set_error(errno);
             LOG_ERROR_RETURN(0, nullptr, "failed to open files");
@@ -279,9 +291,11 @@ IFile *ImageFile::open_localfile(ImageConfigNS::LayerConfig &layer, std::string
     }
     return nullptr;
 }
-int ImageFile::open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer, int index) {
+int ImageFile::open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer, int index,
+                                int *index_fd, LSMT::LayerIndex **layer_index) {
     std::string opened;
     file = open_localfile(layer, opened); // try to open localfile if downloaded
+    bool local = (file != nullptr);
     if (file == nullptr) {
         opened = layer.digest();
         file = __open_ro_remote(layer.dir(), layer.digest(), layer.size(), index);
@@ -317,12 +331,27 @@ int ImageFile::open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer,
     }
     if (target_file != nullptr) {
         file = LSMT::open_warpfile_ro(file, target_file, true);
+    } else if (local && index_fd && image_service.global_conf.lsmtConfig().mmapIndex()) {
+        // LSMT checks that the fd holds the same bytes as the file before mapping,
+        // so a tar-wrapped or compressed layer just falls back to loading
+        *index_fd = ::open(opened.c_str(), O_RDONLY | O_CLOEXEC);
     }
-    if (file != nullptr) {
-        LOG_DEBUG("layer index: `, open(`) success", index, opened);
-        return 0;
+    if (file == nullptr) {
+        return -1;
     }
-    return -1;
+    LOG_DEBUG("layer index: `, open(`) success", index, opened);
+    if (target_file == nullptr && layer_index && layer.digest() != "" &&
+        image_service.global_conf.lsmtConfig().shareIndex()) {
+        // a failure here isn't fatal, the index is then loaded by open_files_ro()
+        int fd = index_fd ? *index_fd : -1;
+        auto li = image_service.layer_indexes.acquire(
+            layer.digest(), [&]() { return LSMT::load_layer_index(file, fd); });
+        if (li) {
+            *layer_index = li;
+            m_layer_index_keys.push_back(layer.digest());
+        }
+    }
+    return 0;
 }
 
 LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &lowers,
@@ -333,13 +362,22 @@ LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &l
     if (lowers.size() == 0)
         return NULL;
 
+    // the shared indexes are only read by the merge of open_files_ro(), so they are released
+    // right after it, and kept by layer_indexes for a while to be reused by the next opens
+    DEFER({
+        for (auto &key : m_layer_index_keys)
+            image_service.layer_indexes.release(key);
+        m_layer_index_keys.clear();
+    });
     photon::join_handle *ths[PARALLEL_LOAD_INDEX];
     std::vector<IFile *> files;
     files.resize(lowers.size(), nullptr);
+    std::vector<int> index_fds(lowers.size(), -1);
+    std::vector<LSMT::LayerIndex *> layer_indexes(lowers.size(), nullptr);
     auto n = std::min(PARALLEL_LOAD_INDEX, (int)lowers.size());
     LOG_DEBUG("create ` photon threads to open lowers", n);
 
-    ParallelOpenTask tm(files, lowers.size(), lowers);
+    ParallelOpenTask tm(files, lowers.size(), lowers, index_fds, layer_indexes);
     for (auto i = 0; i < n; ++i) {
         ths[i] =
             photon::thread_enable_join(photon::thread_create11(&do_parallel_open_files, this, tm));
@@ -358,7 +396,13 @@ LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &l
             goto ERROR_EXIT;
         }
     }
-    ret = LSMT::open_files_ro((IFile **)&(files[0]), lowers.size(), true);
+    ret = LSMT::open_files_ro((IFile **)&(files[0]), lowers.size(), true, &index_fds[0],
+                              &layer_indexes[0]);
+    for (auto fd : index_fds) {
+        if (fd >= 0)
+            ::close(fd);
+    }
+    index_fds.assign(lowers.size(), -1);
     if (!ret) {
         LOG_ERROR("LSMT::open_files_ro(files, `, `) return NULL", lowers.size(), true);
         goto ERROR_EXIT;
@@ -374,6 +418,8 @@ ERROR_EXIT:
     for (size_t i = 0; i < lowers.size(); i++) {
         if (files[i] != NULL)
             delete files[i];
+        if (index_fds[i] >= 0)
+            ::close(index_fds[i]);
     }
     has_error = true;
     return NULL;
@@ -502,6 +548,12 @@ int ImageFile::init_image_file() {
     read_only = false;
 
 SUCCESS_EXIT:
+    if (m_file != nullptr) {
+        auto read_concurrency = image_service.global_conf.lsmtConfig().readConcurrency();
+        if (read_concurrency > 1) {
+            ((LSMT::IFileRO *)m_file)->set_max_io_concurrency(read_concurrency);
+        }
+    }
     if (conf.download().enable() && !record_no_download) {
         start_bk_dl_thread();
     }
@@ -516,8 +568,8 @@ ERROR_EXIT:
     return -1;
 }
 
-int ImageFile::compact(IFile *as) {
-    return ((LSMT::IFileRO*)m_file)->flatten(as);
+int ImageFile::compact(const LSMT::CommitArgs &args) {
+    return ((LSMT::IFileRO*)m_file)->flatten(args);
 }
 
 void ImageFile::set_auth_failed() {
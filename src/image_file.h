@@ -55,8 +55,10 @@ public:
 
     ~ImageFile() {
         m_status = -1;
-        if (dl_thread_jh != nullptr)
-            photon::thread_join(dl_thread_jh);
+        if (image_service.dl_scheduler != nullptr)
+            image_service.dl_scheduler->cancel(this);
+        for (auto dl : dl_list)
+            delete dl;
         delete m_prefetcher;
         if (m_file) {
             m_file->close();
@@ -94,7 +96,8 @@ public:
     }
 
     void set_auth_failed();
-    int open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer, int index);
+    int open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer, int index,
+                         int *index_fd = nullptr, LSMT::LayerIndex **layer_index = nullptr);
 
     std::string m_exception;
     int m_status = 0; // 0: not started, 1: running, -1 exit
@@ -109,14 +112,15 @@ public:
         return m_file;
     }
 
-    int compact(IFile *as);
+    int compact(const LSMT::CommitArgs &args);
 
 private:
     Prefetcher *m_prefetcher = nullptr;
     ImageConfigNS::ImageConfig conf;
     std::list<BKDL::BkDownload *> dl_list;
-    photon::join_handle *dl_thread_jh = nullptr;
     ImageService &image_service;
+    // digests of the layers whose indexes are held in image_service.layer_indexes while opening
+    std::vector<std::string> m_layer_index_keys;
 
     int init_image_file();
     template<typename...Ts> void set_failed(const Ts&...xs);
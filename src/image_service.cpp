@@ -26,6 +26,7 @@
 #include <photon/net/socket.h>
 #include <photon/thread/thread.h>
 #include "overlaybd/cache/cache.h"
+#include "overlaybd/cache/policy/policy.h"
 #include "overlaybd/registryfs/registryfs.h"
 #include "overlaybd/zfile/zfile.h"
 #include "overlaybd/base64.h"
@@ -327,6 +328,15 @@ int ImageService::init() {
     if (cache_type != "file" && cache_type != "ocf" && cache_type != "download") {
         LOG_ERROR_RETURN(0, -1, "unknown cache type: `", cache_type);
     }
+    int eviction_policy;
+    auto eviction_policy_name = global_conf.cacheConfig().evictionPolicy();
+    if (eviction_policy_name == "lru") {
+        eviction_policy = FileSystem::EVICTION_POLICY_LRU;
+    } else if (eviction_policy_name == "slru") {
+        eviction_policy = FileSystem::EVICTION_POLICY_SLRU;
+    } else {
+        LOG_ERROR_RETURN(0, -1, "unknown eviction policy: `", eviction_policy_name);
+    }
     LOG_INFO("cache config: ", VALUE(cache_type), VALUE(cache_dir),
                                VALUE(cache_size_GB), VALUE(refill_size));
 
@@ -353,8 +363,22 @@ int ImageService::init() {
         if (global_fs.underlay_registryfs == nullptr) {
             LOG_ERROR_RETURN(0, -1, "create registryfs failed.");
         }
+        auto registryfs = (RegistryFS *)global_fs.underlay_registryfs;
+        if (global_conf.registryFsVersion() == "v2") {
+            registryfs->setRangeOptions(global_conf.registryRangeGap(),
+                                        global_conf.registryMultiRange());
+            registryfs->setConnectionPool(global_conf.registryMaxConnsPerHost());
+        }
         if (global_conf.exporterConfig().enable()) {
             metrics.reset(new OverlayBDMetric());
+            auto m = metrics.get();
+            m->exporter.add_refresh([m, registryfs]() {
+                uint64_t hits, handshakes;
+                if (registryfs->getConnectionStats(&hits, &handshakes) == 0) {
+                    m->pool_hit.set(hits);
+                    m->handshake.set(handshakes);
+                }
+            });
             global_fs.srcfs = new MetricFS(global_fs.underlay_registryfs, &metrics->download);
             exporter = new ExporterServer(global_conf, metrics.get());
             if (!exporter->ready)
@@ -363,10 +387,6 @@ int ImageService::init() {
             global_fs.srcfs = global_fs.underlay_registryfs;
         }
 
-        if (global_conf.enableThread() == true && cache_type == "file") {
-            LOG_ERROR_RETURN(0, -1, "multi-thread has not been valid for file cache");
-        }
-
         global_fs.io_alloc = new IOAlloc;
 
         if (cache_type == "file") {
@@ -378,7 +398,26 @@ int ImageService::init() {
             // file cache will delete its src_fs automatically when destructed
             global_fs.cached_fs = FileSystem::new_full_file_cached_fs(
                 global_fs.srcfs, registry_cache_fs, refill_size, cache_size_GB, 10000000,
-                (uint64_t)1048576 * 1024, global_fs.io_alloc, 0, {nullptr, &cache_fn_trans_sha256});
+                (uint64_t)1048576 * 1024, global_fs.io_alloc, 0, {nullptr, &cache_fn_trans_sha256},
+                eviction_policy);
+            auto memory_cache_size_MB = global_conf.cacheConfig().memoryCacheSizeMB();
+            if (global_fs.cached_fs && memory_cache_size_MB > 0 &&
+                global_fs.cached_fs->get_pool()->resize(memory_cache_size_MB * 1024UL * 1024,
+                                                        RSZ_MEMORY) != 0) {
+                LOG_ERRNO_RETURN(0, -1, "failed to set memory cache size to ` MB",
+                                 memory_cache_size_MB);
+            }
+            auto max_refill_size = global_conf.cacheConfig().maxRefillSize();
+            if (global_fs.cached_fs && max_refill_size > refill_size) {
+                auto pool = global_fs.cached_fs->get_pool();
+                pool->set_refill_window(refill_size, max_refill_size);
+                if (metrics) {
+                    auto m = metrics.get();
+                    m->exporter.add_refresh([m, pool]() {
+                        m->refill_window.set(pool->get_refill_window());
+                    });
+                }
+            }
 
         } else if (cache_type == "ocf") {
             auto namespace_dir = std::string(cache_dir + "/namespace");
@@ -440,6 +479,15 @@ int ImageService::init() {
                 10000000, (uint64_t)1048576 * 4096, global_fs.io_alloc);
         }
     }
+
+    auto decompress_workers = global_conf.zfileConfig().decompressWorkers();
+    if (decompress_workers > 0 && ZFile::zfile_set_decompress_workers(decompress_workers) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to create zfile decompress workers");
+    }
+
+    dl_scheduler = new BKDL::DownloadScheduler(global_conf.download().maxMBps(),
+                                               global_conf.download().pauseLatencyUs(),
+                                               metrics ? &metrics->pread : nullptr);
     return 0;
 }
 
@@ -491,11 +539,13 @@ ImageFile *ImageService::create_image_file(const char *config_path) {
     return ret;
 }
 
-ImageService::ImageService(const char *config_path) {
+ImageService::ImageService(const char *config_path)
+    : layer_indexes(60UL * 1000 * 1000) {
     m_config_path = config_path ? config_path : DEFAULT_CONFIG_PATH;
 }
 
 ImageService::~ImageService() {
+    delete dl_scheduler;
     delete global_fs.media_file;
     delete global_fs.namespace_fs;
     delete global_fs.cached_fs;
@@ -503,6 +553,7 @@ ImageService::~ImageService() {
     delete global_fs.srcfs;
     delete global_fs.io_alloc;
     delete exporter;
+    ZFile::zfile_set_decompress_workers(0);
     LOG_INFO("image service is fully stopped");
 }
 
@@ -22,6 +22,7 @@
 #include "overlaybd/cache/gzip_cache/cached_fs.h"
 #include <photon/fs/filesystem.h>
 #include <photon/common/io-alloc.h>
+#include <photon/common/expirecontainer.h>
 
 using namespace photon::fs;
 
@@ -48,6 +49,12 @@ struct ImageAuthResponse : public ConfigUtils::Config {
 };
 
 struct ImageFile;
+namespace LSMT {
+struct LayerIndex;
+}
+namespace BKDL {
+class DownloadScheduler;
+}
 
 class ImageService {
 public:
@@ -63,6 +70,11 @@ public:
     struct GlobalFs global_fs;
     std::unique_ptr<OverlayBDMetric> metrics;
     ExporterServer *exporter = nullptr;
+    // indexes of lower layers keyed by digest, shared by all the image files,
+    // kept for 60s after the last open
+    ObjectCache<std::string, LSMT::LayerIndex *> layer_indexes;
+    // background downloads of all the image files
+    BKDL::DownloadScheduler *dl_scheduler = nullptr;
 
 private:
     int read_global_config_and_set();
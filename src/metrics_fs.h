@@ -18,6 +18,7 @@
 
 #include <photon/common/metric-meter/metrics.h>
 #include <photon/fs/forwardfs.h>
+#include "overlaybd/registryfs/registryfs.h"
 
 struct MetricMeta {
     Metric::MaxLatencyCounter latency;
@@ -32,6 +33,7 @@ struct MetricMeta {
 class MetricFile : public photon::fs::ForwardFile_Ownership {
 public:
     MetricMeta *metrics;
+    uint64_t read_bytes = 0; // ranks the background downloads of the layer
 
     MetricFile(photon::fs::IFile *file, MetricMeta *metricMeta)
         : photon::fs::ForwardFile_Ownership(file, true), metrics(metricMeta) {}
@@ -41,9 +43,26 @@ public:
             metrics->throughput.put(ret);
             metrics->total.add(ret);
             metrics->interval.add(ret);
+            read_bytes += ret;
         }
     }
 
+    virtual int vioctl(int request, va_list args) override {
+        if (request == REGISTRY_PREAD_RANGES) {
+            auto ranges = va_arg(args, RegistryRange *);
+            auto n = va_arg(args, int);
+            if (n == 0)
+                return m_file->ioctl(request, ranges, n);
+            metrics->qps.put();
+            SCOPE_LATENCY(metrics->latency);
+            auto ret = m_file->ioctl(request, ranges, n);
+            for (int i = 0; ret == 0 && i < n; i++)
+                mark_metrics(ranges[i].count);
+            return ret;
+        }
+        return m_file->vioctl(request, args);
+    }
+
     virtual ssize_t pread(void *buf, size_t cnt, off_t offset) override {
         metrics->qps.put();
         SCOPE_LATENCY(metrics->latency);
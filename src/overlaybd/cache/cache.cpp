@@ -29,7 +29,7 @@ ICachedFileSystem *new_full_file_cached_fs(IFileSystem *srcFs, IFileSystem *medi
                                            uint64_t refillUnit, uint64_t capacityInGB,
                                            uint64_t periodInUs, uint64_t diskAvailInBytes,
                                            IOAlloc *allocator, int quotaDirLevel,
-                                           CacheFnTransFunc fn_trans_func) {
+                                           CacheFnTransFunc fn_trans_func, int evictionPolicy) {
     if (refillUnit % 4096 != 0 || !is_power_of_2(refillUnit)) {
         LOG_ERROR_RETURN(EINVAL, nullptr, "refill Unit need to be aligned to 4KB and power of 2")
     }
@@ -37,8 +37,8 @@ ICachedFileSystem *new_full_file_cached_fs(IFileSystem *srcFs, IFileSystem *medi
         allocator = new IOAlloc;
     }
     Cache::FileCachePool *pool = nullptr;
-    pool =
-        new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes, refillUnit);
+    pool = new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes,
+                                      refillUnit, evictionPolicy);
     pool->Init();
     return new_cached_fs(srcFs, pool, 4096, allocator, fn_trans_func);
 }
@@ -23,7 +23,7 @@
 
 #define O_WRITE_THROUGH 0x01000000 // write backing store and cache
 #define O_WRITE_AROUND 0x02000000  // write backing store only, default
-#define O_WRITE_BACK 0x04000000    // write cache and async flush to backing store, not support yet
+#define O_WRITE_BACK 0x04000000    // write cache and async flush to backing store
 #define O_CACHE_ONLY 0x08000000    // write cache only
 #define O_DIRECT_LOCAL 0x20000000  // read local
 #define O_MMAP_READ 0x00800000     // mmap like read
@@ -109,12 +109,14 @@ ICachedFileSystem *new_cached_fs(photon::fs::IFileSystem *src, ICachePool *pool,
 
 ICachedFile *new_cached_file(ICacheStore *store, uint64_t pageSize, photon::fs::IFileSystem *fs);
 
+// @param evictionPolicy one of FileSystem::EvictionPolicyType in policy/policy.h
 ICachedFileSystem *new_full_file_cached_fs(photon::fs::IFileSystem *srcFs,
                                            photon::fs::IFileSystem *media_fs, uint64_t refillUnit,
                                            uint64_t capacityInGB, uint64_t periodInUs,
                                            uint64_t diskAvailInBytes, IOAlloc *allocator,
                                            int quotaDirLevel,
-                                           CacheFnTransFunc fn_trans_func = nullptr);
+                                           CacheFnTransFunc fn_trans_func = nullptr,
+                                           int evictionPolicy = 0);
 
 /**
  * @param blk_size The proper size for cache metadata and IO efficiency. Large writes to cache media
@@ -266,6 +266,15 @@ public:
         return 0;
     }
 
+    // for O_WRITE_BACK, returns after the dirty data is written back and synced
+    int fsync() override {
+        return cache_store_->flush();
+    }
+
+    int fdatasync() override {
+        return cache_store_->flush();
+    }
+
     ssize_t read(void *buf, size_t count) override {
         struct iovec v {
             buf, count
@@ -382,8 +391,6 @@ public:
     }
 
     UNIMPLEMENTED(off_t lseek(off_t offset, int whence));
-    UNIMPLEMENTED(int fsync());
-    UNIMPLEMENTED(int fdatasync());
     UNIMPLEMENTED(int fchmod(mode_t mode));
     UNIMPLEMENTED(int fchown(uid_t owner, gid_t group));
     UNIMPLEMENTED(int fiemap(photon::fs::fiemap *map));
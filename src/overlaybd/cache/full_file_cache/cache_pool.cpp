@@ -18,6 +18,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <algorithm>
 #include <sys/statvfs.h>
 #include "cache_store.h"
@@ -35,12 +36,30 @@ using namespace photon::fs;
 const uint64_t kGB = 1024 * 1024 * 1024;
 const uint64_t kMaxFreeSpace = 50 * kGB;
 const int64_t kEvictionMark = 5ll * kGB;
+const char kCachedBlocksSuffix[] = ".cached_blocks";
+const uint64_t kCachedBlocksMagic = 0x736b636f6c426443; // "CdBlocks"
+
+struct CachedBlocksHeader {
+    uint64_t magic;
+    uint64_t blockSize;
+    uint64_t fileSize; // of the media file when the bitmap was saved
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t nwords;
+};
 
 FileCachePool::FileCachePool(IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                             uint64_t diskAvailInBytes, uint64_t refillUnit)
+                             uint64_t diskAvailInBytes, uint64_t refillUnit, int evictionPolicy)
     : ICachePool(0), mediaFs_(mediaFs), capacityInGB_(capacityInGB), periodInUs_(periodInUs),
       diskAvailInBytes_(diskAvailInBytes), refillUnit_(refillUnit), totalUsed_(0), timer_(nullptr),
-      running_(false), exit_(false), isFull_(false) {
+      running_(false), exit_(false), isFull_(false),
+      lru_(FileSystem::new_eviction_policy<FileNameMap::iterator, uint32_t>(evictionPolicy)),
+      memCache_(refillUnit) {
+    if (!lru_) {
+        LOG_WARN("unknown eviction policy `, fall back to lru", evictionPolicy);
+        lru_.reset(FileSystem::new_eviction_policy<FileNameMap::iterator, uint32_t>(
+            FileSystem::EVICTION_POLICY_LRU));
+    }
     int64_t capacityInBytes = capacityInGB_ * kGB;
     waterMark_ = calcWaterMark(capacityInBytes, kMaxFreeSpace);
     // keep this relation : waterMark < riskMark < capacity
@@ -67,21 +86,31 @@ void FileCachePool::Init() {
 }
 
 ICacheStore *FileCachePool::do_open(std::string_view pathname, int flags, mode_t mode) {
-    auto localFile = openMedia(pathname, flags, mode);
-    if (!localFile) {
-        return nullptr;
-    }
+    IFile *localFile;
+    FileNameMap::iterator find;
+    bool firstOpen = true;
+    {
+        // eviction may not unlink the media file until it is counted as open
+        photon::scoped_lock lock(lruLock_);
+        localFile = openMedia(pathname, flags, mode);
+        if (!localFile) {
+            return nullptr;
+        }
 
-    auto find = fileIndex_.find(pathname);
-    if (find == fileIndex_.end()) {
-        auto lruIter = lru_.push_front(fileIndex_.end());
-        std::unique_ptr<LruEntry> entry(new LruEntry{lruIter, 1, 0});
-        find = fileIndex_.emplace(pathname, std::move(entry)).first;
-        lru_.front() = find;
-    } else {
-        lru_.access(find->second->lruIter);
-        find->second->openCount++;
+        find = fileIndex_.find(pathname);
+        if (find == fileIndex_.end()) {
+            auto lruIter = lru_->push_front(fileIndex_.end());
+            std::unique_ptr<LruEntry> entry(new LruEntry{lruIter, 1, 0});
+            find = fileIndex_.emplace(pathname, std::move(entry)).first;
+            lru_->value(lruIter) = find;
+            find->second->lastHitInUs = photon::now;
+        } else {
+            referLru(find->second.get());
+            firstOpen = (find->second->openCount++ == 0);
+        }
     }
+    if (firstOpen)
+        loadCachedBlocks(find);
 
     return new FileCacheStore(this, localFile, refillUnit_, find);
 }
@@ -130,12 +159,113 @@ int FileCachePool::rename(std::string_view oldname, std::string_view newname) {
     return -1;
 }
 
+int FileCachePool::reset(int flags) {
+    if (!(flags & RST_MEMORY)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    memCache_.reset();
+    return 0;
+}
+
+int FileCachePool::resize(size_t n, int flags) {
+    if (!(flags & RSZ_MEMORY)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    memCache_.resize(n);
+    return 0;
+}
+
 bool FileCachePool::isFull() {
     return isFull_;
 }
 
 void FileCachePool::removeOpenFile(FileNameMap::iterator iter) {
-    iter->second->openCount--;
+    photon::scoped_lock lock(lruLock_);
+    if (--iter->second->openCount == 0)
+        saveCachedBlocks(iter);
+}
+
+std::string FileCachePool::cachedBlocksName(FileNameMap::iterator iter) {
+    return std::string(iter->first.data(), iter->first.size()) + kCachedBlocksSuffix;
+}
+
+void FileCachePool::loadCachedBlocks(FileNameMap::iterator iter) {
+    auto lruEntry = iter->second.get();
+    // exclusive with eviction, which drops the bitmap file and truncates the media file
+    photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+    auto name = cachedBlocksName(iter);
+    auto file = mediaFs_->open(name.c_str(), O_RDONLY, 0644);
+    if (file == nullptr)
+        return; // rebuilt from fiemap on the first query
+    DEFER({
+        delete file;
+        // from now on the bitmap only lives in memory
+        mediaFs_->unlink(name.c_str());
+    });
+    if (lruEntry->cachedBlocksReady)
+        return;
+
+    struct stat st = {}, mst = {};
+    if (file->fstat(&st) != 0 || mediaFs_->stat(iter->first.data(), &mst) != 0)
+        return;
+    if (st.st_size < (off_t)sizeof(CachedBlocksHeader) || st.st_size % kCachedBlockSize != 0)
+        return;
+    void *buf = nullptr;
+    if (posix_memalign(&buf, kCachedBlockSize, st.st_size) != 0)
+        return;
+    DEFER(free(buf));
+    if (file->pread(buf, st.st_size, 0) != st.st_size)
+        return;
+    auto header = (CachedBlocksHeader *)buf;
+    if (header->magic != kCachedBlocksMagic || header->blockSize != kCachedBlockSize ||
+        header->fileSize != (uint64_t)mst.st_size || header->mtimeSec != mst.st_mtim.tv_sec ||
+        header->mtimeNsec != mst.st_mtim.tv_nsec ||
+        sizeof(*header) + header->nwords * sizeof(uint64_t) > (uint64_t)st.st_size) {
+        LOG_WARN("stale cached blocks of `, rebuild from fiemap", iter->first);
+        return;
+    }
+    auto words = (uint64_t *)(header + 1);
+    photon::scoped_lock lock(lruEntry->bitmapLock);
+    lruEntry->cachedBlocks.words.assign(words, words + header->nwords);
+    lruEntry->cachedBlocksReady = true;
+}
+
+void FileCachePool::saveCachedBlocks(FileNameMap::iterator iter) {
+    auto lruEntry = iter->second.get();
+    if (!lruEntry->cachedBlocksReady || lruEntry->size == 0)
+        return;
+    struct stat mst = {};
+    if (mediaFs_->stat(iter->first.data(), &mst) != 0)
+        return;
+    photon::scoped_lock lock(lruEntry->bitmapLock);
+    auto &blocks = lruEntry->cachedBlocks.words;
+    size_t len = sizeof(CachedBlocksHeader) + blocks.size() * sizeof(uint64_t);
+    len = (len + kCachedBlockSize - 1) / kCachedBlockSize * kCachedBlockSize;
+    void *buf = nullptr;
+    if (posix_memalign(&buf, kCachedBlockSize, len) != 0)
+        return;
+    DEFER(free(buf));
+    memset(buf, 0, len);
+    auto header = (CachedBlocksHeader *)buf;
+    *header = {kCachedBlocksMagic, kCachedBlockSize, (uint64_t)mst.st_size,
+               mst.st_mtim.tv_sec, mst.st_mtim.tv_nsec, blocks.size()};
+    memcpy(header + 1, blocks.data(), blocks.size() * sizeof(uint64_t));
+
+    auto name = cachedBlocksName(iter);
+    auto file = mediaFs_->open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file == nullptr) {
+        ERRNO e;
+        LOG_ERROR("failed to open `, error code : `", name, e);
+        return;
+    }
+    DEFER(delete file);
+    if (file->pwrite(buf, len, 0) != (ssize_t)len) {
+        ERRNO e;
+        LOG_ERROR("failed to write `, error code : `", name, e);
+        mediaFs_->unlink(name.c_str());
+    }
 }
 
 void FileCachePool::forceRecycle() {
@@ -143,21 +273,81 @@ void FileCachePool::forceRecycle() {
 }
 
 void FileCachePool::updateLru(FileNameMap::iterator iter) {
-    lru_.access(iter->second->lruIter);
+    recordAccess(iter->second->lruIter, false);
+}
+
+void FileCachePool::updateLru(FileNameMap::iterator iter, off_t offset, size_t count, bool hit) {
+    recordAccess(iter->second->lruIter, hit);
+    if (count > 0) {
+        photon::scoped_lock lock(iter->second->bitmapLock);
+        iter->second->unitRefs.set(offset / refillUnit_, (offset + count - 1) / refillUnit_ + 1);
+    }
+}
+
+void FileCachePool::referLru(LruEntry *lruEntry) {
+    auto now = photon::now;
+    if (now - lruEntry->lastHitInUs >= kCorrelatedPeriodInUs)
+        lru_->access(lruEntry->lruIter);
+    else
+        lru_->requeue(lruEntry->lruIter);
+    lruEntry->lastHitInUs = now;
+}
+
+static uint32_t accessStripe() {
+    static std::atomic<uint32_t> next{0};
+    static thread_local uint32_t stripe = next++ % FileCachePool::kAccessStripes;
+    return stripe;
+}
+
+void FileCachePool::recordAccess(uint32_t lruIter, bool hit) {
+    auto &buf = accessBuffers_[accessStripe()];
+    auto tail = buf.tail.load(std::memory_order_relaxed);
+    auto pending = tail - buf.head.load(std::memory_order_acquire);
+    if (pending < AccessBuffer::kSize &&
+        buf.tail.compare_exchange_strong(tail, tail + 1, std::memory_order_relaxed)) {
+        buf.slots[tail % AccessBuffer::kSize].store((uint64_t)lruIter << 2 | (hit ? 2 : 0) | 1,
+                                                    std::memory_order_release);
+        pending++;
+    }
+    if (pending >= kDrainThreshold && lruLock_.try_lock() == 0) {
+        drainAccessBuffers();
+        lruLock_.unlock();
+    }
+}
+
+void FileCachePool::drainAccessBuffers() {
+    for (auto &buf : accessBuffers_) {
+        auto head = buf.head.load(std::memory_order_relaxed);
+        auto tail = buf.tail.load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+            auto v = buf.slots[head % AccessBuffer::kSize].exchange(0, std::memory_order_acquire);
+            if (v == 0) // reserved but not yet filled
+                break;
+            auto lruIter = (uint32_t)(v >> 2);
+            if (v & 2)
+                referLru(lru_->value(lruIter)->second.get());
+            else
+                lru_->requeue(lruIter);
+        }
+        buf.head.store(head, std::memory_order_release);
+    }
 }
 
 //  currently, we exist duplicate pwrite
 uint64_t FileCachePool::updateSpace(FileNameMap::iterator iter, uint64_t size) {
     auto lruEntry = iter->second.get();
     uint64_t diff = 0;
-    if (size > lruEntry->size) {
-        diff = size - lruEntry->size;
-        totalUsed_ += diff;
+    {
+        photon::scoped_lock lock(lruLock_);
+        if (size > lruEntry->size) {
+            diff = size - lruEntry->size;
+            totalUsed_ += diff;
+        }
+        lruEntry->size = size;
     }
-    lruEntry->size = size;
     if (totalUsed_ >= riskMark_) {
-        LOG_WARN("pwrite is so heavy, totalUsed:`,riskMark:` || lruEntry->size = `", totalUsed_,
-                 riskMark_, lruEntry->size);
+        LOG_WARN("pwrite is so heavy, totalUsed:`,riskMark:` || lruEntry->size = `",
+                 totalUsed_.load(), riskMark_, size);
         isFull_ = true;
         forceRecycle();
         if (lruEntry->size == 0)
@@ -169,10 +359,10 @@ uint64_t FileCachePool::updateSpace(FileNameMap::iterator iter, uint64_t size) {
 
 uint64_t FileCachePool::timerHandler(void *data) {
     auto cur = static_cast<FileCachePool *>(data);
-    if (cur->running_) {
+    // by the timer, or by writers on any vcpu
+    if (cur->running_.exchange(true)) {
         return 0;
     }
-    cur->running_ = true;
     DEFER(cur->running_ = false;);
     cur->eviction();
     return 0;
@@ -210,29 +400,65 @@ void FileCachePool::eviction() {
 
     isFull_ = true;
 
-    while (actualEvict > 0 && !lru_.empty() && !exit_) {
-        auto fileIter = lru_.back();
+    size_t skipped = 0;
+    while (actualEvict > 0 && !exit_) {
+        FileNameMap::iterator fileIter;
+        uint64_t fileSize;
+        {
+            photon::scoped_lock lock(lruLock_);
+            drainAccessBuffers();
+            if (lru_->empty())
+                break;
+            fileIter = lru_->back();
+            fileSize = fileIter->second->size;
+            // dirty data lives only in the cache until written back
+            if (fileIter->second->dirtySize > 0) {
+                lru_->requeue(fileIter->second->lruIter);
+                if (++skipped >= lru_->size())
+                    break;
+                continue;
+            }
+        }
         const auto &fileName = fileIter->first;
         auto lruEntry = fileIter->second.get();
-        auto fileSize = lruEntry->size;
-        if (lruEntry->openCount == 0) {
-            lru_.mark_key_cleared(fileIter->second->lruIter);
-        } else {
-            lru_.access(fileIter->second->lruIter);
+        if (fileSize > kRangeEvictionMinUnits * refillUnit_) {
+            // keep the hot ranges of a large file, which then counts as recently used;
+            // it is evicted as a whole only if nothing could be freed this way
+            auto freed = evictRanges(fileIter, actualEvict);
+            if (freed > 0) {
+                {
+                    photon::scoped_lock lock(lruLock_);
+                    lru_->requeue(lruEntry->lruIter);
+                }
+                actualEvict -= freed;
+                photon::thread_yield();
+                continue;
+            }
+        }
+        {
+            photon::scoped_lock lock(lruLock_);
+            if (lruEntry->openCount == 0) {
+                lru_->mark_key_cleared(fileIter->second->lruIter);
+            } else {
+                lru_->requeue(fileIter->second->lruIter);
+            }
         }
         // as soon as possible truncate and unlink
         if (0 == fileSize) {
-            if (0 == fileIter->second->openCount) {
-                afterFtrucate(fileIter);
-            }
+            afterFtrucate(fileIter);
             photon::thread_yield();
             continue;
         }
 
         {
             photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+            mediaFs_->unlink(cachedBlocksName(fileIter).c_str());
             err = mediaFs_->truncate(fileName.data(), 0);
             lruEntry->truncate_done = false;
+            photon::scoped_lock lock(lruEntry->bitmapLock);
+            lruEntry->cachedBlocks.reset();
+            lruEntry->cachedBlocksReady = (err == 0);
+            lruEntry->unitRefs.reset();
         }
 
         if (err) {
@@ -253,12 +479,88 @@ void FileCachePool::eviction() {
     }
 }
 
+int64_t FileCachePool::evictRanges(FileNameMap::iterator iter, int64_t size) {
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 /* default is extend size */
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02 /* de-allocates range */
+#endif
+    auto lruEntry = iter->second.get();
+    photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+    auto file = mediaFs_->open(iter->first.data(), O_RDWR, 0644);
+    if (file == nullptr) {
+        LOG_ERRNO_RETURN(0, 0, "open failed, name : `", iter->first);
+    }
+    DEFER(delete file);
+    struct stat st = {};
+    if (file->fstat(&st) != 0) {
+        LOG_ERRNO_RETURN(0, 0, "fstat failed, name : `", iter->first);
+    }
+    uint64_t units = (st.st_size + refillUnit_ - 1) / refillUnit_;
+    if (units == 0)
+        return 0;
+    mediaFs_->unlink(cachedBlocksName(iter).c_str());
+
+    // clock over refill units, two rounds at most so that every unit gets cold
+    auto blocksPerUnit = refillUnit_ / kCachedBlockSize;
+    int64_t punched = 0;
+    for (uint64_t n = 0; n < 2 * units && punched < size; n++) {
+        auto unit = lruEntry->clockHand++ % units;
+        lruEntry->clockHand %= units;
+        // without a bitmap, assume the unit is fully cached
+        uint64_t cached = refillUnit_;
+        {
+            photon::scoped_lock lock(lruEntry->bitmapLock);
+            if (lruEntry->unitRefs.test(unit)) {
+                lruEntry->unitRefs.clear(unit, unit + 1);
+                continue;
+            }
+            if (lruEntry->cachedBlocksReady) {
+                auto first = unit * blocksPerUnit;
+                cached =
+                    lruEntry->cachedBlocks.count(first, first + blocksPerUnit) * kCachedBlockSize;
+                if (cached == 0)
+                    continue;
+            }
+        }
+        off_t offset = unit * refillUnit_;
+        auto len = std::min((off_t)refillUnit_, st.st_size - offset);
+        if (file->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) != 0) {
+            ERRNO e;
+            LOG_ERROR("punch hole failed, name : `, offset : `, error code : `", iter->first,
+                      offset, e);
+            break;
+        }
+        {
+            photon::scoped_lock lock(lruEntry->bitmapLock);
+            lruEntry->cachedBlocks.clear(unit * blocksPerUnit, (unit + 1) * blocksPerUnit);
+        }
+        punched += cached;
+    }
+
+    struct stat nst = {};
+    if (file->fstat(&nst) != 0) {
+        LOG_ERRNO_RETURN(0, 0, "fstat failed, name : `", iter->first);
+    }
+    auto freed = std::max((int64_t)(st.st_blocks - nst.st_blocks) * (int64_t)kDiskBlockSize,
+                          (int64_t)0);
+    photon::scoped_lock lock(lruLock_);
+    lruEntry->size = nst.st_blocks * kDiskBlockSize;
+    totalUsed_ -= freed;
+    if (totalUsed_ < 0) {
+        totalUsed_ = 0;
+    }
+    return freed;
+}
+
 uint64_t FileCachePool::calcWaterMark(uint64_t capacity, uint64_t maxFreeSpace) {
     return std::max(static_cast<uint64_t>(capacity * kWaterMarkRatio * 0.01),
                     capacity > maxFreeSpace ? capacity - maxFreeSpace : 0);
 }
 
 bool FileCachePool::afterFtrucate(FileNameMap::iterator iter) {
+    photon::scoped_lock lock(lruLock_);
     auto lruEntry = iter->second.get();
     totalUsed_ -= static_cast<int64_t>(lruEntry->size);
     lruEntry->size = 0;
@@ -266,6 +568,7 @@ bool FileCachePool::afterFtrucate(FileNameMap::iterator iter) {
         totalUsed_ = 0;
     }
     if (0 == iter->second->openCount) {
+        mediaFs_->unlink(cachedBlocksName(iter).c_str());
         auto err = mediaFs_->unlink(iter->first.data());
         ERRNO e;
         LOG_ERROR("unlink failed, name : `, ret : `, error code : `", iter->first, err, e);
@@ -275,7 +578,10 @@ bool FileCachePool::afterFtrucate(FileNameMap::iterator iter) {
         if (err && (e.no == EBUSY)) {
             return false;
         }
-        lru_.remove(iter->second->lruIter);
+        // no update of the file may be left in the buffers, as its key is to be reused
+        drainAccessBuffers();
+        lru_->remove(iter->second->lruIter);
+        memCache_.invalidate(lruEntry);
         fileIndex_.erase(iter);
     }
     return true;
@@ -289,6 +595,10 @@ int FileCachePool::traverseDir(const std::string &root) {
 }
 
 int FileCachePool::insertFile(std::string_view file) {
+    auto suffixLen = sizeof(kCachedBlocksSuffix) - 1;
+    if (file.size() > suffixLen &&
+        file.substr(file.size() - suffixLen) == std::string_view(kCachedBlocksSuffix, suffixLen))
+        return 0; // belongs to a media file
     struct stat st = {};
     auto ret = mediaFs_->stat(file.data(), &st);
     if (ret) {
@@ -296,10 +606,11 @@ int FileCachePool::insertFile(std::string_view file) {
     }
     auto fileSize = st.st_blocks * kDiskBlockSize;
 
-    auto lruIter = lru_.push_front(fileIndex_.end());
+    photon::scoped_lock lock(lruLock_);
+    auto lruIter = lru_->push_front(fileIndex_.end());
     auto entry = std::unique_ptr<LruEntry>(new LruEntry{lruIter, 0, fileSize});
     auto iter = fileIndex_.emplace(file, std::move(entry)).first;
-    lru_.front() = iter;
+    lru_->value(lruIter) = iter;
     totalUsed_ += fileSize;
     return 0;
 }
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <string>
@@ -24,8 +26,9 @@
 #include <photon/thread/thread.h>
 #include <photon/thread/timer.h>
 #include <photon/common/string-keyed.h>
-#include "../policy/lru.h"
+#include "../policy/policy.h"
 #include "../pool_store.h"
+#include "memory_cache.h"
 
 #include <photon/fs/filesystem.h>
 
@@ -34,12 +37,22 @@ namespace Cache {
 class FileCachePool : public FileSystem::ICachePool {
 public:
     FileCachePool(photon::fs::IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                  uint64_t diskAvailInBytes, uint64_t refillUnit);
+                  uint64_t diskAvailInBytes, uint64_t refillUnit,
+                  int evictionPolicy = FileSystem::EVICTION_POLICY_LRU);
     ~FileCachePool();
 
     static const uint64_t kDiskBlockSize = 512; // stat(2)
     static const uint64_t kDeleteDelayInUs = 1000;
     static const uint32_t kWaterMarkRatio = 90;
+    static const uint64_t kCachedBlockSize = 4 * 1024;
+    // files smaller than this many refill units are evicted as a whole
+    static const uint64_t kRangeEvictionMinUnits = 16;
+    // hits within this period since the last one are correlated, and don't
+    // count as a reuse of the file for the eviction policy
+    static const uint64_t kCorrelatedPeriodInUs = 30UL * 1000 * 1000;
+    // # of access buffers, and the # of pending updates in one that triggers a drain
+    static const uint32_t kAccessStripes = 16;
+    static const uint32_t kDrainThreshold = 64;
 
     void Init();
 
@@ -54,16 +67,69 @@ public:
     int evict(size_t size = 0) override;
     int rename(std::string_view oldname, std::string_view newname) override;
 
+    // RST_MEMORY drops the memory cache
+    int reset(int flags = 0) override;
+    // RSZ_MEMORY sets the budget of the memory cache in bytes, 0 (default) disables it
+    int resize(size_t n, int flags = 0) override;
+
+    // a bitmap growing on demand, bits beyond its end are 0
+    struct Bitmap {
+        std::vector<uint64_t> words;
+
+        bool test(uint64_t i) const {
+            return i / 64 < words.size() && (words[i / 64] >> (i % 64) & 1);
+        }
+        void set(uint64_t first, uint64_t last) {
+            if (first >= last)
+                return;
+            if (words.size() < (last + 63) / 64)
+                words.resize((last + 63) / 64, 0);
+            for (auto i = first; i < last; i++)
+                words[i / 64] |= 1UL << (i % 64);
+        }
+        void clear(uint64_t first, uint64_t last) {
+            last = std::min(last, (uint64_t)words.size() * 64);
+            for (auto i = first; i < last; i++)
+                words[i / 64] &= ~(1UL << (i % 64));
+        }
+        uint64_t count(uint64_t first, uint64_t last) const {
+            uint64_t n = 0;
+            last = std::min(last, (uint64_t)words.size() * 64);
+            for (auto i = first; i < last; i++)
+                n += words[i / 64] >> (i % 64) & 1;
+            return n;
+        }
+        void reset() {
+            words.clear();
+        }
+    };
+
     struct LruEntry {
         LruEntry(uint32_t lruIt, int openCnt, uint64_t fileSize)
-            : lruIter(lruIt), openCount(openCnt), size(fileSize), truncate_done(false) {
+            : lruIter(lruIt), openCount(openCnt), size(fileSize), truncate_done(false),
+              cachedBlocksReady(false), clockHand(0), lastHitInUs(0), dirtySize(0) {
         }
         ~LruEntry() = default;
         uint32_t lruIter;
-        int openCount;
+        int openCount; // guarded by lruLock_, as well as size
         uint64_t size;
         photon::rwlock rw_lock_;
-        bool truncate_done;
+        std::atomic<bool> truncate_done;
+        // guards the bitmaps below, which are updated by stores on any vcpu
+        photon::mutex bitmapLock;
+        // bitmap of kCachedBlockSize blocks present in the media file, shared
+        // by all the stores opened on it; it is persisted next to the media
+        // file when the last store is closed, or else rebuilt from fiemap
+        Bitmap cachedBlocks;
+        std::atomic<bool> cachedBlocksReady;
+        // reference bits of refill units, set when accessed and cleared by
+        // the clock hand of range eviction, which gives them a second chance
+        Bitmap unitRefs;
+        uint64_t clockHand;
+        uint64_t lastHitInUs;
+        // bytes not yet written back by a store of O_WRITE_BACK, which keep
+        // the file from eviction
+        std::atomic<uint64_t> dirtySize;
     };
 
     // Normally, fileIndex(std::map) always keep growing, so its iterators always
@@ -76,9 +142,24 @@ public:
     void removeOpenFile(FileNameMap::iterator iter);
     void forceRecycle();
     void updateLru(FileNameMap::iterator iter);
+    // `hit` is true for reads served by the cache, and false for refills
+    void updateLru(FileNameMap::iterator iter, off_t offset, size_t count, bool hit = false);
     uint64_t updateSpace(FileNameMap::iterator iter, uint64_t size);
 
+    // hot refill units in memory, keyed by their LruEntry
+    MemoryCache &memoryCache() {
+        return memCache_;
+    }
+
 protected:
+    // the bitmap file of a media file is consumed when the first store is
+    // opened, and written back when the last one is closed
+    std::string cachedBlocksName(FileNameMap::iterator iter);
+    void loadCachedBlocks(FileNameMap::iterator iter);
+    void saveCachedBlocks(FileNameMap::iterator iter);
+    // punch holes in cold refill units of a file, returning the bytes freed
+    int64_t evictRanges(FileNameMap::iterator iter, int64_t size);
+
     photon::fs::IFile *openMedia(std::string_view name, int flags, int mode);
 
     static uint64_t timerHandler(void *data);
@@ -90,25 +171,48 @@ protected:
     uint64_t periodInUs_;
     uint64_t diskAvailInBytes_;
     size_t refillUnit_;
-    int64_t totalUsed_;
+    std::atomic<int64_t> totalUsed_;
     int64_t riskMark_;
     uint64_t waterMark_;
 
     photon::Timer *timer_;
-    bool running_;
+    std::atomic<bool> running_;
     bool exit_;
 
-    bool isFull_;
+    std::atomic<bool> isFull_;
 
     virtual bool afterFtrucate(FileNameMap::iterator iter);
 
     int traverseDir(const std::string &root);
     virtual int insertFile(std::string_view file);
 
-    typedef FileSystem::LRU<FileNameMap::iterator, uint32_t> LRUContainer;
-    LRUContainer lru_;
+    void referLru(LruEntry *lruEntry);
+    // record an update of lru_, which is applied later in a batch
+    void recordAccess(uint32_t lruIter, bool hit);
+    // apply the recorded updates, with lruLock_ held
+    void drainAccessBuffers();
+
+    // A lossy ring buffer of updates of lru_, filled by multiple vcpus and
+    // drained by whoever holds lruLock_. A full buffer drops new updates,
+    // which only costs some accuracy of recency.
+    struct AccessBuffer {
+        static const uint32_t kSize = 256;
+        std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> tail{0};
+        std::atomic<uint64_t> slots[kSize]{}; // 0 for an empty slot
+    };
+
+    typedef FileSystem::IEvictionPolicy<FileNameMap::iterator, uint32_t> LRUContainer;
+    std::unique_ptr<LRUContainer> lru_;
+    // reads record their updates of lru_ in the access buffer of their vcpu,
+    // so they never wait for lruLock_, which serializes all the other uses
+    // of lru_, as well as fileIndex_ and the space accounting, as stores
+    // may run on multiple vcpus
+    photon::mutex lruLock_;
+    AccessBuffer accessBuffers_[kAccessStripes];
     // filename -> lruEntry
     FileNameMap fileIndex_;
+    MemoryCache memCache_;
 };
 
 } //  namespace Cache
@@ -24,6 +24,7 @@
 #include <photon/fs/filesystem.h>
 #include <photon/common/iovector.h>
 #include "cache_pool.h"
+#include "../cache.h"
 
 using namespace FileSystem;
 using namespace photon::fs;
@@ -32,7 +33,7 @@ namespace Cache {
 
 const uint64_t kDiskBlockSize = 512; // stat(2)
 constexpr int kFieExtentSize = 1000;
-const int kBlockSize = 4 * 1024;
+const uint64_t kBlockSize = FileCachePool::kCachedBlockSize;
 
 FileCacheStore::FileCacheStore(FileSystem::ICachePool *cachePool, IFile *localFile,
                                size_t refillUnit, FileIterator iterator)
@@ -48,6 +49,15 @@ FileCacheStore::~FileCacheStore() {
 ICacheStore::try_preadv_result FileCacheStore::try_preadv2(const struct iovec *iov, int iovcnt,
                                                            off_t offset, int flags) {
     auto lruEntry = static_cast<FileCachePool::LruEntry *>(iterator_->second.get());
+    auto ret = cachePool_->memoryCache().preadv(lruEntry, iov, iovcnt, offset);
+    if (ret >= 0) {
+        cachePool_->updateLru(iterator_, offset, ret, true);
+        try_preadv_result rst;
+        rst.iov_sum = ret;
+        rst.refill_size = 0;
+        rst.size = ret;
+        return rst;
+    }
     photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::RLOCK);
     return this->ICacheStore::try_preadv2(iov, iovcnt, offset, flags);
 }
@@ -56,12 +66,53 @@ ssize_t FileCacheStore::do_preadv2(const struct iovec *iov, int iovcnt, off_t of
     // TODO(suoshi.yf): maybe a new interface for updating lru is better for avoiding
     // multiple cacheStore preadvs but cacheFile preadv only once
     ssize_t ret;
-    cachePool_->updateLru(iterator_);
-    SCOPE_AUDIT_THRESHOLD(1UL * 1000, "file:read", AU_FILEOP("", offset, ret));
-    ret = localFile_->preadv(iov, iovcnt, offset);
+    iovector_view view((iovec *)iov, iovcnt);
+    auto count = view.sum();
+    // promote units on their second access, before updateLru() marks them referenced
+    bool promote = count > 0 && cachePool_->memoryCache().capacity() > 0 &&
+                   ((flags & RW_V2_PROMOTE) || unitsReferenced(offset, count));
+    cachePool_->updateLru(iterator_, offset, count, true);
+    {
+        SCOPE_AUDIT_THRESHOLD(1UL * 1000, "file:read", AU_FILEOP("", offset, ret));
+        ret = localFile_->preadv(iov, iovcnt, offset);
+    }
+    if (promote && ret == static_cast<ssize_t>(count))
+        promoteUnits(offset, count);
     return ret;
 }
 
+bool FileCacheStore::unitsReferenced(off_t offset, size_t count) {
+    uint64_t first = offset / refillUnit_, last = (offset + count - 1) / refillUnit_ + 1;
+    photon::scoped_lock lock(lruEntry()->bitmapLock);
+    return lruEntry()->unitRefs.count(first, last) == last - first;
+}
+
+void FileCacheStore::promoteUnits(off_t offset, size_t count) {
+    auto entry = lruEntry();
+    auto &memCache = cachePool_->memoryCache();
+    auto blocksPerUnit = refillUnit_ / kBlockSize;
+    for (uint64_t i = offset / refillUnit_; i <= (offset + count - 1) / refillUnit_; i++) {
+        off_t begin = i * refillUnit_;
+        if (begin >= actual_size_)
+            break;
+        size_t size = std::min((off_t)refillUnit_, actual_size_ - begin);
+        {
+            // only a unit fully in the media file
+            auto blocks = (size + kBlockSize - 1) / kBlockSize;
+            photon::scoped_lock lock(entry->bitmapLock);
+            if (entry->cachedBlocks.count(i * blocksPerUnit, i * blocksPerUnit + blocks) < blocks)
+                continue;
+        }
+        auto ticket = memCache.reserve(entry, i);
+        if (ticket == 0)
+            continue;
+        std::shared_ptr<char> data(new char[size], std::default_delete<char[]>());
+        if (localFile_->pread(data.get(), size, begin) != static_cast<ssize_t>(size))
+            data.reset();
+        memCache.fill(entry, i, ticket, std::move(data), size);
+    }
+}
+
 ssize_t FileCacheStore::do_pwritev(const struct iovec *iov, int iovcnt, off_t offset) {
     ssize_t ret;
     iovector_view view((iovec *)iov, iovcnt);
@@ -78,6 +129,9 @@ ssize_t FileCacheStore::do_pwritev(const struct iovec *iov, int iovcnt, off_t of
     ScopedRangeLock lock(rangeLock_, offset, view.sum());
     SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:write", AU_FILEOP("", offset, ret));
     ret = localFile_->pwritev(iov, iovcnt, offset);
+    if (ret > 0)
+        markCachedBlocks(offset, offset + ret);
+    cachePool_->memoryCache().invalidate(lruEntry, offset, view.sum());
     return ret;
 }
 
@@ -98,7 +152,7 @@ ssize_t FileCacheStore::do_pwritev2(const struct iovec *iov, int iovcnt, off_t o
         if (err) {
             LOG_ERRNO_RETURN(0, ret, "fstat failed")
         }
-        cachePool_->updateLru(iterator_);
+        cachePool_->updateLru(iterator_, offset, ret);
         cachePool_->updateSpace(iterator_, kDiskBlockSize * st.st_blocks);
     }
     return ret;
@@ -106,64 +160,99 @@ ssize_t FileCacheStore::do_pwritev2(const struct iovec *iov, int iovcnt, off_t o
 
 std::pair<off_t, size_t> FileCacheStore::queryRefillRange(off_t offset, size_t size) {
     ScopedRangeLock lock(rangeLock_, offset, size);
-    off_t alignLeft = align_down(offset, kBlockSize);
-    off_t alignRight = align_up(offset + size, kBlockSize);
-    ReadRequest request{alignLeft, static_cast<size_t>(alignRight - alignLeft)};
-    struct fiemap_t<kFieExtentSize> fie(request.offset, request.size);
-    fie.fm_mapped_extents = 0;
+    auto entry = lruEntry();
+    if (!entry->cachedBlocksReady && rebuildCachedBlocks() != 0) {
+        LOG_ERRNO_RETURN(0, std::make_pair(-1, 0),
+                         "failed to rebuild cached blocks, offset : `, size : `", offset, size);
+    }
 
-    if (request.size > 0) { //  fiemap cannot handle size zero.
-        auto ok = localFile_->fiemap(&fie);
-        if (ok != 0) {
-            LOG_ERRNO_RETURN(0, std::make_pair(-1, 0),
-                             "media fiemap failed : `, offset : `, size : `", ok, request.offset,
-                             request.size);
-        }
-        if (fie.fm_mapped_extents >= kFieExtentSize) { // TODO: qisheng.ds
-                                                       // it's supposed to be solved by
-                                                       // get fie extents twice,
-                                                       // but just do not concern much
-                                                       // about it rightnow.
-            LOG_ERROR_RETURN(EINVAL, std::make_pair(-1, 0), "read size is too big : `",
-                             request.size);
+    //  narrow [first, last) down to the hole between the first and the last missing block
+    photon::scoped_lock blocksLock(entry->bitmapLock);
+    auto &bits = entry->cachedBlocks;
+    auto &words = bits.words;
+    uint64_t first = offset / kBlockSize;
+    uint64_t last = align_up(offset + size, kBlockSize) / kBlockSize;
+    while (first < last) {
+        if (first % 64 == 0 && first + 64 <= last && first / 64 < words.size() &&
+            words[first / 64] == ~0UL) {
+            first += 64;
+        } else if (bits.test(first)) {
+            first++;
+        } else {
+            break;
         }
     }
+    while (last > first && bits.test(last - 1))
+        last--;
 
-    uint64_t holeStart = request.offset;
-    uint64_t holeEnd = request.offset + request.size;
+    if (first >= last)
+        return std::make_pair(0, 0);
+    // CacheMiss
+    auto left = align_down(first * kBlockSize, refillUnit_);
+    auto right = align_up(last * kBlockSize, refillUnit_);
+    return std::make_pair(left, right - left);
+}
 
-    for (ssize_t i = (ssize_t)(fie.fm_mapped_extents) - 1; i >= 0; i--) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical < holeEnd) {
-            if (extent.fe_logical_end() >= holeEnd) {
-                holeEnd = extent.fe_logical;
-            } else
-                break;
-        }
+int FileCacheStore::rebuildCachedBlocks() {
+    struct stat st = {};
+    if (localFile_->fstat(&st) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "media fstat failed");
     }
+    uint64_t fileSize = st.st_size;
+    FileCachePool::Bitmap bits;
+    // a run of continuous extents, the partial block at EOF counts as cached
+    uint64_t runStart = 0, runEnd = 0;
+    auto flush = [&]() {
+        auto last = runEnd >= fileSize ? align_up(fileSize, kBlockSize) : runEnd;
+        bits.set(align_up(runStart, kBlockSize) / kBlockSize, last / kBlockSize);
+    };
 
-    for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical_end() > holeStart) {
-            if (extent.fe_logical <= holeStart) {
-                holeStart = extent.fe_logical_end();
-            } else
-                break;
+    uint64_t start = 0;
+    while (start < fileSize) {
+        struct fiemap_t<kFieExtentSize> fie(start, fileSize - start);
+        fie.fm_mapped_extents = 0;
+        auto ok = localFile_->fiemap(&fie);
+        if (ok != 0) {
+            LOG_ERRNO_RETURN(0, -1, "media fiemap failed : `, offset : `, size : `", ok, start,
+                             fileSize - start);
+        }
+        if (fie.fm_mapped_extents == 0)
+            break;
+        for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
+            auto &extent = fie.fm_extents[i];
+            if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
+                (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
+                continue;
+            if (extent.fe_logical > runEnd) {
+                flush();
+                runStart = extent.fe_logical;
+            }
+            runEnd = std::max(runEnd, (uint64_t)extent.fe_logical_end());
         }
+        auto &lastExtent = fie.fm_extents[fie.fm_mapped_extents - 1];
+        if ((lastExtent.fe_flags & FIEMAP_EXTENT_LAST) || lastExtent.fe_logical_end() <= start)
+            break;
+        start = lastExtent.fe_logical_end();
     }
+    flush();
 
-    if (holeStart >= holeEnd)
-        return std::make_pair(0, 0);
-    // CacheMiss
-    auto left = align_down(holeStart, refillUnit_);
-    auto right = align_up(holeEnd, refillUnit_);
-    return std::make_pair(left, right - left);
+    auto entry = lruEntry();
+    photon::scoped_lock lock(entry->bitmapLock);
+    entry->cachedBlocks.words.swap(bits.words);
+    entry->cachedBlocksReady = true;
+    return 0;
+}
+
+void FileCacheStore::markCachedBlocks(off_t begin, off_t end) {
+    //  the partial block at EOF is complete once written to the end
+    auto last = end >= actual_size_ ? align_up(end, kBlockSize) : align_down(end, kBlockSize);
+    photon::scoped_lock lock(lruEntry()->bitmapLock);
+    lruEntry()->cachedBlocks.set(align_up(begin, kBlockSize) / kBlockSize, last / kBlockSize);
+}
+
+void FileCacheStore::clearCachedBlocks(off_t begin, off_t end) {
+    photon::scoped_lock lock(lruEntry()->bitmapLock);
+    lruEntry()->cachedBlocks.clear(begin / kBlockSize, align_up(end, kBlockSize) / kBlockSize);
 }
 
 int FileCacheStore::set_quota(size_t quota) {
@@ -177,7 +266,12 @@ int FileCacheStore::stat(CacheStat *stat) {
 }
 
 int FileCacheStore::evict(off_t offset, size_t count) {
+    cachePool_->memoryCache().invalidate(lruEntry(), offset, count);
     if (static_cast<size_t>(-1) == count) {
+        {
+            photon::scoped_lock lock(lruEntry()->bitmapLock);
+            lruEntry()->cachedBlocks.clear(offset / kBlockSize, -1UL);
+        }
         return localFile_->ftruncate(offset);
     } else {
 #ifndef FALLOC_FL_KEEP_SIZE
@@ -187,6 +281,7 @@ int FileCacheStore::evict(off_t offset, size_t count) {
 #define FALLOC_FL_PUNCH_HOLE 0x02 /* de-allocates range */
 #endif
         int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        clearCachedBlocks(offset, offset + count);
         return localFile_->fallocate(mode, offset, count);
     }
 }
@@ -48,19 +48,25 @@ public:
 protected:
     bool cacheIsFull();
 
-    struct ReadRequest {
-        off_t offset;
-        size_t size;
-    };
-
-    //  merge from first extent to last extent(or encounter hole),
-    //  because fiemap could return multiple continuous extents even though no any hole.
-    std::pair<off_t, size_t> getFirstMergedExtents(struct fiemap *fie);
-
-    std::pair<off_t, size_t> getLastMergedExtents(struct fiemap *fie);
-
-    std::pair<off_t, off_t> getHoleFromCacheHitResult(off_t offset, size_t alignSize,
-                                                      struct fiemap *fie);
+    void dirty_changed(size_t dirty_size) override {
+        lruEntry()->dirtySize = dirty_size;
+    }
+
+    FileCachePool::LruEntry *lruEntry() {
+        return static_cast<FileCachePool::LruEntry *>(iterator_->second.get());
+    }
+
+    //  rebuild the bitmap of cached blocks from the extents of the media file,
+    //  merging continuous extents since fiemap may split them without any hole.
+    int rebuildCachedBlocks();
+    //  mark the blocks fully written within [begin, end) as cached
+    void markCachedBlocks(off_t begin, off_t end);
+    //  mark the blocks overlapping with [begin, end) as not cached
+    void clearCachedBlocks(off_t begin, off_t end);
+    //  whether the refill units overlapping with [offset, offset + count) have all been accessed
+    bool unitsReferenced(off_t offset, size_t count);
+    //  copy the refill units overlapping with [offset, offset + count) to the memory cache
+    void promoteUnits(off_t offset, size_t count);
 
     FileCachePool *cachePool_;     //  owned by extern class
     photon::fs::IFile *localFile_; //  owned by current class
@@ -0,0 +1,135 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "memory_cache.h"
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+namespace Cache {
+
+ssize_t MemoryCache::preadv(const void *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (capacity_ == 0)
+        return -1;
+    size_t count = 0;
+    for (int i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+    if (count == 0)
+        return 0;
+    uint64_t first = offset / unit_, last = (offset + count - 1) / unit_;
+    // hold the data of the units, which may be evicted during the copy
+    std::vector<std::shared_ptr<char>> data;
+    data.reserve(last - first + 1);
+    {
+        photon::scoped_lock lock(lock_);
+        auto it = units_.find(Key(file, first));
+        for (auto i = first; i <= last; i++, ++it) {
+            auto end = (i == last) ? offset + count - i * unit_ : unit_;
+            if (it == units_.end() || it->first != Key(file, i) || !it->second.data ||
+                it->second.size < end)
+                return -1;
+            data.push_back(it->second.data);
+            lru_.access(it->second.lruIter);
+        }
+    }
+
+    int k = 0;
+    size_t done = 0;
+    for (auto i = first; i <= last; i++) {
+        auto src = data[i - first].get();
+        size_t begin = (i == first) ? offset - i * unit_ : 0;
+        size_t end = std::min(unit_, offset + count - i * unit_);
+        while (begin < end) {
+            auto n = std::min(end - begin, iov[k].iov_len - done);
+            memcpy((char *)iov[k].iov_base + done, src + begin, n);
+            begin += n;
+            done += n;
+            if (done == iov[k].iov_len) {
+                k++;
+                done = 0;
+            }
+        }
+    }
+    return count;
+}
+
+uint64_t MemoryCache::reserve(const void *file, uint64_t index) {
+    if (capacity_ == 0)
+        return 0;
+    photon::scoped_lock lock(lock_);
+    auto ret = units_.emplace(Key(file, index), Unit{nullptr, 0, 0, 0});
+    if (!ret.second)
+        return 0;
+    return ret.first->second.ticket = nextTicket_++;
+}
+
+void MemoryCache::fill(const void *file, uint64_t index, uint64_t ticket,
+                       std::shared_ptr<char> data, size_t size) {
+    photon::scoped_lock lock(lock_);
+    auto it = units_.find(Key(file, index));
+    if (it == units_.end() || it->second.ticket != ticket)
+        return; // invalidated since reserved
+    if (!data || size > capacity_) {
+        units_.erase(it);
+        return;
+    }
+    it->second.data = std::move(data);
+    it->second.size = size;
+    it->second.lruIter = lru_.push_front(it);
+    used_ += size;
+    while (used_ > capacity_ && !lru_.empty())
+        erase(lru_.back());
+}
+
+void MemoryCache::invalidate(const void *file, off_t offset, size_t count) {
+    if (capacity_ == 0 || count == 0)
+        return;
+    uint64_t last = (count == static_cast<size_t>(-1)) ? -1UL : (offset + count - 1) / unit_;
+    photon::scoped_lock lock(lock_);
+    auto it = units_.lower_bound(Key(file, offset / unit_));
+    while (it != units_.end() && it->first.first == file && it->first.second <= last)
+        erase(it++);
+}
+
+void MemoryCache::resize(size_t capacity) {
+    photon::scoped_lock lock(lock_);
+    capacity_ = capacity;
+    if (capacity == 0) {
+        // reservations are dropped too, as invalidate() is skipped from now on
+        units_.clear();
+        lru_ = decltype(lru_)();
+        used_ = 0;
+        return;
+    }
+    while (used_ > capacity_ && !lru_.empty())
+        erase(lru_.back());
+}
+
+void MemoryCache::reset() {
+    photon::scoped_lock lock(lock_);
+    units_.clear();
+    lru_ = decltype(lru_)();
+    used_ = 0;
+}
+
+void MemoryCache::erase(UnitMap::iterator it) {
+    if (it->second.data) {
+        lru_.remove(it->second.lruIter);
+        used_ -= it->second.size;
+    }
+    units_.erase(it);
+}
+
+} //  namespace Cache
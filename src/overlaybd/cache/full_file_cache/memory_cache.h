@@ -0,0 +1,86 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <utility>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <photon/thread/thread.h>
+#include "../policy/lru.h"
+
+namespace Cache {
+
+// A RAM tier of hot refill units in front of the media files, bounded by a
+// byte budget and evicted in LRU order. Units are identified by an opaque
+// file key and their index in the file. A unit is promoted by reserve()
+// before reading it from the media and fill() after, so a unit invalidated
+// in between is never filled with stale data.
+class MemoryCache {
+public:
+    explicit MemoryCache(size_t unit) : unit_(unit) {
+    }
+
+    // copy [offset, offset + sum of iov) of `file` to iov if it is all in
+    // memory, otherwise returns -1
+    ssize_t preadv(const void *file, const struct iovec *iov, int iovcnt, off_t offset);
+
+    // returns a ticket to fill a unit not in memory, or 0
+    uint64_t reserve(const void *file, uint64_t index);
+    // fill a reserved unit with `size` bytes of `data`, or drop the
+    // reservation if `data` is null
+    void fill(const void *file, uint64_t index, uint64_t ticket, std::shared_ptr<char> data,
+              size_t size);
+
+    // drop the units overlapping [offset, offset + count) of `file`
+    void invalidate(const void *file, off_t offset = 0, size_t count = -1);
+
+    // evict units to fit in `capacity`, 0 disables the memory cache
+    void resize(size_t capacity);
+    void reset();
+
+    size_t capacity() const {
+        return capacity_;
+    }
+    size_t used() const {
+        return used_;
+    }
+
+protected:
+    typedef std::pair<const void *, uint64_t> Key;
+    struct Unit {
+        std::shared_ptr<char> data; // null while reserved
+        size_t size;
+        uint64_t ticket;
+        uint32_t lruIter;
+    };
+    typedef std::map<Key, Unit> UnitMap;
+
+    // with lock_ held
+    void erase(UnitMap::iterator it);
+
+    const size_t unit_;
+    std::atomic<size_t> capacity_{0};
+    std::atomic<size_t> used_{0};
+    uint64_t nextTicket_ = 1;
+    UnitMap units_;
+    FileSystem::LRU<UnitMap::iterator, uint32_t> lru_;
+    photon::mutex lock_;
+};
+
+} //  namespace Cache
@@ -1,7 +1,5 @@
 /*
  * Note: Some OCF APIs are not being used under current circumstances, for example:
- *      ocf_mngt_cache_lock
- *      ocf_mngt_cache_unlock
  *      ocf_mngt_cache_flush
  *      ocf_mngt_core_flush
  *      ocf_mngt_cache_remove_core
@@ -190,6 +188,28 @@ int ease_ocf_provider::stop() {
     return 0;
 }
 
+int ease_ocf_provider::save() {
+    if (m_cache == nullptr) {
+        return 0;
+    }
+    simple_context lock_ctx;
+    ocf_mngt_cache_lock(m_cache, simple_complete, &lock_ctx);
+    lock_ctx.sem.wait(1);
+    if (lock_ctx.error != 0) {
+        LOG_ERROR_RETURN(0, -1, "OCF: failed to lock cache, error = `", lock_ctx.error);
+    }
+    DEFER(ocf_mngt_cache_unlock(m_cache));
+
+    simple_context simple_ctx;
+    ocf_mngt_cache_save(m_cache, simple_complete, &simple_ctx);
+    simple_ctx.sem.wait(1);
+    if (simple_ctx.error != 0) {
+        LOG_ERROR_RETURN(0, -1, "OCF: failed to save cache metadata, error = `", simple_ctx.error);
+    }
+    LOG_DEBUG("OCF: succeeded to save cache metadata");
+    return 0;
+}
+
 void ease_ocf_provider::prepare_aligned_iov(size_t count, off_t offset, alignment &a, IOVector &iov,
                                             const void *buf, void *padding_buf) {
     // bound
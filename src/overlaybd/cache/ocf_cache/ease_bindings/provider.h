@@ -17,6 +17,12 @@ public:
 
     int stop();
 
+    /**
+     * @brief Persist OCF metadata, including the cache line map, to the media
+     * @retval 0 for success
+     */
+    int save();
+
     /**
      * @brief Caller should guarantee that offset + count does not exceed the EOF.
      * @return On success, count is returned. On error, other value is returned.
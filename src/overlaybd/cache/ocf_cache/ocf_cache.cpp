@@ -9,6 +9,7 @@
 #include <photon/fs/forwardfs.h>
 #include <photon/fs/virtual-file.h>
 #include <photon/common/alog-stdstring.h>
+#include <photon/thread/thread.h>
 #include "../cache.h"
 #include "ocf_namespace.h"
 #include "ease_bindings/provider.h"
@@ -118,6 +119,12 @@ public:
 
     int init();
 
+    /**
+     * @brief Persist the namespace and OCF metadata, so that a restart reloads a warm cache
+     * @retval 0 for success
+     */
+    int checkpoint();
+
     ssize_t ocf_pread(void *buf, size_t count, off_t offset, OcfSrcFileCtx *ctx);
 
     inline void pooled_release(OcfCachedFile *file) {
@@ -170,6 +177,12 @@ private:
 
     ease_ocf_volume_params *m_volume_params = nullptr; // owned by self
     ease_ocf_provider *m_provider = nullptr;           // owned by self
+
+    static const uint64_t CHECKPOINT_INTERVAL = 60UL * 1000 * 1000;
+    photon::thread *m_checkpointer = nullptr;
+    photon::join_handle *m_checkpointer_jh = nullptr;
+    bool m_stop_checkpointer = false;
+    static void *checkpoint_loop(void *arg);
 };
 
 OcfCachedFile::OcfCachedFile(Cache::OcfCachedFs *fs, OcfSrcFileCtx *ctx) : m_fs(fs), m_ctx(ctx) {
@@ -208,6 +221,13 @@ OcfCachedFs::OcfCachedFs(IFileSystem *src_fs, size_t prefetch_unit,
 }
 
 OcfCachedFs::~OcfCachedFs() {
+    if (m_checkpointer != nullptr) {
+        m_stop_checkpointer = true;
+        photon::thread_interrupt(m_checkpointer);
+        photon::thread_join(m_checkpointer_jh);
+        // OCF metadata is saved when the cache stops
+        m_ocf_ns->checkpoint();
+    }
     m_provider->stop();
     delete m_provider;
     delete m_volume_params;
@@ -229,7 +249,33 @@ int OcfCachedFs::init() {
         new ease_ocf_volume_params{m_ocf_ns->block_size(), media_size, m_media_file, false};
     m_provider = new ease_ocf_provider(m_volume_params, m_prefetch_unit);
 
-    return m_provider->start(m_reload_media);
+    if (m_provider->start(m_reload_media) != 0) {
+        return -1;
+    }
+    m_checkpointer = photon::thread_create(&checkpoint_loop, this);
+    m_checkpointer_jh = photon::thread_enable_join(m_checkpointer);
+    return 0;
+}
+
+int OcfCachedFs::checkpoint() {
+    if (m_ocf_ns->checkpoint() != 0) {
+        LOG_ERROR_RETURN(0, -1, "OCF: failed to checkpoint namespace");
+    }
+    if (m_provider->save() != 0) {
+        LOG_ERROR_RETURN(0, -1, "OCF: failed to checkpoint cache metadata");
+    }
+    return 0;
+}
+
+void *OcfCachedFs::checkpoint_loop(void *arg) {
+    auto fs = (OcfCachedFs *)arg;
+    while (!fs->m_stop_checkpointer) {
+        photon::thread_usleep(CHECKPOINT_INTERVAL);
+        if (!fs->m_stop_checkpointer) {
+            fs->checkpoint();
+        }
+    }
+    return nullptr;
 }
 
 ssize_t OcfCachedFs::ocf_pread(void *buf, size_t count, off_t offset, OcfSrcFileCtx *ctx) {
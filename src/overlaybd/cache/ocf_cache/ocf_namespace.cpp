@@ -1,7 +1,10 @@
 #include "ocf_namespace.h"
 
 #include <fcntl.h>
+#include <stddef.h>
 #include <sys/stat.h>
+#include <string>
+#include <unordered_map>
 
 #include <photon/common/enumerable.h>
 #include <photon/fs/localfs.h>
@@ -17,12 +20,24 @@ extern "C" {
 
 #define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
 
+/*
+ * Besides a file per source file, the namespace table is kept in a snapshot at the root of the
+ * namespace fs, along with a journal of the files appended since the snapshot was taken. init()
+ * loads the snapshot and replays the journal, and walks through the namespace fs only when
+ * they are missing or corrupted. The snapshot is replaced atomically by checkpoint(), and then
+ * the journal is emptied, unless files were appended while the snapshot was written. A crash
+ * in between leaves records of the journal in the snapshot, which are simply replayed again.
+ */
 class OcfNamespaceOnFs : public OcfNamespace {
 public:
     OcfNamespaceOnFs(size_t blk_size, photon::fs::IFileSystem *fs)
         : OcfNamespace(blk_size), m_fs(fs) {
     }
 
+    ~OcfNamespaceOnFs() {
+        delete m_journal;
+    }
+
     int init() override {
         switch (m_blk_size) {
         case ocf_cache_line_size_4:
@@ -35,14 +50,31 @@ public:
             LOG_ERROR_RETURN(0, -1, "OCF: invalid cache line size");
         }
 
+        if (load_snapshot() == 0 && open_journal() == 0 && replay_journal() == 0) {
+            LOG_INFO("OCF: loaded ` files of namespace from snapshot, total_blocks `",
+                     m_table.size(), m_total_blocks);
+            return 0;
+        }
+        m_table.clear();
+        m_total_blocks = 0;
+
+        // A stale snapshot must not be combined with a new journal
+        if (m_fs->access(SNAPSHOT_FILE, F_OK) == 0 && m_fs->unlink(SNAPSHOT_FILE) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "OCF: failed to remove namespace snapshot");
+        }
+
         off_t max_blk_idx = 0;
         off_t last_num_blocks = 0;
 
         for (auto file_path : enumerable(photon::fs::Walker(m_fs, ""))) {
+            if (is_meta_file(file_path)) {
+                continue;
+            }
             NsInfo info;
             if (get_ns_info(file_path, info) != 0) {
                 return -1;
             }
+            m_table[ns_key(file_path)] = info;
 
             if (max_blk_idx < info.blk_idx) {
                 max_blk_idx = info.blk_idx;
@@ -52,10 +84,27 @@ public:
 
         m_total_blocks = max_blk_idx + last_num_blocks;
         LOG_DEBUG("OCF: set total_blocks to `", m_total_blocks);
+
+        if (open_journal() != 0 || m_journal->ftruncate(0) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "OCF: failed to reset namespace journal");
+        }
+        m_journal_size = 0;
+        m_dirty = true;
+        if (checkpoint() != 0) {
+            LOG_WARN("OCF: failed to checkpoint namespace, it will be walked through again");
+        }
         return 0;
     }
 
     int locate_file(const estring &file_path, photon::fs::IFile *src_file, NsInfo &info) override {
+        {
+            photon::scoped_lock lock(m_mutex);
+            auto it = m_table.find(ns_key(file_path));
+            if (it != m_table.end()) {
+                info = it->second;
+                return 0;
+            }
+        }
         if (m_fs->access(file_path.c_str(), F_OK) == 0) {
             if (get_ns_info(file_path, info) != 0) {
                 LOG_ERROR_RETURN(0, -1, "OCF: get ns info failed, path `", file_path);
@@ -72,6 +121,75 @@ public:
         return 0;
     }
 
+    int checkpoint() override {
+        photon::scoped_lock ckpt_lock(m_checkpoint_mutex);
+        std::string data;
+        SnapshotHeader header;
+        size_t journal_size;
+        {
+            // Only the table is copied under the lock, the snapshot is written without it
+            photon::scoped_lock lock(m_mutex);
+            if (!m_dirty) {
+                return 0;
+            }
+            for (auto &x : m_table) {
+                SnapshotEntry entry = {
+                    .info = x.second,
+                    .path_len = (uint32_t)x.first.size(),
+                };
+                data.append((const char *)&entry, sizeof(entry)).append(x.first);
+            }
+            header = {
+                .magic = SNAPSHOT_MAGIC,
+                .version = SNAPSHOT_VERSION,
+                .blk_size = m_blk_size,
+                .total_blocks = m_total_blocks,
+                .count = m_table.size(),
+                .data_size = data.size(),
+            };
+            journal_size = m_journal_size;
+        }
+        header.data_checksum = crc32::crc32c(data);
+        header.checksum = crc32::crc32c(&header, offsetof(SnapshotHeader, checksum));
+
+        auto tmp_file_path = estring().appends(SNAPSHOT_FILE, ".tmp");
+        {
+            auto tmp_file = m_fs->open(tmp_file_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
+            if (tmp_file == nullptr) {
+                LOG_ERRNO_RETURN(0, -1, "OCF: failed to create tmp file `", tmp_file_path);
+            }
+            DEFER(delete tmp_file);
+            if (tmp_file->pwrite(&header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+                tmp_file->pwrite(data.data(), data.size(), sizeof(header)) !=
+                    (ssize_t)data.size() ||
+                tmp_file->fdatasync() != 0) {
+                LOG_ERRNO_RETURN(0, -1, "OCF: failed to write tmp file `", tmp_file_path);
+            }
+        }
+        if (m_fs->rename(tmp_file_path.c_str(), SNAPSHOT_FILE) != 0) {
+            ERRNO prev_eno;
+            m_fs->unlink(tmp_file_path.c_str());
+            LOG_ERRNO_RETURN(prev_eno.no, -1, "OCF: failed to rename tmp file `", tmp_file_path);
+        }
+
+        photon::scoped_lock lock(m_mutex);
+        if (m_journal_size != journal_size) {
+            // Files appended meanwhile are only in the journal, which is kept till the next
+            // checkpoint. Replaying the records that are also in the snapshot does no harm.
+            LOG_INFO("OCF: checkpoint ` files of namespace, journal is kept", header.count);
+            return 0;
+        }
+        // Records of the journal are all in the snapshot now
+        if (m_journal->ftruncate(0) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "OCF: failed to truncate namespace journal");
+        }
+        m_journal_size = 0;
+        m_dirty = false;
+        LOG_INFO("OCF: checkpoint ` files of namespace, total_blocks `", header.count,
+                 header.total_blocks);
+        return 0;
+    }
+
 private:
     struct NsFileFormat {
         uint32_t magic;
@@ -79,6 +197,184 @@ private:
         NsInfo info;
     };
 
+    struct SnapshotHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t blk_size;
+        uint64_t total_blocks;
+        uint64_t count;
+        uint64_t data_size;
+        uint32_t data_checksum;
+        uint32_t checksum; // of the fields above
+    };
+
+    // followed by path_len bytes of path
+    struct SnapshotEntry {
+        NsInfo info;
+        uint32_t path_len;
+        uint32_t reserved;
+    };
+
+    // followed by path_len bytes of path, the checksum covers the rest of the record
+    struct JournalRecord {
+        uint32_t magic;
+        uint32_t checksum;
+        NsInfo info;
+        uint32_t path_len;
+        uint32_t reserved;
+    };
+
+    static std::string ns_key(estring_view file_path) {
+        while (!file_path.empty() && file_path.front() == '/') {
+            file_path.remove_prefix(1);
+        }
+        return std::string(file_path);
+    }
+
+    bool is_meta_file(estring_view file_path) const {
+        auto key = ns_key(file_path);
+        return key == ns_key(SNAPSHOT_FILE) || key == ns_key(JOURNAL_FILE) ||
+               key == ns_key(SNAPSHOT_FILE) + ".tmp";
+    }
+
+    // reads the whole file at `path` into `buf`
+    int read_all(const char *path, std::string &buf) {
+        auto file = m_fs->open(path, O_RDONLY, 0644);
+        if (file == nullptr) {
+            return -1;
+        }
+        DEFER(delete file);
+        struct stat st {};
+        if (file->fstat(&st) != 0) {
+            return -1;
+        }
+        buf.resize(st.st_size);
+        if (file->pread(&buf[0], buf.size(), 0) != (ssize_t)buf.size()) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int load_snapshot() {
+        std::string buf;
+        if (m_fs->access(SNAPSHOT_FILE, F_OK) != 0) {
+            LOG_INFO("OCF: no namespace snapshot, walk through the namespace");
+            return -1;
+        }
+        if (read_all(SNAPSHOT_FILE, buf) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "OCF: failed to read namespace snapshot");
+        }
+
+        SnapshotHeader header;
+        if (buf.size() < sizeof(header)) {
+            LOG_ERROR_RETURN(0, -1, "OCF: namespace snapshot is truncated");
+        }
+        memcpy(&header, buf.data(), sizeof(header));
+        if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+            header.checksum != crc32::crc32c(&header, offsetof(SnapshotHeader, checksum))) {
+            LOG_ERROR_RETURN(0, -1, "OCF: namespace snapshot header error");
+        }
+        if (header.blk_size != m_blk_size) {
+            LOG_ERROR_RETURN(0, -1, "OCF: namespace snapshot of blk_size ` mismatches `",
+                             header.blk_size, m_blk_size);
+        }
+        auto data = buf.data() + sizeof(header);
+        if (header.data_size != buf.size() - sizeof(header) ||
+            header.data_checksum != crc32::crc32c(data, header.data_size)) {
+            LOG_ERROR_RETURN(0, -1, "OCF: namespace snapshot checksum error");
+        }
+
+        auto end = data + header.data_size;
+        while (data < end) {
+            SnapshotEntry entry;
+            if (end - data < (ssize_t)sizeof(entry)) {
+                LOG_ERROR_RETURN(0, -1, "OCF: namespace snapshot entry error");
+            }
+            memcpy(&entry, data, sizeof(entry));
+            data += sizeof(entry);
+            if (end - data < (ssize_t)entry.path_len) {
+                LOG_ERROR_RETURN(0, -1, "OCF: namespace snapshot entry error");
+            }
+            m_table[std::string(data, entry.path_len)] = entry.info;
+            data += entry.path_len;
+        }
+        if (m_table.size() != header.count) {
+            LOG_ERROR_RETURN(0, -1, "OCF: namespace snapshot has ` files, expect `",
+                             m_table.size(), header.count);
+        }
+        m_total_blocks = header.total_blocks;
+        return 0;
+    }
+
+    int open_journal() {
+        if (m_journal == nullptr) {
+            m_journal = m_fs->open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+            if (m_journal == nullptr) {
+                LOG_ERRNO_RETURN(0, -1, "OCF: failed to open namespace journal");
+            }
+        }
+        return 0;
+    }
+
+    int replay_journal() {
+        std::string buf;
+        if (read_all(JOURNAL_FILE, buf) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "OCF: failed to read namespace journal");
+        }
+
+        size_t pos = 0;
+        while (pos + sizeof(JournalRecord) <= buf.size()) {
+            JournalRecord record;
+            memcpy(&record, buf.data() + pos, sizeof(record));
+            auto size = sizeof(record) + record.path_len;
+            auto skip = offsetof(JournalRecord, info);
+            if (record.magic != JOURNAL_MAGIC || pos + size > buf.size() ||
+                record.checksum != crc32::crc32c(buf.data() + pos + skip, size - skip)) {
+                // torn by a crash
+                break;
+            }
+            auto &info = m_table[std::string(buf.data() + pos + sizeof(record), record.path_len)];
+            info = record.info;
+            m_total_blocks = std::max(m_total_blocks,
+                                      info.blk_idx + DIV_ROUND_UP(info.file_size, m_blk_size));
+            pos += size;
+        }
+        if (pos != buf.size()) {
+            LOG_WARN("OCF: drop ` bytes of torn namespace journal", buf.size() - pos);
+            if (m_journal->ftruncate(pos) != 0) {
+                LOG_ERRNO_RETURN(0, -1, "OCF: failed to truncate namespace journal");
+            }
+        }
+        m_journal_size = pos;
+        m_dirty = (pos != 0);
+        return 0;
+    }
+
+    int append_journal(const estring &file_path, const NsInfo &info) {
+        auto key = ns_key(file_path);
+        JournalRecord record = {
+            .magic = JOURNAL_MAGIC,
+            .checksum = 0,
+            .info = info,
+            .path_len = (uint32_t)key.size(),
+        };
+        std::string buf((const char *)&record, sizeof(record));
+        buf.append(key);
+        auto skip = offsetof(JournalRecord, info);
+        record.checksum = crc32::crc32c(buf.data() + skip, buf.size() - skip);
+        memcpy(&buf[0], &record, sizeof(record));
+
+        if (m_journal->pwrite(buf.data(), buf.size(), m_journal_size) != (ssize_t)buf.size() ||
+            m_journal->fdatasync() != 0) {
+            // overwritten by the next record
+            LOG_ERRNO_RETURN(0, -1, "OCF: failed to write namespace journal");
+        }
+        m_journal_size += buf.size();
+        m_table[key] = info;
+        m_dirty = true;
+        return 0;
+    }
+
     int get_ns_info(estring_view file_path, NsInfo &info) {
         auto file = m_fs->open(file_path.data(), O_RDONLY, 0644);
         if (file == nullptr) {
@@ -122,14 +418,17 @@ private:
         info.blk_idx = (off_t)m_total_blocks;
         info.file_size = file_size;
 
-        if (write_ns_info(file_path, info) != 0) {
-            LOG_ERROR_RETURN(0, -1, "OCF: failed to write namespace file");
+        // Journal first, so that the blocks are never reused after a crash
+        if (append_journal(file_path, info) != 0) {
+            LOG_ERROR_RETURN(0, -1, "OCF: failed to journal namespace file");
         }
-
-        // Update total_blocks at last
         size_t num_blocks = DIV_ROUND_UP(file_size, m_blk_size);
         m_total_blocks += num_blocks;
 
+        if (write_ns_info(file_path, info) != 0) {
+            LOG_ERROR_RETURN(0, -1, "OCF: failed to write namespace file");
+        }
+
         LOG_DEBUG("OCF: append namespace, file `, blk_idx `, size `", file_path, info.blk_idx,
                   info.file_size);
         return 0;
@@ -168,9 +467,19 @@ private:
     }
 
     const uint32_t NS_FILE_MAGIC = UINT32_MAX - 1;
+    const uint32_t SNAPSHOT_MAGIC = UINT32_MAX - 2;
+    const uint32_t SNAPSHOT_VERSION = 1;
+    const uint32_t JOURNAL_MAGIC = UINT32_MAX - 3;
+    const char *const SNAPSHOT_FILE = "/.ns_snapshot";
+    const char *const JOURNAL_FILE = "/.ns_journal";
     size_t m_total_blocks = 0;
     photon::fs::IFileSystem *m_fs; // owned by external class
     photon::mutex m_mutex;
+    photon::mutex m_checkpoint_mutex;
+    std::unordered_map<std::string, NsInfo> m_table;
+    photon::fs::IFile *m_journal = nullptr; // owned by self
+    size_t m_journal_size = 0;
+    bool m_dirty = false;
 };
 
 OcfNamespace *new_ocf_namespace_on_fs(size_t blk_size, photon::fs::IFileSystem *fs) {
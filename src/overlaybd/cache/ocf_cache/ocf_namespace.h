@@ -34,6 +34,15 @@ public:
     virtual int locate_file(const estring &file_path, photon::fs::IFile *src_file,
                             NsInfo &info) = 0;
 
+    /**
+     * @brief Persist the namespace table as a snapshot, which init() loads at once instead of
+     * walking through the whole namespace
+     * @retval 0 for success
+     */
+    virtual int checkpoint() {
+        return 0;
+    }
+
     size_t block_size() const {
         return m_blk_size;
     }
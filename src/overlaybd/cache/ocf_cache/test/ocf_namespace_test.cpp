@@ -0,0 +1,266 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/fs/localfs.h>
+#include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
+#include "../ocf_namespace.h"
+
+using namespace photon::fs;
+
+static const std::string kRoot = "/tmp/ocf_namespace_test/";
+static const std::string kNsDir = kRoot + "ns/";
+static const std::string kSnapshot = kNsDir + ".ns_snapshot";
+static const std::string kJournal = kNsDir + ".ns_journal";
+static const size_t kBlkSize = 4096;
+
+class OcfNamespaceTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        system(("rm -rf " + kRoot).c_str());
+        system(("mkdir -p " + kNsDir).c_str());
+        m_ns_fs.reset(new_localfs_adaptor(kNsDir.c_str()));
+        m_src_fs.reset(new_localfs_adaptor(kRoot.c_str()));
+    }
+
+    void TearDown() override {
+        m_ns.reset();
+        m_ns_fs.reset();
+        m_src_fs.reset();
+    }
+
+    // reopens the namespace as after a restart
+    int reopen() {
+        m_ns.reset(new_ocf_namespace_on_fs(kBlkSize, m_ns_fs.get()));
+        return m_ns->init();
+    }
+
+    OcfNamespace::NsInfo locate(const char *path, size_t size) {
+        auto src_path = std::string("src_") + std::to_string(size);
+        std::unique_ptr<IFile> src(m_src_fs->open(src_path.c_str(), O_RDWR | O_CREAT, 0644));
+        EXPECT_NE(nullptr, src.get());
+        EXPECT_EQ(0, src->ftruncate(size));
+        OcfNamespace::NsInfo info{};
+        EXPECT_EQ(0, m_ns->locate_file(path, src.get(), info));
+        return info;
+    }
+
+    // locates two files in a fresh namespace, without checkpoint
+    void prepare() {
+        ASSERT_EQ(0, reopen());
+        m_a = locate("/a", 3 * kBlkSize);
+        m_b = locate("/dir/b", kBlkSize + 1);
+        EXPECT_EQ(0, m_a.blk_idx);
+        EXPECT_EQ(3, m_b.blk_idx);
+    }
+
+    static void expect_same(const OcfNamespace::NsInfo &x, const OcfNamespace::NsInfo &y) {
+        EXPECT_EQ(x.blk_idx, y.blk_idx);
+        EXPECT_EQ(x.file_size, y.file_size);
+    }
+
+    static off_t file_size(const std::string &path) {
+        struct stat st {};
+        if (::stat(path.c_str(), &st) != 0) {
+            return -1;
+        }
+        return st.st_size;
+    }
+
+    static void flip_byte(const std::string &path, off_t offset) {
+        auto fd = ::open(path.c_str(), O_RDWR);
+        ASSERT_GE(fd, 0);
+        char c;
+        ASSERT_EQ(1, ::pread(fd, &c, 1, offset));
+        c = ~c;
+        ASSERT_EQ(1, ::pwrite(fd, &c, 1, offset));
+        ::close(fd);
+    }
+
+    static void append_bytes(const std::string &path, size_t count) {
+        auto fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        ASSERT_GE(fd, 0);
+        std::string garbage(count, 'x');
+        ASSERT_EQ((ssize_t)count, ::write(fd, garbage.data(), count));
+        ::close(fd);
+    }
+
+    std::unique_ptr<IFileSystem> m_ns_fs, m_src_fs;
+    std::unique_ptr<OcfNamespace> m_ns;
+    OcfNamespace::NsInfo m_a{}, m_b{};
+};
+
+// The per-file ns file of /a is removed before reopening in the tests below, so /a is
+// located at its original place only when the table is recovered from snapshot and journal,
+// and is appended to the end of the namespace when the namespace fs is walked through.
+
+TEST_F(OcfNamespaceTest, load_snapshot) {
+    prepare();
+    ASSERT_EQ(0, m_ns->checkpoint());
+    EXPECT_EQ(0, file_size(kJournal));
+    ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+    ASSERT_EQ(0, reopen());
+    expect_same(m_a, locate("/a", 3 * kBlkSize));
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+    EXPECT_EQ(5, locate("/c", 1).blk_idx);
+}
+
+TEST_F(OcfNamespaceTest, replay_journal) {
+    prepare();
+    auto journal_size = file_size(kJournal);
+    EXPECT_GT(journal_size, 0);
+    ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+    ASSERT_EQ(0, reopen());
+    EXPECT_EQ(journal_size, file_size(kJournal));
+    expect_same(m_a, locate("/a", 3 * kBlkSize));
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+    EXPECT_EQ(5, locate("/c", 1).blk_idx);
+
+    // the journal is emptied by the next checkpoint
+    ASSERT_EQ(0, m_ns->checkpoint());
+    EXPECT_EQ(0, file_size(kJournal));
+}
+
+TEST_F(OcfNamespaceTest, torn_journal) {
+    prepare();
+    auto journal_size = file_size(kJournal);
+    append_bytes(kJournal, 10);
+    ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+    ASSERT_EQ(0, reopen());
+    EXPECT_EQ(journal_size, file_size(kJournal));
+    expect_same(m_a, locate("/a", 3 * kBlkSize));
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+    EXPECT_EQ(5, locate("/c", 1).blk_idx);
+}
+
+TEST_F(OcfNamespaceTest, corrupted_journal_record) {
+    ASSERT_EQ(0, reopen());
+    m_a = locate("/a", 3 * kBlkSize);
+    auto first_record = file_size(kJournal);
+    m_b = locate("/dir/b", kBlkSize + 1);
+    // a bit rot in the path of /dir/b
+    flip_byte(kJournal, file_size(kJournal) - 1);
+    ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+    ASSERT_EQ(0, reopen());
+    EXPECT_EQ(first_record, file_size(kJournal));
+    expect_same(m_a, locate("/a", 3 * kBlkSize));
+    // found by its ns file instead
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+}
+
+TEST_F(OcfNamespaceTest, corrupted_snapshot) {
+    prepare();
+    ASSERT_EQ(0, m_ns->checkpoint());
+    // a bit rot in the entries
+    flip_byte(kSnapshot, file_size(kSnapshot) - 1);
+    ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+    ASSERT_EQ(0, reopen());
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+    EXPECT_EQ(5, locate("/a", 3 * kBlkSize).blk_idx);
+
+    // the walk takes a new snapshot, which loads next time
+    ASSERT_EQ(0, m_ns->checkpoint());
+    ASSERT_EQ(0, m_ns_fs->unlink("/dir/b"));
+    ASSERT_EQ(0, reopen());
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+}
+
+TEST_F(OcfNamespaceTest, corrupted_snapshot_header) {
+    prepare();
+    ASSERT_EQ(0, m_ns->checkpoint());
+    flip_byte(kSnapshot, 8);
+    ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+    ASSERT_EQ(0, reopen());
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+    EXPECT_EQ(5, locate("/a", 3 * kBlkSize).blk_idx);
+}
+
+TEST_F(OcfNamespaceTest, truncated_snapshot) {
+    // in the entries, and in the header
+    for (bool in_header : {false, true}) {
+        prepare();
+        ASSERT_EQ(0, m_ns->checkpoint());
+        auto size = in_header ? 10 : file_size(kSnapshot) - 1;
+        ASSERT_EQ(0, ::truncate(kSnapshot.c_str(), size));
+        ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+        ASSERT_EQ(0, reopen());
+        expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+        EXPECT_EQ(5, locate("/a", 3 * kBlkSize).blk_idx);
+        TearDown();
+        SetUp();
+    }
+}
+
+TEST_F(OcfNamespaceTest, missing_snapshot) {
+    prepare();
+    ASSERT_EQ(0, m_ns->checkpoint());
+    auto c = locate("/c", 1);
+    EXPECT_GT(file_size(kJournal), 0);
+    m_ns.reset();
+    ASSERT_EQ(0, ::unlink(kSnapshot.c_str()));
+    ASSERT_EQ(0, m_ns_fs->unlink("/a"));
+
+    // the journal is never replayed without its snapshot
+    ASSERT_EQ(0, reopen());
+    EXPECT_EQ(0, file_size(kJournal));
+    expect_same(m_b, locate("/dir/b", kBlkSize + 1));
+    expect_same(c, locate("/c", 1));
+    EXPECT_EQ(6, locate("/a", 3 * kBlkSize).blk_idx);
+}
+
+TEST_F(OcfNamespaceTest, append_during_checkpoint) {
+    prepare();
+    auto th = photon::thread_enable_join(photon::thread_create11([&] {
+        EXPECT_EQ(0, m_ns->checkpoint());
+    }));
+    // locates /c right after the checkpoint takes the table
+    photon::thread_yield();
+    auto c = locate("/c", 1);
+    photon::thread_join(th);
+    EXPECT_EQ(5, c.blk_idx);
+    ASSERT_EQ(0, m_ns_fs->unlink("/c"));
+
+    // /c is either in the snapshot, or kept in the journal
+    ASSERT_EQ(0, reopen());
+    expect_same(c, locate("/c", 1));
+}
+
+int main(int argc, char **argv) {
+    log_output_level = ALOG_ERROR;
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
+    DEFER(photon::fini());
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
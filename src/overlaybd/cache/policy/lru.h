@@ -93,6 +93,10 @@ public:
         assert(m_size > 0);
         return PTR(PTR(PTR(m_head)->prev)->prev)->val;
     }
+    value_type &value(key_type i) {
+        assert(i < m_array.size());
+        return PTR(i)->val;
+    }
     size_t size() {
         return m_size;
     }
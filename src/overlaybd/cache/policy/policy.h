@@ -0,0 +1,111 @@
+
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include "lru.h"
+#include "slru.h"
+#include <errno.h>
+
+namespace FileSystem {
+enum EvictionPolicyType {
+    EVICTION_POLICY_LRU = 0,
+    EVICTION_POLICY_SLRU = 1, // scan-resistant segmented LRU
+};
+
+// An eviction policy keeps track of the entries of a cache and picks the
+// victim with back(). Keys returned by push_front() stay valid until remove().
+template <typename ValueType, typename KeyType = uint16_t>
+class IEvictionPolicy {
+public:
+    using value_type = ValueType;
+    using key_type = KeyType;
+    virtual ~IEvictionPolicy() {
+    }
+    virtual key_type push_front(value_type v) = 0;
+    // a reference to `i` that is a reuse of it
+    virtual void access(key_type i) = 0;
+    // a reference to `i` that refreshes its recency only, e.g. a correlated
+    // reference within a short period, or keeping a busy entry from eviction
+    virtual void requeue(key_type i) = 0;
+    virtual void mark_key_cleared(key_type i) = 0;
+    virtual void remove(key_type i) = 0;
+    virtual value_type &back() = 0;
+    virtual value_type &value(key_type i) = 0;
+    virtual size_t size() = 0;
+    virtual bool empty() = 0;
+};
+
+template <typename Container>
+class EvictionPolicy
+    : public IEvictionPolicy<typename Container::value_type, typename Container::key_type> {
+public:
+    using value_type = typename Container::value_type;
+    using key_type = typename Container::key_type;
+    virtual key_type push_front(value_type v) override {
+        return m_container.push_front(v);
+    }
+    virtual void access(key_type i) override {
+        m_container.access(i);
+    }
+    virtual void requeue(key_type i) override {
+        do_requeue(m_container, i);
+    }
+    virtual void mark_key_cleared(key_type i) override {
+        m_container.mark_key_cleared(i);
+    }
+    virtual void remove(key_type i) override {
+        m_container.remove(i);
+    }
+    virtual value_type &back() override {
+        return m_container.back();
+    }
+    virtual value_type &value(key_type i) override {
+        return m_container.value(i);
+    }
+    virtual size_t size() override {
+        return m_container.size();
+    }
+    virtual bool empty() override {
+        return m_container.empty();
+    }
+
+protected:
+    Container m_container;
+
+    // LRU doesn't tell reuses from other references
+    static void do_requeue(LRU<value_type, key_type> &c, key_type i) {
+        c.access(i);
+    }
+    template <typename C>
+    static void do_requeue(C &c, key_type i) {
+        c.requeue(i);
+    }
+};
+
+// returns nullptr with errno = EINVAL if `type` is unknown
+template <typename ValueType, typename KeyType = uint16_t>
+IEvictionPolicy<ValueType, KeyType> *new_eviction_policy(int type) {
+    switch (type) {
+    case EVICTION_POLICY_LRU:
+        return new EvictionPolicy<LRU<ValueType, KeyType>>();
+    case EVICTION_POLICY_SLRU:
+        return new EvictionPolicy<SLRU<ValueType, KeyType>>();
+    default:
+        errno = EINVAL;
+        return nullptr;
+    }
+}
+} // namespace FileSystem
@@ -0,0 +1,135 @@
+
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include "lru.h"
+
+namespace FileSystem {
+// A segmented LRU container, with the same interface and key semantics as LRU.
+// New entries are inserted into a probationary segment, and only a hit by
+// access() promotes an entry into the protected segment, which is capped at
+// a percentage of all the entries. Entries overflowing the protected segment
+// are demoted to the head of probation, and victims are taken from the tail
+// of probation first, so a burst of one-time references (e.g. a scan) can't
+// flush the entries that have proven to be reused.
+template <typename ValueType, typename KeyType = uint16_t>
+class SLRU {
+public:
+    using value_type = ValueType;
+    using key_type = KeyType;
+    static_assert(std::is_unsigned<KeyType>::value, "KeyType must be unsigned integer");
+
+    // maximum # of entries in the SLRU container
+    const static size_t LIMIT = LRU<key_type, key_type>::LIMIT - 1;
+
+    explicit SLRU(uint32_t protected_percent = 80) : m_protected_percent(protected_percent) {
+    }
+
+    // Insert a value into the probationary segment, returning a key that is
+    // guaranteed not to change during the lifetime.
+    key_type push_front(value_type v) {
+        assert(m_size < LIMIT);
+        key_type i;
+        if (m_free.empty()) {
+            i = (key_type)m_array.size();
+            m_array.emplace_back();
+        } else {
+            i = m_free.back();
+            m_free.pop_back();
+        }
+        m_array[i].val = v;
+        m_array[i].seg = PROBATION;
+        m_array[i].pos = m_probation.push_front(i);
+        m_size++;
+        return i;
+    }
+    // a reference that proves `i` to be reused, promoting it to the protected segment
+    void access(key_type i) {
+        assert(i < m_array.size());
+        auto &r = m_array[i];
+        if (r.seg == PROTECTED)
+            return m_protected.access(r.pos);
+        unlink(i);
+        r.seg = PROTECTED;
+        r.pos = m_protected.push_front(i);
+        while (m_protected.size() > 1 && m_protected.size() * 100 > m_size * m_protected_percent) {
+            auto j = m_protected.back();
+            m_protected.pop_back();
+            m_array[j].seg = PROBATION;
+            m_array[j].pos = m_probation.push_front(j);
+        }
+    }
+    // move `i` to the head of its segment, without promoting it
+    void requeue(key_type i) {
+        assert(i < m_array.size());
+        auto &r = m_array[i];
+        if (r.seg == PROTECTED)
+            return m_protected.access(r.pos);
+        if (r.seg == PROBATION)
+            return m_probation.access(r.pos);
+        r.seg = PROBATION;
+        r.pos = m_probation.push_front(i);
+    }
+    // mark `i` as cleared, so it is no longer a candidate for eviction,
+    // `access()`, `requeue()` and `remove()` apply as usual
+    void mark_key_cleared(key_type i) {
+        assert(i < m_array.size());
+        unlink(i);
+        m_array[i].seg = CLEARED;
+    }
+    void remove(key_type i) {
+        assert(i < m_array.size());
+        unlink(i);
+        m_array[i].seg = CLEARED;
+        m_free.push_back(i);
+        m_size--;
+    }
+    value_type &back() {
+        return m_array[m_probation.empty() ? m_protected.back() : m_probation.back()].val;
+    }
+    value_type &value(key_type i) {
+        assert(i < m_array.size());
+        return m_array[i].val;
+    }
+    size_t size() {
+        return m_size;
+    }
+    bool empty() {
+        return m_probation.empty() && m_protected.empty();
+    }
+
+protected:
+    enum Segment : uint8_t { CLEARED, PROBATION, PROTECTED };
+    struct Record {
+        value_type val;
+        key_type pos; // key in the LRU ring of its segment
+        Segment seg;
+    };
+    std::vector<Record> m_array;
+    std::vector<key_type> m_free;
+    uint64_t m_size = 0; // # of valid records (excluding free)
+    uint32_t m_protected_percent;
+    LRU<key_type, key_type> m_probation, m_protected;
+
+    void unlink(key_type i) {
+        auto &r = m_array[i];
+        if (r.seg == PROBATION)
+            m_probation.remove(r.pos);
+        else if (r.seg == PROTECTED)
+            m_protected.remove(r.pos);
+    }
+};
+} // namespace FileSystem
@@ -14,6 +14,7 @@
    limitations under the License.
 */
 #pragma once
+#include <map>
 #include <vector>
 #include <assert.h>
 #include <inttypes.h>
@@ -26,6 +27,7 @@
 #include <photon/common/range-lock.h>
 #include <photon/common/iovector.h>
 #include <photon/fs/filesystem.h>
+#include <photon/thread/thread.h>
 
 enum ListType : int {
     LIST_ALL = 0,
@@ -123,6 +125,17 @@ public:
         return -1;
     }
 
+    // let refills of sequential reads grow from `min` up to `max` bytes,
+    // and shrink back on random ones, `max` of 0 (default) disables it
+    void set_refill_window(uint64_t min, uint64_t max) {
+        m_refill_window_min = min;
+        m_refill_window_max = max;
+    }
+    // the refill window most recently updated by a store
+    uint64_t get_refill_window() {
+        return m_refill_window.load(std::memory_order_relaxed);
+    }
+
 protected:
     void *m_stores;
     CacheFnTransFunc fn_trans_func;
@@ -131,6 +144,9 @@ protected:
     std::atomic<uint32_t> m_refilling{0};
     const uint32_t m_max_refilling = 128;
     const uint32_t m_refilling_threshold = -1U;
+    uint64_t m_refill_window_min = 0;
+    uint64_t m_refill_window_max = 0;
+    std::atomic<uint64_t> m_refill_window{0};
     friend class ICacheStore;
 };
 
@@ -142,6 +158,8 @@ public:
     ssize_t preadv2(const struct iovec *iov, int iovcnt, off_t offset, int flags);
     ssize_t pwritev2(const struct iovec *iov, int iovcnt, off_t offset, int flags);
     ssize_t try_refill_range(off_t offset, size_t count);
+    // write back the dirty ranges of O_WRITE_BACK, then sync the source file
+    int flush();
 
     virtual int set_quota(size_t quota) = 0;
     virtual int stat(CacheStat *stat) = 0;
@@ -163,6 +181,8 @@ public:
 
     void release() {
         auto ref = ref_.fetch_sub(1, std::memory_order_relaxed);
+        if (ref <= 1)
+            stop_flusher();
         if (ref == 1 && pool_) {
             pool_->store_release(this);
         } else if (ref == 0)
@@ -246,12 +266,36 @@ public:
     virtual ssize_t do_pwritev2(const struct iovec *iov, int iovcnt, off_t offset, int flags);
     virtual ssize_t do_pwritev2_mutable(struct iovec *iov, int iovcnt, off_t offset, int flags);
 
+protected:
+    // called whenever the dirty bytes of O_WRITE_BACK change, including those
+    // being written back, so that the cache keeps them from eviction
+    virtual void dirty_changed(size_t dirty_size) {
+    }
+
 private:
     ssize_t pwritev2_extend(const struct iovec *iov, int iovcnt, off_t offset, int flags);
+    size_t insert_dirty(off_t offset, off_t end);
+    int mark_dirty(off_t offset, size_t count, size_t writing);
+    int flush_range(off_t offset, size_t count);
+    void stop_flusher();
+    static void *flush_dirty(void *args);
     ssize_t do_refill_range(uint64_t refill_off, uint64_t refill_size, size_t count,
                             IOVector *input = nullptr, off_t offset = 0, int flags = 0);
     int tryget_size();
+    // returns the refill window for a sequential read, or 0
+    uint64_t update_refill_window(off_t offset, size_t count);
     static void *async_refill(void *args);
+    struct Refill;
+    Refill *attach_refill(off_t offset, size_t size, bool *leader);
+    // with refill_lock_ held
+    bool extend_refill(Refill *refill, off_t offset, off_t end);
+    void finish_refill(Refill *refill);
+    // with refill_lock_ held
+    void unref_refill(Refill *refill);
+    // whether the source fetches several ranges with one request
+    bool batches_refills();
+    // fetches the claimed refills, then publishes their results
+    void fetch_refills(std::vector<Refill *> &refills, int flags);
 
 protected:
     std::string src_name_;
@@ -261,13 +305,32 @@ protected:
     off_t actual_size_ = 0;
     int open_flags_ = 0;
     std::atomic<uint32_t> ref_{0};
+    // for detecting sequential reads, which grow the refill window
+    std::atomic<off_t> next_offset_{-1};
+    std::atomic<uint64_t> refill_window_{0};
     photon::fs::IFile *src_file_ = nullptr;
     photon::fs::IFileSystem *src_fs_ = nullptr;
     size_t page_size_ = 4096;
     IOAlloc *allocator_ = nullptr;
-    RangeLock range_lock_;
+    // refills in flight by offset, guarded by refill_lock_
+    std::map<off_t, Refill *> refills_;
+    photon::mutex refill_lock_;
+    int batch_refills_ = -1; // for batches_refills(), unknown if -1
     photon::mutex open_lock_;
+    // dirty ranges of O_WRITE_BACK, from offset to end, written back by a
+    // flusher thread in the order of offset
+    std::map<off_t, off_t> dirty_;
+    size_t dirty_size_ = 0; // in bytes, of dirty_
+    size_t flushing_ = 0;   // in bytes, being written back
+    size_t writing_ = 0;    // in bytes, being written to the cache
+    uint64_t flush_failures_ = 0;
+    int flush_errno_ = 0;
+    bool flusher_running_ = false;
+    bool flusher_stop_ = false;
+    photon::mutex dirty_lock_;
+    photon::condition_variable dirty_cond_;
     friend class ICachePool;
+    friend struct RefillContext;
 };
 
 class IMemCacheStore : public ICacheStore {
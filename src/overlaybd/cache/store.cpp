@@ -15,6 +15,8 @@
 */
 #include "pool_store.h"
 #include "cache.h"
+#include "../registryfs/registryfs.h"
+#include <algorithm>
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/alog-audit.h>
@@ -28,7 +30,12 @@ using namespace photon::fs;
 
 namespace FileSystem {
 
-static const uint32_t MAX_REFILLING = 128;
+static const size_t MAX_MERGED_REFILL = 4UL * 1024 * 1024;   // max bytes of a merged refill
+static const size_t MAX_BATCHED_REFILLS = 16;                // max refills fetched at once
+static const uint64_t REFILL_MERGE_WINDOW = 200;             // in us
+static const size_t WRITE_BACK_UNIT = 1024 * 1024;          // max bytes written back at a time
+static const size_t MAX_DIRTY_SIZE = 64UL * 1024 * 1024;    // writers wait beyond it
+static const uint64_t FLUSH_RETRY_INTERVAL = 1000UL * 1000; // in us
 
 ICacheStore::~ICacheStore() {
     delete src_file_;
@@ -65,6 +72,7 @@ ssize_t ICacheStore::preadv2(const struct iovec *iov, int iovcnt, off_t offset,
         }
     }
 
+    auto window = update_refill_window(offset, iov_size);
 again:
     auto tr = try_preadv2(input.iovec(), input.iovcnt(), offset, flags);
     if (tr.refill_size == 0 && tr.size >= 0)
@@ -75,6 +83,14 @@ again:
                          iov_size, flags);
     }
 
+    if (tr.refill_offset >= 0 && window > tr.refill_size && tr.refill_offset < actual_size_) {
+        // read ahead the missing range within the window
+        auto q = queryRefillRange(
+            tr.refill_offset, std::min<off_t>(window, actual_size_ - tr.refill_offset));
+        if (q.first == tr.refill_offset && q.second > tr.refill_size)
+            tr.refill_size = q.second;
+    }
+
     if (tr.refill_offset < 0) {
         SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), offset, tr.size));
         tr.size = src_file_->preadv2(input.iovec(), input.iovcnt(), offset, flags);
@@ -89,7 +105,33 @@ again:
 }
 
 ssize_t ICacheStore::pwritev2(const struct iovec *iov, int iovcnt, off_t offset, int flags) {
-    if (open_flags_ & (O_WRITE_THROUGH | O_CACHE_ONLY | O_WRITE_BACK)) {
+    if (open_flags_ & O_WRITE_BACK) {
+        iovector_view view(const_cast<struct iovec *>(iov), iovcnt);
+        size_t size = view.sum();
+        // the partial tail page is evicted when appended, so write it back first
+        if (cached_size_ % page_size_ != 0 && offset + static_cast<off_t>(size) > cached_size_ &&
+            flush() != 0)
+            return -1;
+        {
+            photon::scoped_lock l(dirty_lock_);
+            auto failures = flush_failures_;
+            while (dirty_size_ + flushing_ > MAX_DIRTY_SIZE && flusher_running_) {
+                if (flush_failures_ != failures)
+                    LOG_ERROR_RETURN(flush_errno_, -1, "failed to write back dirty data of `",
+                                     src_name_);
+                dirty_cond_.wait(l);
+            }
+            // keeps the range from eviction until it is marked dirty
+            writing_ += size;
+            dirty_changed(dirty_size_ + flushing_ + writing_);
+        }
+        auto ret = pwritev2_extend(iov, iovcnt, offset, flags);
+        if (mark_dirty(offset, ret > 0 ? ret : 0, size) != 0)
+            return -1;
+        return ret;
+    }
+
+    if (open_flags_ & (O_WRITE_THROUGH | O_CACHE_ONLY)) {
         return pwritev2_extend(iov, iovcnt, offset, flags);
     }
 
@@ -166,27 +208,119 @@ again:
     return ret;
 }
 
+// A refill of [offset, offset + size) of the source, from fetching it until it
+// is written to the cache. Readers missing a range it covers wait for it and
+// take their data from its buffer, and adjacent misses extend it during its
+// merge window, so that they are fetched with one request. The window is held
+// only while other refills or readers are around.
+struct ICacheStore::Refill {
+    off_t offset;
+    size_t size;
+    IOVector buffer;
+    ssize_t result = 0;    // 0 until fetched, then the size fetched, or -1
+    bool fetching = false; // can't be extended any more
+    bool done = false;     // written to the cache, and removed from refills_
+    int refs = 2;          // held by the reader fetching it and the writer
+    photon::condition_variable cond;
+
+    Refill(off_t offset, size_t size, IOAlloc *allocator)
+        : offset(offset), size(size), buffer(*allocator) {
+    }
+    off_t end() const {
+        return offset + size;
+    }
+};
+
+ICacheStore::Refill *ICacheStore::attach_refill(off_t offset, size_t size, bool *leader) {
+    photon::scoped_lock l(refill_lock_);
+    off_t end = offset + size;
+    auto it = refills_.upper_bound(offset);
+    if (it != refills_.begin() && std::prev(it)->second->end() > offset)
+        --it;
+    Refill *refill = nullptr;
+    if (it != refills_.end() && it->first < end) {
+        refill = it->second;
+        if ((refill->offset > offset || refill->end() < end) &&
+            !extend_refill(refill, offset, end)) {
+            // wait for the overlapping refill, then query the cache again
+            refill->refs++;
+            while (!refill->done)
+                refill->cond.wait(l);
+            unref_refill(refill);
+            return nullptr;
+        }
+    } else {
+        auto prev = (it != refills_.begin()) ? std::prev(it)->second : nullptr;
+        auto next = (it != refills_.end()) ? it->second : nullptr;
+        if (prev && prev->end() == offset && extend_refill(prev, offset, end))
+            refill = prev;
+        else if (next && next->offset == end && extend_refill(next, offset, end))
+            refill = next;
+    }
+    if (refill) {
+        refill->refs++;
+        *leader = false;
+        return refill;
+    }
+    refill = new Refill(offset, size, allocator_);
+    refills_.emplace(offset, refill);
+    *leader = true;
+    return refill;
+}
+
+bool ICacheStore::extend_refill(Refill *refill, off_t offset, off_t end) {
+    auto begin = std::min(offset, refill->offset);
+    end = std::max(end, refill->end());
+    if (refill->fetching || static_cast<size_t>(end - begin) > MAX_MERGED_REFILL)
+        return false;
+    auto it = refills_.find(refill->offset);
+    if (it != refills_.begin() && std::prev(it)->second->end() > begin)
+        return false;
+    if (std::next(it) != refills_.end() && std::next(it)->first < end)
+        return false;
+    if (begin != refill->offset) {
+        refills_.erase(it);
+        refills_.emplace(begin, refill);
+    }
+    refill->offset = begin;
+    refill->size = end - begin;
+    return true;
+}
+
+void ICacheStore::finish_refill(Refill *refill) {
+    photon::scoped_lock l(refill_lock_);
+    refills_.erase(refill->offset);
+    refill->done = true;
+    refill->cond.notify_all();
+    unref_refill(refill);
+}
+
+void ICacheStore::unref_refill(Refill *refill) {
+    if (--refill->refs == 0)
+        delete refill;
+}
+
 struct RefillContext {
     ICacheStore *store;
-    IOVector buffer;
-    uint64_t refill_off;
-    uint64_t refill_size;
+    ICacheStore::Refill *refill;
     int flags;
 };
 
 void *ICacheStore::async_refill(void *args) {
     auto ctx = (RefillContext *)args;
-    auto write = ctx->store->do_pwritev2(ctx->buffer.iovec(), ctx->buffer.iovcnt(), ctx->refill_off,
-                                         ctx->flags);
-    if (write != static_cast<ssize_t>(ctx->refill_size)) {
+    auto refill = ctx->refill;
+    auto write = ctx->store->do_pwritev2(refill->buffer.iovec(), refill->buffer.iovcnt(),
+                                         refill->offset, ctx->flags);
+    if (write != static_cast<ssize_t>(refill->size)) {
         if (ENOSPC != errno)
             LOG_ERROR(
                 "cache file write failed : `, error : `, actual_size_ : `, offset : `, sum : `",
-                write, ERRNO(errno), ctx->store->actual_size_, ctx->refill_off, ctx->buffer.sum());
+                write, ERRNO(errno), ctx->store->actual_size_, refill->offset,
+                refill->buffer.sum());
     }
 
     ctx->store->pool_->m_refilling.fetch_sub(1, std::memory_order_relaxed);
-    ctx->store->range_lock_.unlock(ctx->refill_off, ctx->refill_size);
+    ctx->store->finish_refill(refill);
     ctx->store->release();
     photon::thread_migrate(photon::CURRENT,
                            static_cast<photon::vcpu_base *>(ctx->store->pool_->m_vcpu));
@@ -194,6 +328,60 @@ void *ICacheStore::async_refill(void *args) {
     return nullptr;
 }
 
+bool ICacheStore::batches_refills() {
+    if (batch_refills_ < 0) {
+        if (src_file_->ioctl(REGISTRY_PREAD_RANGES, (RegistryRange *)nullptr, 0) == 0)
+            batch_refills_ = 1;
+        else if (errno == ENOSYS)
+            batch_refills_ = 0;
+    }
+    return batch_refills_ > 0;
+}
+
+void ICacheStore::fetch_refills(std::vector<Refill *> &refills, int flags) {
+    std::vector<ssize_t> results(refills.size(), -1);
+    std::vector<RegistryRange> ranges;
+    std::vector<size_t> batched;
+    for (size_t i = 0; i < refills.size(); i++) {
+        auto r = refills[i];
+        auto alloc = r->buffer.push_back(r->size);
+        if (alloc < r->size) {
+            LOG_ERROR("memory allocate failed, refill_size:`, alloc:`", r->size, alloc);
+        } else if (refills.size() > 1 && r->buffer.iovcnt() == 1) {
+            ranges.push_back({r->buffer.iovec()[0].iov_base, r->size, r->offset});
+            batched.push_back(i);
+        } else {
+            ssize_t ret = 0;
+            SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), r->offset, ret));
+            ret = src_file_->preadv2(r->buffer.iovec(), r->buffer.iovcnt(), r->offset, flags);
+            results[i] = ret;
+        }
+    }
+    if (!ranges.empty()) {
+        ssize_t ret = 0;
+        SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), ranges[0].offset, ret));
+        ret = registry_pread_ranges(src_file_, ranges.data(), ranges.size());
+        for (size_t j = 0; j < batched.size(); j++)
+            results[batched[j]] = ret < 0 ? -1 : static_cast<ssize_t>(ranges[j].count);
+    }
+
+    photon::scoped_lock l(refill_lock_);
+    for (size_t i = 0; i < refills.size(); i++) {
+        auto r = refills[i];
+        if (results[i] != static_cast<ssize_t>(r->size)) {
+            LOG_ERROR(
+                "src file read failed, read : `, expectRead : `, actual_size_ : `, offset : `, sum : `",
+                results[i], r->size, actual_size_, r->offset, r->buffer.sum());
+            results[i] = -1;
+        }
+        r->result = results[i];
+        r->cond.notify_all();
+        // the batched ones were referenced when claimed
+        if (i > 0)
+            unref_refill(r);
+    }
+}
+
 ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size, size_t count,
                                      IOVector *input, off_t offset, int flags) {
     ssize_t ret = 0;
@@ -208,42 +396,79 @@ ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size,
         refill_size = actual_size_ - refill_off;
     }
 
-    ret = range_lock_.try_lock_wait(refill_off, refill_size);
-    if (ret < 0)
+    bool leader = false;
+    auto refill = attach_refill(refill_off, refill_size, &leader);
+    if (refill == nullptr)
         return -EAGAIN;
-    {
-        static uint32_t max_refilling = pool_ ? pool_->m_max_refilling : MAX_REFILLING;
-        uint32_t refilling = max_refilling;
-        DEFER({
-            if (refilling >= max_refilling)
-                range_lock_.unlock(refill_off, refill_size);
-        });
-        IOVector buffer(*allocator_);
-        auto alloc = buffer.push_back(refill_size);
-        if (alloc < refill_size) {
-            LOG_ERROR("memory allocate failed, refill_size:`, alloc:`", refill_size, alloc);
-            if (input) {
-                SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), offset, ret));
-                ret = src_file_->preadv2(input->iovec(), input->iovcnt(), offset, flags);
-                return ret;
-            } else
-                return -1;
+    DEFER({
+        photon::scoped_lock l(refill_lock_);
+        unref_refill(refill);
+    });
+
+    if (leader) {
+        // let the misses already runnable merge into this refill, and hold a merge window
+        // only if there are other refills or readers to merge, so a lone miss isn't delayed
+        photon::thread_yield();
+        bool busy;
+        {
+            photon::scoped_lock l(refill_lock_);
+            busy = refills_.size() > 1 || refill->refs > 2;
         }
-
+        if (busy)
+            photon::thread_usleep(REFILL_MERGE_WINDOW);
+        bool batch = busy && batches_refills();
+        std::vector<Refill *> refills;
         {
-            SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), refill_off, ret));
-            ret = src_file_->preadv2(buffer.iovec(), buffer.iovcnt(), refill_off, flags);
+            photon::scoped_lock l(refill_lock_);
+            // unless fetched already in the batch of another refill
+            if (!refill->fetching) {
+                refill->fetching = true;
+                refills.push_back(refill);
+                // scattered refills still in their merge window are fetched along with it
+                for (auto it = refills_.begin(); batch && it != refills_.end() &&
+                                                 refills.size() < MAX_BATCHED_REFILLS;
+                     ++it) {
+                    auto r = it->second;
+                    if (!r->fetching) {
+                        r->fetching = true;
+                        r->refs++;
+                        refills.push_back(r);
+                    }
+                }
+            }
         }
-
-        if (ret != static_cast<ssize_t>(refill_size)) {
-            LOG_ERRNO_RETURN(
-                0, -1,
-                "src file read failed, read : `, expectRead : `, actual_size_ : `, offset : `, sum : `",
-                ret, refill_size, actual_size_, refill_off, buffer.sum());
+        if (!refills.empty())
+            fetch_refills(refills, flags);
+        {
+            photon::scoped_lock l(refill_lock_);
+            while (refill->result == 0)
+                refill->cond.wait(l);
+            ret = refill->result;
+        }
+        if (ret < 0) {
+            ERRNO err;
+            finish_refill(refill);
+            if (input && refill->buffer.sum() < refill->size) {
+                SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), offset, ret));
+                ret = src_file_->preadv2(input->iovec(), input->iovcnt(), offset, flags);
+                return ret;
+            }
+            errno = err.no;
+            return -1;
         }
+    } else {
+        photon::scoped_lock l(refill_lock_);
+        while (refill->result == 0)
+            refill->cond.wait(l);
+        if (refill->result < 0)
+            return -EAGAIN;
+    }
 
-        // buffer need async refill
-        IOVector refill_buf(buffer.iovec(), buffer.iovcnt());
+    {
+        // the refill may have been extended beyond the range missed by this read
+        refill_off = refill->offset;
+        refill_size = refill->size;
+        IOVector refill_buf(refill->buffer.iovec(), refill->buffer.iovcnt());
         if (input && (off_t)refill_off <= offset) {
             auto view = input->view();
             refill_buf.extract_front(offset - refill_off);
@@ -258,22 +483,25 @@ ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size,
         } else
             ret = 0;
 
-        if (input && pool_ && pool_->m_thread_pool &&
-            (refilling = pool_->m_refilling.load(std::memory_order_relaxed)) <
-                pool_->m_max_refilling) {
+        // buffer need async refill
+        if (leader && input && pool_ && pool_->m_thread_pool &&
+            pool_->m_refilling.load(std::memory_order_relaxed) < pool_->m_max_refilling) {
             pool_->m_refilling.fetch_add(1, std::memory_order_relaxed);
             ref_.fetch_add(1, std::memory_order_relaxed);
-            auto ctx = new RefillContext{this, std::move(buffer), refill_off, refill_size, flags};
+            auto ctx = new RefillContext{this, refill, flags};
             auto th = static_cast<photon::ThreadPoolBase *>(pool_->m_thread_pool)
                           ->thread_create(&async_refill, ctx);
             photon::thread_migrate(th, photon::get_vcpu());
-        } else {
-            auto write = do_pwritev2(buffer.iovec(), buffer.iovcnt(), refill_off, flags);
+        } else if (leader) {
+            auto write =
+                do_pwritev2(refill->buffer.iovec(), refill->buffer.iovcnt(), refill_off, flags);
+            ERRNO err;
+            finish_refill(refill);
             if (write != static_cast<ssize_t>(refill_size)) {
-                if (ENOSPC != errno)
+                if (ENOSPC != err.no)
                     LOG_ERROR(
                         "cache file write failed : `, error : `, actual_size_ : `, offset : `, sum : `",
-                        write, ERRNO(errno), actual_size_, refill_off, buffer.sum());
+                        write, err, actual_size_, refill_off, refill_size);
                 if (!input)
                     return -1;
             }
@@ -360,7 +588,7 @@ int ICacheStore::open_src_file(IFile **src_file) {
             *src_file = src_file_;
         return 0;
     }
-    int flags = O_RDONLY;
+    int flags = (open_flags_ & O_WRITE_BACK) ? O_RDWR : O_RDONLY;
     if (open_flags_ & (O_WRITE_THROUGH | O_WRITE_BACK))
         flags |= O_CREAT;
     src_file_ = src_fs_->open(src_name_.c_str(), flags);
@@ -417,6 +645,9 @@ int ICacheStore::tryget_size() {
     buf.st_size = 0;
     if ((src_file_ && src_file_->fstat(&buf) != 0) || (!src_file_ && fstat(&buf) != 0))
         return -1;
+    // the source lags behind the cache until the dirty ranges are written back
+    if ((open_flags_ & O_WRITE_BACK) && buf.st_size < actual_size_)
+        return 0;
     if (buf.st_size != actual_size_) {
         set_cached_size(buf.st_size);
         actual_size_ = buf.st_size;
@@ -424,4 +655,142 @@ int ICacheStore::tryget_size() {
     return 0;
 }
 
+uint64_t ICacheStore::update_refill_window(off_t offset, size_t count) {
+    if (!pool_ || pool_->m_refill_window_max == 0)
+        return 0;
+    auto min = pool_->m_refill_window_min, max = pool_->m_refill_window_max;
+    bool sequential = next_offset_.exchange(offset + count, std::memory_order_relaxed) == offset;
+    auto window = std::max(refill_window_.load(std::memory_order_relaxed), min);
+    window = sequential ? std::min(window * 2, max) : std::max(window / 2, min);
+    refill_window_.store(window, std::memory_order_relaxed);
+    pool_->m_refill_window.store(window, std::memory_order_relaxed);
+    return sequential ? window : 0;
+}
+
+size_t ICacheStore::insert_dirty(off_t offset, off_t end) {
+    size_t merged = 0;
+    auto it = dirty_.upper_bound(offset);
+    if (it != dirty_.begin() && std::prev(it)->second >= offset)
+        --it;
+    while (it != dirty_.end() && it->first <= end) {
+        merged += it->second - it->first;
+        offset = std::min(offset, it->first);
+        end = std::max(end, it->second);
+        it = dirty_.erase(it);
+    }
+    dirty_[offset] = end;
+    return end - offset - merged;
+}
+
+int ICacheStore::mark_dirty(off_t offset, size_t count, size_t writing) {
+    photon::scoped_lock l(dirty_lock_);
+    writing_ -= writing;
+    if (count)
+        dirty_size_ += insert_dirty(offset, offset + count);
+    dirty_changed(dirty_size_ + flushing_ + writing_);
+    if (!flusher_running_ && dirty_size_ > 0) {
+        if (!photon::thread_create(&flush_dirty, this))
+            LOG_ERRNO_RETURN(0, -1, "failed to create flusher of `", src_name_);
+        flusher_running_ = true;
+    }
+    dirty_cond_.notify_all();
+    return 0;
+}
+
+int ICacheStore::flush_range(off_t offset, size_t count) {
+    if (open_src_file() != 0)
+        return -1;
+    if (!src_file_)
+        LOG_ERROR_RETURN(EBADF, -1, "no source file to write back, name : `", src_name_);
+    IOVector buffer(*allocator_);
+    if (buffer.push_back(count) < count)
+        LOG_ERROR_RETURN(ENOMEM, -1, "memory allocate failed, count : `", count);
+    auto ret = do_preadv2(buffer.iovec(), buffer.iovcnt(), offset, 0);
+    if (ret != static_cast<ssize_t>(count))
+        LOG_ERRNO_RETURN(0, -1, "cache file read failed, read : `, offset : `, count : `", ret,
+                         offset, count);
+    SCOPE_AUDIT("upload", AU_FILEOP(get_src_name(), offset, ret));
+    ret = src_file_->pwritev(buffer.iovec(), buffer.iovcnt(), offset);
+    if (ret != static_cast<ssize_t>(count))
+        LOG_ERRNO_RETURN(0, -1, "src file write failed, write : `, offset : `, count : `", ret,
+                         offset, count);
+    return 0;
+}
+
+void *ICacheStore::flush_dirty(void *args) {
+    auto store = (ICacheStore *)args;
+    photon::scoped_lock l(store->dirty_lock_);
+    while (!store->flusher_stop_) {
+        if (store->dirty_.empty()) {
+            store->dirty_cond_.wait(l);
+            continue;
+        }
+        // take the range out before copying it, so that writes to it during
+        // the copy mark it dirty again
+        auto it = store->dirty_.begin();
+        off_t offset = it->first;
+        size_t count = std::min<size_t>(it->second - offset, WRITE_BACK_UNIT);
+        if (offset + static_cast<off_t>(count) < it->second)
+            store->dirty_[offset + count] = it->second;
+        store->dirty_.erase(it);
+        store->dirty_size_ -= count;
+        store->flushing_ = count;
+        l.unlock();
+        auto ret = store->flush_range(offset, count);
+        l.lock();
+        store->flushing_ = 0;
+        if (ret != 0) {
+            store->flush_errno_ = errno;
+            store->flush_failures_++;
+            store->dirty_size_ += store->insert_dirty(offset, offset + count);
+            store->dirty_cond_.notify_all();
+            store->dirty_cond_.wait(l, FLUSH_RETRY_INTERVAL);
+        }
+        store->dirty_changed(store->dirty_size_ + store->flushing_ + store->writing_);
+        store->dirty_cond_.notify_all();
+    }
+    store->flusher_running_ = false;
+    store->dirty_cond_.notify_all();
+    return nullptr;
+}
+
+int ICacheStore::flush() {
+    if (!(open_flags_ & O_WRITE_BACK)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    {
+        photon::scoped_lock l(dirty_lock_);
+        auto failures = flush_failures_;
+        while (dirty_size_ + flushing_ > 0) {
+            if (flush_failures_ != failures || !flusher_running_)
+                LOG_ERROR_RETURN(flush_errno_ ? flush_errno_ : EIO, -1,
+                                 "failed to write back dirty data of `", src_name_);
+            dirty_cond_.wait(l);
+        }
+    }
+    if (open_src_file() != 0)
+        return -1;
+    return src_file_ ? src_file_->fsync() : 0;
+}
+
+void ICacheStore::stop_flusher() {
+    if (!(open_flags_ & O_WRITE_BACK))
+        return;
+    {
+        photon::scoped_lock l(dirty_lock_);
+        if (!flusher_running_)
+            return;
+    }
+    flush();
+    photon::scoped_lock l(dirty_lock_);
+    flusher_stop_ = true;
+    dirty_cond_.notify_all();
+    while (flusher_running_)
+        dirty_cond_.wait(l);
+    flusher_stop_ = false;
+    if (dirty_size_ > 0)
+        LOG_ERROR("` bytes of dirty data of ` are not written back", dirty_size_, src_name_);
+}
+
 } // namespace FileSystem
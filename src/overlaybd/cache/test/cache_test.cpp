@@ -25,16 +25,22 @@
 #include <random>
 #include <algorithm>
 #include <memory>
+#include <thread>
+#include <unordered_map>
 
 #include "photon/common/alog.h"
 #include "photon/common/callback.h"
 #include "photon/fs/localfs.h"
 #include "photon/fs/aligned-file.h"
+#include "photon/fs/forwardfs.h"
 #include "photon/thread/thread.h"
 #include "photon/io/fd-events.h"
 #include "photon/io/aio-wrapper.h"
 #include "photon/common/io-alloc.h"
 #include "../cache.h"
+#include "../full_file_cache/cache_pool.h"
+#include "../policy/policy.h"
+#include "../../registryfs/registryfs.h"
 #include "random_generator.h"
 
 namespace Cache {
@@ -492,6 +498,496 @@ TEST(CachedFS, write_while_full) {
   }
 }
 
+TEST(CachedFS, cached_blocks) {
+  std::string srcRoot("/tmp/ease/cache/src_test/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_test/blocks bs=1M count=4");
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kUnit = 1024 * 1024;
+  std::vector<char> src(4096), buf(4096);
+  auto fd = ::open("/tmp/ease/cache/src_test/blocks", O_RDONLY);
+  ::pread(fd, src.data(), 4096, kUnit + 4096);
+  ::close(fd);
+
+  // refill a unit, the bitmap is saved next to the media file on close
+  {
+    auto srcFs = new_localfs_adaptor(srcRoot.c_str());
+    auto mediaFs = new_localfs_adaptor(root.c_str());
+    auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, kUnit, 1, 100 * 1000 * 1,
+                                            128ul * 1024 * 1024, nullptr, 0);
+    auto file = cachedFs->open("/blocks", O_RDONLY);
+    EXPECT_EQ(4096, file->pread(buf.data(), 4096, kUnit + 4096));
+    EXPECT_EQ(0, memcmp(buf.data(), src.data(), 4096));
+    delete file;
+    delete cachedFs;
+    delete srcFs;
+  }
+  EXPECT_EQ(0, ::access((root + "blocks.cached_blocks").c_str(), F_OK));
+
+  // without the source, only the cached unit can be read
+  {
+    auto mediaFs = new_localfs_adaptor(root.c_str());
+    auto cachedFs = new_full_file_cached_fs(nullptr, mediaFs, kUnit, 1, 100 * 1000 * 1,
+                                            128ul * 1024 * 1024, nullptr, 0);
+    auto file = static_cast<ICachedFile*>(cachedFs->open("/blocks", O_RDONLY));
+    EXPECT_NE(0, ::access((root + "blocks.cached_blocks").c_str(), F_OK));
+    file->ftruncate(4 * kUnit);
+    EXPECT_EQ(4096, file->pread(buf.data(), 4096, kUnit + 4096));
+    EXPECT_EQ(0, memcmp(buf.data(), src.data(), 4096));
+    EXPECT_EQ(-1, file->pread(buf.data(), 4096, 3 * kUnit));
+    delete file;
+    delete cachedFs;
+  }
+}
+
+struct RangeEvictionPool : public FileCachePool {
+  using FileCachePool::FileCachePool;
+  int64_t evictRanges(std::string_view name, int64_t size) {
+    return FileCachePool::evictRanges(fileIndex_.find(name), size);
+  }
+  int64_t used() {
+    return totalUsed_;
+  }
+};
+
+TEST(CachedFS, range_eviction) {
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kUnit = 1024 * 1024, kUnits = 32;
+  auto pool = new RangeEvictionPool(new_localfs_adaptor(root.c_str()), 1, 1000UL * 1000 * 1000,
+                                    0, kUnit);
+  DEFER(delete pool);
+  pool->Init();
+  auto store = pool->open("/file", O_RDWR | O_CREAT, 0644);
+  ASSERT_NE(nullptr, store);
+  store->set_actual_size(kUnits * kUnit);
+  std::vector<char> buf(kUnit, 'x');
+  for (size_t i = 0; i < kUnits; i++) {
+    EXPECT_EQ((ssize_t)kUnit, store->pwrite(buf.data(), kUnit, i * kUnit));
+  }
+  auto used = pool->used();
+  EXPECT_GE(used, (int64_t)(kUnits * kUnit));
+
+  // all units are referenced by the writes, so they get a second chance first
+  EXPECT_GE(pool->evictRanges("/file", 8 * kUnit), (int64_t)(8 * kUnit));
+  EXPECT_LE(pool->used(), used - (int64_t)(8 * kUnit));
+  for (size_t i = 0; i < 8; i++) {
+    EXPECT_EQ(i * kUnit, (size_t)store->queryRefillRange(i * kUnit, 4096).first);
+    EXPECT_EQ(kUnit, store->queryRefillRange(i * kUnit, 4096).second);
+  }
+
+  // units being read survive the next round
+  for (size_t i = 20; i < 24; i++) {
+    EXPECT_EQ(4096, store->pread(buf.data(), 4096, i * kUnit));
+  }
+  EXPECT_GE(pool->evictRanges("/file", 16 * kUnit), (int64_t)(16 * kUnit));
+  for (size_t i = 8; i < 28; i++) {
+    auto hit = (store->queryRefillRange(i * kUnit, 4096).second == 0);
+    EXPECT_EQ(i >= 20 && i < 24, hit) << "unit " << i;
+  }
+  for (size_t i = 28; i < kUnits; i++) {
+    EXPECT_EQ(0u, store->queryRefillRange(i * kUnit, kUnit).second);
+  }
+  store->release();
+}
+
+struct AccessBufferPool : public FileCachePool {
+  using FileCachePool::FileCachePool;
+  std::string victim() {
+    photon::scoped_lock lock(lruLock_);
+    drainAccessBuffers();
+    return std::string(lru_->back()->first);
+  }
+  void touch(std::string_view name, bool hit) {
+    recordAccess(fileIndex_.find(name)->second->lruIter, hit);
+  }
+};
+
+TEST(CachedFS, access_buffers) {
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  auto pool = new AccessBufferPool(new_localfs_adaptor(root.c_str()), 1, 1000UL * 1000 * 1000,
+                                   0, 1024 * 1024);
+  DEFER(delete pool);
+  pool->Init();
+  auto a = pool->open("/a", O_RDWR | O_CREAT, 0644);
+  auto b = pool->open("/b", O_RDWR | O_CREAT, 0644);
+  ASSERT_NE(nullptr, a);
+  ASSERT_NE(nullptr, b);
+  a->set_actual_size(4096);
+  b->set_actual_size(4096);
+  EXPECT_EQ("/a", pool->victim());
+
+  // updates by reads and writes are buffered, and applied before picking a victim
+  char buf[4096] = {};
+  EXPECT_EQ(4096, a->pwrite(buf, 4096, 0));
+  EXPECT_EQ("/b", pool->victim());
+  EXPECT_EQ(4096, b->pwrite(buf, 4096, 0));
+  EXPECT_EQ("/a", pool->victim());
+  EXPECT_EQ(4096, a->pread(buf, 4096, 0));
+  EXPECT_EQ("/b", pool->victim());
+
+  // a busy vcpu drains the buffers by itself before they fill up
+  for (int i = 0; i < 10000; i++) pool->touch(i % 2 ? "/a" : "/b", true);
+  pool->touch("/a", false);
+  EXPECT_EQ("/b", pool->victim());
+
+  // concurrent updates from multiple vcpus
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      photon::vcpu_init();
+      for (int i = 0; i < 100000; i++) pool->touch((i + t) % 2 ? "/a" : "/b", i % 3 == 0);
+      photon::vcpu_fini();
+    });
+  }
+  for (auto &th : threads) th.join();
+  auto victim = pool->victim();
+  EXPECT_TRUE(victim == "/a" || victim == "/b");
+  a->release();
+  b->release();
+}
+
+TEST(CachedFS, multi_vcpu) {
+  std::string srcRoot("/tmp/ease/cache/src_test/");
+  SetupTestDir(srcRoot);
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kFileSize = 16UL * 1024 * 1024, kMaxRead = 64 * 1024;
+  std::vector<char> data(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data) c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str(), ioengine_psync);
+  for (auto name : {"/file_0", "/file_1"}) {
+    auto srcFile = srcFs->open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(nullptr, srcFile);
+    EXPECT_EQ((ssize_t)kFileSize, srcFile->pwrite(data.data(), kFileSize, 0));
+    delete srcFile;
+  }
+  auto cachedFs = new_full_file_cached_fs(srcFs, new_localfs_adaptor(root.c_str()), 1024 * 1024,
+                                          1, 1000 * 1000, 128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+
+  // devices on their own vcpus share the pool, the stores and the refills
+  std::atomic<int> errors{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      photon::vcpu_init();
+      DEFER(photon::vcpu_fini());
+      auto file = cachedFs->open(t % 2 ? "/file_1" : "/file_0", O_RDONLY, 0644);
+      if (!file) {
+        errors++;
+        return;
+      }
+      DEFER(delete file);
+      std::mt19937 rng(t);
+      std::vector<char> buf(kMaxRead);
+      for (int i = 0; i < 2000; i++) {
+        size_t offset = rng() % (kFileSize - kMaxRead);
+        size_t count = rng() % kMaxRead + 1;
+        if (file->pread(buf.data(), count, offset) != (ssize_t)count ||
+            memcmp(buf.data(), data.data() + offset, count) != 0)
+          errors++;
+      }
+    });
+  }
+  for (auto &th : threads) th.join();
+  EXPECT_EQ(0, errors.load());
+}
+
+TEST(CachedFS, write_back) {
+  std::string srcRoot("/tmp/ease/cache/src_test/");
+  SetupTestDir(srcRoot);
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kFileSize = 8UL * 1024 * 1024, kWrite = 256 * 1024;
+  std::vector<char> data(kFileSize), buf(kFileSize);
+  UniformCharRandomGen gen(0, 255);
+  for (auto &c : data) c = gen.next();
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str());
+  delete srcFs->open("/wb", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  auto cachedFs = new_full_file_cached_fs(srcFs, new_localfs_adaptor(root.c_str()), 1024 * 1024,
+                                          1, 1000 * 1000, 128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  auto srcData = [&]() {
+    std::vector<char> ret(kFileSize);
+    auto fd = ::open((srcRoot + "wb").c_str(), O_RDONLY);
+    auto n = ::pread(fd, ret.data(), kFileSize, 0);
+    ::close(fd);
+    ret.resize(n < 0 ? 0 : n);
+    return ret;
+  };
+
+  // writes are acknowledged by the cache, and written back in the background
+  auto file = cachedFs->open("/wb", O_RDWR | O_WRITE_BACK, 0644);
+  ASSERT_NE(nullptr, file);
+  for (size_t off = 0; off < kFileSize; off += kWrite)
+    EXPECT_EQ((ssize_t)kWrite, file->pwrite(data.data() + off, kWrite, off));
+  EXPECT_EQ((ssize_t)kFileSize, file->pread(buf.data(), kFileSize, 0));
+  EXPECT_EQ(0, memcmp(buf.data(), data.data(), kFileSize));
+  EXPECT_EQ(0, file->fsync());
+  EXPECT_TRUE(srcData() == data);
+
+  // dirty data left is written back when the file is closed
+  for (auto &c : data) c = gen.next();
+  for (size_t off = 0; off < kFileSize; off += kWrite)
+    EXPECT_EQ((ssize_t)kWrite, file->pwrite(data.data() + off, kWrite, off));
+  delete file;
+  EXPECT_TRUE(srcData() == data);
+}
+
+TEST(CachedFS, memory_cache) {
+  std::string srcRoot("/tmp/ease/cache/src_test/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_test/hot bs=1M count=4");
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kUnit = 1024 * 1024;
+  std::vector<char> src(4 * kUnit), buf(4096);
+  auto fd = ::open("/tmp/ease/cache/src_test/hot", O_RDONLY);
+  ::pread(fd, src.data(), src.size(), 0);
+  ::close(fd);
+
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str());
+  auto cachedFs = new_full_file_cached_fs(srcFs, new_localfs_adaptor(root.c_str()), kUnit, 1,
+                                          100 * 1000 * 1, 128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  auto pool = static_cast<FileCachePool *>(cachedFs->get_pool());
+  EXPECT_EQ(0, pool->resize(2 * kUnit, RSZ_MEMORY));
+  auto file = cachedFs->open("/hot", O_RDONLY);
+  DEFER(delete file);
+
+  // a unit is promoted on its second access, the refill being the first
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(4096, file->pread(buf.data(), 4096, 4096));
+    EXPECT_EQ(0, memcmp(buf.data(), src.data() + 4096, 4096));
+  }
+  EXPECT_EQ(kUnit, pool->memoryCache().used());
+
+  // hot units are bounded by the budget
+  for (size_t off : {kUnit, 2 * kUnit, kUnit, 2 * kUnit})
+    EXPECT_EQ(4096, file->pread(buf.data(), 4096, off));
+  EXPECT_EQ(2 * kUnit, pool->memoryCache().used());
+
+  // reads of hot units don't reach the media file
+  ::truncate((root + "hot").c_str(), 0);
+  EXPECT_EQ(4096, file->pread(buf.data(), 4096, 2 * kUnit + 8192));
+  EXPECT_EQ(0, memcmp(buf.data(), src.data() + 2 * kUnit + 8192, 4096));
+
+  EXPECT_EQ(-1, pool->reset(RST_DISK));
+  EXPECT_EQ(0, pool->reset(RST_MEMORY));
+  EXPECT_EQ(0UL, pool->memoryCache().used());
+}
+
+struct CountingFile : public ForwardFile_Ownership {
+  std::atomic<int> *reads;
+  CountingFile(IFile *file, std::atomic<int> *reads)
+      : ForwardFile_Ownership(file, true), reads(reads) {}
+  ssize_t preadv2(const struct iovec *iov, int iovcnt, off_t offset, int flags) override {
+    (*reads)++;
+    return m_file->preadv2(iov, iovcnt, offset, flags);
+  }
+};
+
+struct CountingFS : public ForwardFS_Ownership {
+  std::atomic<int> reads{0};
+  CountingFS(IFileSystem *fs) : ForwardFS_Ownership(fs, true) {}
+  IFile *open(const char *fn, int flags) override {
+    auto file = m_fs->open(fn, flags);
+    return file ? new CountingFile(file, &reads) : nullptr;
+  }
+  IFile *open(const char *fn, int flags, mode_t mode) override {
+    auto file = m_fs->open(fn, flags, mode);
+    return file ? new CountingFile(file, &reads) : nullptr;
+  }
+};
+
+struct RefillReader {
+  IFile *file;
+  off_t offset;
+  const char *expected;
+};
+
+void *refill_reader(void *arg) {
+  auto r = (RefillReader *)arg;
+  char buf[4096];
+  EXPECT_EQ(4096, r->file->pread(buf, 4096, r->offset));
+  EXPECT_EQ(0, memcmp(buf, r->expected, 4096));
+  return nullptr;
+}
+
+TEST(CachedFS, coalesced_refills) {
+  std::string srcRoot("/tmp/ease/cache/src_test/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_test/cold bs=1M count=4");
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kUnit = 256 * 1024;
+  std::vector<char> src(4 * 1024 * 1024);
+  auto fd = ::open("/tmp/ease/cache/src_test/cold", O_RDONLY);
+  ::pread(fd, src.data(), src.size(), 0);
+  ::close(fd);
+
+  auto srcFs = new CountingFS(new_localfs_adaptor(srcRoot.c_str()));
+  auto cachedFs = new_full_file_cached_fs(srcFs, new_localfs_adaptor(root.c_str()), kUnit, 1,
+                                          100 * 1000 * 1, 128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  auto file = cachedFs->open("/cold", O_RDONLY);
+  DEFER(delete file);
+  auto run = [&](std::vector<off_t> offsets) {
+    std::vector<RefillReader> readers;
+    for (auto off : offsets)
+      readers.push_back({file, off, src.data() + off});
+    std::vector<photon::join_handle*> jhs;
+    for (auto &r : readers)
+      jhs.emplace_back(photon::thread_enable_join(photon::thread_create(refill_reader, &r)));
+    for (auto &x : jhs)
+      photon::thread_join(x);
+  };
+
+  // readers missing the same unit share one fetch
+  run({0, 4096, 8192, 12288, 16384, 20480, 24576, 28672});
+  EXPECT_EQ(1, srcFs->reads.load());
+
+  // misses of adjacent units are merged into one request
+  std::vector<off_t> offsets;
+  for (int i = 1; i <= 8; i++)
+    offsets.push_back(i * kUnit);
+  run(offsets);
+  EXPECT_EQ(2, srcFs->reads.load());
+}
+
+// a source reading several ranges at once, like a registry file
+struct BatchingFile : public CountingFile {
+  std::atomic<int> *batches;
+  std::atomic<int> *ranges;
+  BatchingFile(IFile *file, std::atomic<int> *reads, std::atomic<int> *batches,
+               std::atomic<int> *ranges)
+      : CountingFile(file, reads), batches(batches), ranges(ranges) {}
+  int vioctl(int request, va_list args) override {
+    if (request != REGISTRY_PREAD_RANGES) {
+      errno = ENOSYS;
+      return -1;
+    }
+    auto rs = va_arg(args, RegistryRange *);
+    auto n = va_arg(args, int);
+    if (n == 0)
+      return 0;
+    (*batches)++;
+    (*ranges) += n;
+    for (int i = 0; i < n; i++) {
+      auto ret = m_file->pread(rs[i].buf, rs[i].count, rs[i].offset);
+      if (ret < 0)
+        return -1;
+      rs[i].count = ret;
+    }
+    return 0;
+  }
+};
+
+struct BatchingFS : public CountingFS {
+  std::atomic<int> batches{0};
+  std::atomic<int> ranges{0};
+  BatchingFS(IFileSystem *fs) : CountingFS(fs) {}
+  IFile *open(const char *fn, int flags) override {
+    auto file = m_fs->open(fn, flags);
+    return file ? new BatchingFile(file, &reads, &batches, &ranges) : nullptr;
+  }
+  IFile *open(const char *fn, int flags, mode_t mode) override {
+    auto file = m_fs->open(fn, flags, mode);
+    return file ? new BatchingFile(file, &reads, &batches, &ranges) : nullptr;
+  }
+};
+
+TEST(CachedFS, batched_refills) {
+  std::string srcRoot("/tmp/ease/cache/src_test/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_test/cold bs=1M count=4");
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kUnit = 256 * 1024;
+  std::vector<char> src(4 * 1024 * 1024);
+  auto fd = ::open("/tmp/ease/cache/src_test/cold", O_RDONLY);
+  ::pread(fd, src.data(), src.size(), 0);
+  ::close(fd);
+
+  auto srcFs = new BatchingFS(new_localfs_adaptor(srcRoot.c_str()));
+  auto cachedFs = new_full_file_cached_fs(srcFs, new_localfs_adaptor(root.c_str()), kUnit, 1,
+                                          100 * 1000 * 1, 128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  auto file = cachedFs->open("/cold", O_RDONLY);
+  DEFER(delete file);
+
+  // a lone miss is fetched by itself
+  char buf[4096];
+  EXPECT_EQ(4096, file->pread(buf, 4096, 0));
+  EXPECT_EQ(0, memcmp(buf, src.data(), 4096));
+  EXPECT_EQ(1, srcFs->reads.load());
+  EXPECT_EQ(0, srcFs->batches.load());
+
+  // concurrent misses of scattered units are fetched in one batch
+  std::vector<RefillReader> readers;
+  for (int i = 1; i <= 6; i++) {
+    off_t off = 2 * i * kUnit;
+    readers.push_back({file, off, src.data() + off});
+  }
+  std::vector<photon::join_handle*> jhs;
+  for (auto &r : readers)
+    jhs.emplace_back(photon::thread_enable_join(photon::thread_create(refill_reader, &r)));
+  for (auto &x : jhs)
+    photon::thread_join(x);
+  EXPECT_EQ(1, srcFs->reads.load());
+  EXPECT_EQ(1, srcFs->batches.load());
+  EXPECT_EQ(6, srcFs->ranges.load());
+
+  // and they are all in the cache afterwards
+  for (auto &r : readers) {
+    EXPECT_EQ(4096, file->pread(buf, 4096, r.offset));
+    EXPECT_EQ(0, memcmp(buf, r.expected, 4096));
+  }
+  EXPECT_EQ(1, srcFs->reads.load());
+  EXPECT_EQ(1, srcFs->batches.load());
+}
+
+TEST(CachedFS, adaptive_refill) {
+  std::string srcRoot("/tmp/ease/cache/src_test/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_test/seq bs=1M count=4");
+  std::string root("/tmp/ease/cache/cache_test/");
+  SetupTestDir(root);
+  const size_t kUnit = 256 * 1024;
+  std::vector<char> src(4 * 1024 * 1024);
+  auto fd = ::open("/tmp/ease/cache/src_test/seq", O_RDONLY);
+  ::pread(fd, src.data(), src.size(), 0);
+  ::close(fd);
+
+  auto srcFs = new CountingFS(new_localfs_adaptor(srcRoot.c_str()));
+  auto cachedFs = new_full_file_cached_fs(srcFs, new_localfs_adaptor(root.c_str()), kUnit, 1,
+                                          100 * 1000 * 1, 128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  auto pool = cachedFs->get_pool();
+  pool->set_refill_window(kUnit, 4 * kUnit);
+  auto file = cachedFs->open("/seq", O_RDONLY);
+  DEFER(delete file);
+
+  // sequential reads grow the refill window up to the max
+  std::vector<char> buf(64 * 1024);
+  for (size_t off = 0; off < src.size(); off += buf.size()) {
+    ASSERT_EQ((ssize_t)buf.size(), file->pread(buf.data(), buf.size(), off));
+    ASSERT_EQ(0, memcmp(buf.data(), src.data() + off, buf.size()));
+  }
+  EXPECT_EQ(4 * kUnit, pool->get_refill_window());
+  // [0, 1), [1, 5), [5, 9), [9, 13), [13, 16) in units
+  EXPECT_EQ(5, srcFs->reads.load());
+
+  // random ones shrink it back to the min
+  for (size_t off : {3 * kUnit, kUnit, 2 * kUnit})
+    ASSERT_EQ((ssize_t)buf.size(), file->pread(buf.data(), buf.size(), off));
+  EXPECT_EQ(kUnit, pool->get_refill_window());
+}
+
 TEST(CachedFS, fn_trans_func) {
   std::string srcRoot("/tmp/ease/cache/src_test/");
   SetupTestDir(srcRoot);
@@ -534,6 +1030,92 @@ TEST(CachedFS, fn_trans_func) {
   EXPECT_EQ(cs1, cs2);
 }
 
+TEST(EvictionPolicy, slru) {
+  SLRU<int, uint32_t> slru(50);
+  std::vector<uint32_t> keys;
+  for (int i = 0; i < 4; i++) keys.push_back(slru.push_front(i));
+  EXPECT_EQ(0, slru.back());
+  // requeue refreshes recency only, access promotes
+  slru.requeue(keys[0]);
+  EXPECT_EQ(1, slru.back());
+  slru.access(keys[1]);
+  slru.access(keys[2]);
+  EXPECT_EQ(3, slru.back());
+  slru.remove(keys[3]);
+  EXPECT_EQ(0, slru.back());
+  // the protected segment overflows, demoting its lru entry to probation
+  slru.access(keys[0]);
+  EXPECT_EQ(3u, slru.size());
+  EXPECT_EQ(1, slru.back());
+  slru.mark_key_cleared(keys[1]);
+  EXPECT_EQ(2, slru.back());
+  slru.remove(keys[2]);
+  slru.remove(keys[0]);
+  EXPECT_TRUE(slru.empty());
+  EXPECT_EQ(1u, slru.size());
+  EXPECT_EQ(1, slru.value(keys[1]));
+  slru.remove(keys[1]);
+  EXPECT_EQ(0u, slru.size());
+  EXPECT_EQ(nullptr, (new_eviction_policy<int, uint32_t>(-1)));
+}
+
+// replay `trace` over a cache of `capacity` entries managed by `policy`
+static double hit_ratio(IEvictionPolicy<uint32_t, uint32_t> *policy,
+                        const std::vector<uint32_t> &trace, size_t capacity) {
+  std::unordered_map<uint32_t, uint32_t> keys;
+  size_t hits = 0;
+  for (auto x : trace) {
+    auto it = keys.find(x);
+    if (it != keys.end()) {
+      hits++;
+      policy->access(it->second);
+      continue;
+    }
+    if (policy->size() >= capacity) {
+      auto victim = policy->back();
+      policy->remove(keys[victim]);
+      keys.erase(victim);
+    }
+    keys[x] = policy->push_front(x);
+  }
+  return (double)hits / trace.size();
+}
+
+TEST(EvictionPolicy, hit_ratio) {
+  // a hot working set of container boots, interleaved with one-time scans
+  // (e.g. merging or prefetching) that are larger than the cache
+  const uint32_t kHot = 200, kCapacity = 300, kScan = 1000;
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<uint32_t> hot(0, kHot - 1);
+  std::vector<uint32_t> trace, skewed;
+  uint32_t cold = kHot;
+  for (int epoch = 0; epoch < 20; epoch++) {
+    for (int i = 0; i < 2000; i++) trace.push_back(hot(gen));
+    for (uint32_t i = 0; i < kScan; i++) trace.push_back(cold++);
+  }
+  // a skewed trace without scans, where the policies should be on par
+  std::geometric_distribution<uint32_t> skew(0.005);
+  for (int i = 0; i < 40000; i++) skewed.push_back(skew(gen));
+
+  std::unique_ptr<IEvictionPolicy<uint32_t, uint32_t>> lru(
+      new_eviction_policy<uint32_t, uint32_t>(EVICTION_POLICY_LRU));
+  std::unique_ptr<IEvictionPolicy<uint32_t, uint32_t>> slru(
+      new_eviction_policy<uint32_t, uint32_t>(EVICTION_POLICY_SLRU));
+  auto lru_ratio = hit_ratio(lru.get(), trace, kCapacity);
+  auto slru_ratio = hit_ratio(slru.get(), trace, kCapacity);
+  LOG_INFO("hot set with scans: lru `, slru `", lru_ratio, slru_ratio);
+  EXPECT_GT(slru_ratio, lru_ratio);
+  // the hot set survives the scans, missing only on its first access
+  EXPECT_GT(slru_ratio, 0.99 * 40000 / trace.size());
+
+  lru.reset(new_eviction_policy<uint32_t, uint32_t>(EVICTION_POLICY_LRU));
+  slru.reset(new_eviction_policy<uint32_t, uint32_t>(EVICTION_POLICY_SLRU));
+  lru_ratio = hit_ratio(lru.get(), skewed, kCapacity);
+  slru_ratio = hit_ratio(slru.get(), skewed, kCapacity);
+  LOG_INFO("skewed: lru `, slru `", lru_ratio, slru_ratio);
+  EXPECT_GT(slru_ratio, lru_ratio * 0.95);
+}
+
 }  //  namespace Cache
 
 int main(int argc, char** argv) {
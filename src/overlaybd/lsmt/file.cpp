@@ -28,6 +28,10 @@ limitations under the License.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include "index.h"
 #include "photon/common/alog.h"
 #include "photon/common/uuid.h"
@@ -271,70 +275,278 @@ static int push_segment(char *buf, char *data, int &data_length, int &prev_end,
     return 0;
 }
 
-static int is_zero_block(char *buf, size_t n) {
-    return 1;
-    // TODO: fixme: result data error
-    if (n & (sizeof(uint64_t) - 1)) {
+static bool is_zero_scalar(const char *buf, size_t n) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i < n; i += sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, buf + i, sizeof(v));
+        acc |= v;
+    }
+    return acc == 0;
+}
+
+#ifdef __x86_64__
+static bool is_zero_sse2(const char *buf, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < n; i += 64) {
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i + 16)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i + 32)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(buf + i + 48)));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+}
+
+__attribute__((target("avx2"))) static bool is_zero_avx2(const char *buf, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < n; i += 64) {
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(buf + i)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(buf + i + 32)));
+    }
+    return _mm256_testz_si256(acc, acc);
+}
+#endif
+
+static auto select_zero_detector() -> bool (*)(const char *, size_t) {
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) {
+        LOG_INFO("zero block detection uses AVX2");
+        return &is_zero_avx2;
+    }
+    return &is_zero_sse2;
+#else
+    return &is_zero_scalar;
+#endif
+}
+
+// return 0 if all `n` bytes in `buf` are zero, otherwise return 1.
+// `n` must be a multiple of 64, or -1 is returned.
+static int is_zero_block(const char *buf, size_t n) {
+    static auto is_zero = select_zero_detector();
+    if (n & 63) {
         LOG_ERROR("buf size invalid.");
         return -1;
     }
-    for (uint64_t j = 0; j < n; j += sizeof(uint64_t)) {
-        if ((uint64_t)(*(buf + j)) == (uint64_t)0)
+    return is_zero(buf, n) ? 0 : 1;
+}
+
+// split the sectors in `buf` into data and zeroed segments starting from `s`, and pack the
+// non-zero sectors into `data`; return the length of packed data.
+static int scan_zero_blocks(char *buf, ssize_t step, char *data, SegmentMapping &s,
+                            vector<SegmentMapping> &index) {
+    auto zero_detected = -1;
+    auto data_length = 0;
+    auto prev_end = 0;
+    for (auto i = 0; i < step; i += (ssize_t)ALIGNMENT) {
+        if (is_zero_block(buf + i, ALIGNMENT) == 0) {
+            if (zero_detected == 0 && s.length) {
+                push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+            }
+            s.length++;
+            zero_detected = 1;
             continue;
-        return 1;
+        }
+        if (zero_detected == 1) {
+            push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+        }
+        zero_detected = 0;
+        s.length++;
     }
-    return 0;
+    if (s.length) {
+        push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+    }
+    return data_length;
 }
 
-static ssize_t pcopy(const CompactOptions &opt, const SegmentMapping &m, uint64_t moffset,
-                     vector<SegmentMapping> &index) {
-    auto offset = m.moffset * ALIGNMENT;
-    auto count = m.length * ALIGNMENT;
-    auto bytes = 0;
-    const size_t BUFFER_SIZE = 32 * 1024;
-    ALIGNED_MEM4K(buf, BUFFER_SIZE);
-    ALIGNED_MEM4K(data, BUFFER_SIZE);
-    LOG_DEBUG("check segment: [ offset: `, len: `, moffset: `]", m.offset, m.length, m.moffset);
-    SegmentMapping s{m.offset, 0, moffset, m.tag};
-    while (count > 0) {
-        ssize_t step = min((size_t)count, BUFFER_SIZE /* BUFFER_SIZE 32K */);
+// Compaction runs as a pipeline: reader threads take the mappings piece by piece (at most
+// `compact_block_size` each), read them from the source layers and detect zero sectors
+// concurrently, while the compacting thread writes the pieces out in their original
+// order through a ring of reorder slots.
+struct parallel_compact_task {
+    struct Slot {
+        char *buf = nullptr;
+        char *data = nullptr;
+        vector<SegmentMapping> segments;
+        int data_length = 0;
+        bool passthrough = false; // keep moffset of segments as is
+        bool eof = false;
+        int eno = 0;
+        photon::semaphore ready{0};
+    };
+
+    const CompactOptions &opt;
+    bool keep_remote;
+    size_t block_size;
+    vector<Slot> slots;
+    photon::semaphore free_slots;
+    atomic_uint64_t &compacted_idx_size;
+    size_t i = 0;     // current mapping in raw index
+    uint64_t pos = 0; // sectors consumed in current mapping
+    uint64_t next_id = 0;
+    bool done = false, stop = false;
+
+    parallel_compact_task(const CompactOptions &opt, bool keep_remote, size_t block_size,
+                          int nslots, atomic_uint64_t &compacted_idx_size)
+        : opt(opt), keep_remote(keep_remote), block_size(block_size), slots(nslots),
+          free_slots(nslots), compacted_idx_size(compacted_idx_size) {
+    }
+
+    bool is_remote(const SegmentMapping &m) const {
+        return keep_remote && m.tag == (uint8_t)SegmentType::remoteData;
+    }
+
+    // get the next piece to copy, return false if no more
+    bool get_job(uint64_t &id, SegmentMapping &m, bool &whole) {
+        if (i >= opt.index_size)
+            return false;
+        m = opt.raw_index[i];
+        if (pos == 0)
+            compacted_idx_size.fetch_add(1);
+        whole = m.zeroed || is_remote(m);
+        if (whole) {
+            i++;
+        } else {
+            auto len = min((uint64_t)(m.length - pos), (uint64_t)(block_size / ALIGNMENT));
+            m.offset += pos;
+            m.moffset += pos;
+            m.length = len;
+            pos += len;
+            if (pos == opt.raw_index[i].length) {
+                i++;
+                pos = 0;
+            }
+        }
+        id = next_id++;
+        return true;
+    }
+
+    int read_job(Slot &slot, SegmentMapping m, bool whole) {
+        slot.segments.clear();
+        slot.data_length = 0;
+        slot.passthrough = is_remote(m);
+        if (whole) {
+            if (!slot.passthrough)
+                m.moffset = 0;
+            slot.segments.push_back(m);
+            return 0;
+        }
+        auto offset = m.moffset * ALIGNMENT;
+        auto step = m.length * ALIGNMENT;
         LOG_DEBUG("read from src_file, offset: `, step: `", offset, step);
-        ssize_t ret = opt.src_files[m.tag]->pread(buf, step, offset);
+        ssize_t ret = opt.src_files[m.tag]->pread(slot.buf, step, offset);
         if (ret < (ssize_t)step)
             LOG_ERRNO_RETURN(0, -1, "failed to read from file");
-        auto zero_detected = -1;
-        auto data_length = 0;
-        auto prev_end = 0;
-        for (auto i = 0; i < step; i += (ssize_t)ALIGNMENT) {
-            if (is_zero_block(buf + i, ALIGNMENT) == 0) {
-                if (zero_detected == 0 && s.length) {
-                    push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
-                }
-                s.length++;
-                zero_detected = 1;
-                continue;
+        SegmentMapping s{m.offset, 0, 0, m.tag};
+        slot.data_length = scan_zero_blocks(slot.buf, step, slot.data, s, slot.segments);
+        return 0;
+    }
+
+    static void *do_read(void *arg) {
+        auto task = (parallel_compact_task *)arg;
+        while (true) {
+            task->free_slots.wait(1);
+            if (task->stop || task->done) {
+                task->free_slots.signal(1);
+                break;
             }
-            if (zero_detected == 1) {
-                push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+            uint64_t id;
+            SegmentMapping m;
+            bool whole;
+            if (!task->get_job(id, m, whole)) {
+                // the slot after the last piece carries the end mark
+                task->done = true;
+                auto &slot = task->slots[task->next_id % task->slots.size()];
+                slot.eof = true;
+                slot.ready.signal(1);
+                break;
             }
-            zero_detected = 0;
-            s.length++;
+            auto &slot = task->slots[id % task->slots.size()];
+            slot.eof = false;
+            slot.eno = 0;
+            if (task->read_job(slot, m, whole) != 0) {
+                slot.eno = (errno ? errno : EIO);
+            }
+            slot.ready.signal(1);
         }
-        if (s.length) {
-            push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+        return nullptr;
+    }
+
+    // write the pieces out in order, starting from `moffset`, return the end moffset
+    ssize_t run(int nthreads, uint64_t moffset, vector<SegmentMapping> &index) {
+        auto dest_file = opt.commit_args->as;
+        auto nslots = slots.size();
+        void *mem = nullptr;
+        if (posix_memalign(&mem, ALIGNMENT4K, block_size * 2 * nslots) != 0) {
+            LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate compaction buffers");
         }
-        /* write non-zeroed data */
-        LOG_DEBUG("write valid data(size: `)", data_length);
-        if (data_length) {
-            ret = opt.commit_args->as->write(data, data_length);
-            if (ret < (ssize_t)data_length)
-                LOG_ERROR_RETURN(0, -1, "failed to write to file");
+        DEFER(free(mem));
+        for (size_t k = 0; k < nslots; k++) {
+            slots[k].buf = (char *)mem + block_size * 2 * k;
+            slots[k].data = slots[k].buf + block_size;
         }
-        bytes += data_length;
-        offset += step;
-        count -= step;
+        vector<photon::join_handle *> ths;
+        for (int k = 0; k < nthreads; k++) {
+            auto th = photon::thread_create(&parallel_compact_task::do_read, this);
+            ths.push_back(photon::thread_enable_join(th));
+        }
+
+        int eno = 0;
+        for (uint64_t id = 0;; id++) {
+            auto &slot = slots[id % nslots];
+            slot.ready.wait(1);
+            if (slot.eof)
+                break;
+            if (slot.eno != 0) {
+                eno = slot.eno;
+                LOG_ERROR("failed to read source data {eno: `}", eno);
+                break;
+            }
+            for (auto s : slot.segments) {
+                if (!slot.passthrough)
+                    s.moffset += moffset;
+                index.push_back(s);
+            }
+            LOG_DEBUG("write valid data(size: `)", slot.data_length);
+            if (slot.data_length) {
+                auto ret = dest_file->write(slot.data, slot.data_length);
+                if (ret < (ssize_t)slot.data_length) {
+                    eno = (errno ? errno : EIO);
+                    LOG_ERROR("failed to write to file");
+                    break;
+                }
+            }
+            moffset += slot.data_length / ALIGNMENT;
+            free_slots.signal(1);
+        }
+        if (eno != 0) {
+            stop = true;
+            free_slots.signal(nthreads);
+        }
+        for (auto th : ths) {
+            photon::thread_join(th);
+        }
+        if (eno != 0) {
+            LOG_ERRNO_RETURN(eno, -1, "compaction failed");
+        }
+        return moffset;
     }
-    return bytes / ALIGNMENT;
+};
+
+// copy the data of `opt.raw_index` into the destination from `moffset` (in sectors),
+// appending the resulting mappings to `index`; return the end moffset or -1.
+static ssize_t copy_segments(const CompactOptions &opt, uint64_t moffset,
+                             vector<SegmentMapping> &index, atomic_uint64_t &compacted_idx_size,
+                             bool keep_remote = false) {
+    auto block_size = opt.commit_args->compact_block_size;
+    auto concurrency = opt.commit_args->compact_concurrency;
+    if (block_size < ALIGNMENT || block_size % ALIGNMENT != 0 || concurrency <= 0) {
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid compaction block size ` or concurrency `",
+                         block_size, concurrency);
+    }
+    LOG_INFO("compact with block size: `, concurrency: `", block_size, concurrency);
+    parallel_compact_task task(opt, keep_remote, block_size, concurrency * 2,
+                               compacted_idx_size);
+    return task.run(concurrency, moffset, index);
 }
 
 static int load_layer_info(IFile **src_files, size_t n, LayerInfo &layer, bool oper_seal = false) {
@@ -398,23 +610,13 @@ static int compact(const CompactOptions &opt, atomic_uint64_t &compacted_idx_siz
     if (ret < 0) {
         LOG_ERRNO_RETURN(0, -1, "failed to write header.");
     }
-    auto marray = ptr_array(opt.raw_index, opt.index_size);
     uint64_t moffset = HeaderTrailer::SPACE;
     vector<SegmentMapping> compact_index;
     moffset /= ALIGNMENT;
-    for (auto &m : marray) {
-        compacted_idx_size.fetch_add(1);
-        if (m.zeroed) {
-            m.moffset = moffset;
-            compact_index.push_back(m);
-            // there is no need do pcopy if current block is zero-marked.
-            continue;
-        }
-        auto ret = pcopy(opt, m, moffset, compact_index);
-        if (ret < 0)
-            return (int)ret;
-        moffset += ret;
-    }
+    ret = copy_segments(opt, moffset, compact_index, compacted_idx_size);
+    if (ret < 0)
+        return (int)ret;
+    moffset = ret;
     uint64_t index_offset = moffset * ALIGNMENT;
     auto index_size = compress_raw_index(&compact_index[0], compact_index.size());
     LOG_DEBUG("write index to dest_file `, size: `*`", dest_file, index_size,
@@ -452,9 +654,65 @@ static int compact(const CompactOptions &opt, atomic_uint64_t &compacted_idx_siz
     return 0;
 }
 
+// segment reads of a single pread(), dispatched to a few photon threads
+struct parallel_read_task {
+    struct Job {
+        IFile *file;
+        void *buf;
+        size_t count;
+        off_t offset;
+        uint8_t tag;
+    };
+
+    vector<Job> jobs;
+    size_t i = 0;
+    int eno = 0;
+    uint32_t io_cnt = 0;
+    uint64_t io_size = 0;
+
+    Job *get_job() {
+        if (eno != 0 || i >= jobs.size())
+            return nullptr;
+        return &jobs[i++];
+    }
+
+    // merge with the previous job if both the source range and the user buffer are adjacent
+    void add_job(IFile *file, void *buf, size_t count, off_t offset, uint8_t tag) {
+        if (!jobs.empty()) {
+            auto &last = jobs.back();
+            if (last.tag == tag && last.offset + (off_t)last.count == offset &&
+                (char *)last.buf + last.count == (char *)buf) {
+                last.count += count;
+                return;
+            }
+        }
+        jobs.push_back({file, buf, count, offset, tag});
+    }
+};
+
+static void *do_parallel_read(void *param) {
+    auto tm = (parallel_read_task *)param;
+    while (true) {
+        auto job = tm->get_job();
+        if (job == nullptr)
+            return nullptr;
+        ssize_t ret = job->file->pread(job->buf, job->count, job->offset);
+        if (ret < (ssize_t)job->count) {
+            tm->eno = (errno != 0) ? errno : EIO;
+            LOG_ERRNO_RETURN(0, nullptr,
+                             "failed to read from `-th file ( ` pread return: ` < size: `)",
+                             job->tag, job->file, ret, job->count);
+        }
+        tm->io_size += ret;
+        tm->io_cnt++;
+    }
+    return nullptr;
+}
+
 class LSMTReadOnlyFile : public IFileRW {
 public:
     size_t MAX_IO_SIZE = 4 * 1024 * 1024;
+    int MAX_IO_CONCURRENCY = 1;
     uint64_t m_vsize = 0;
     vector<IFile *> m_files;
     vector<UUID> m_uuid;
@@ -496,6 +754,19 @@ public:
         return this->MAX_IO_SIZE;
     }
 
+    virtual int set_max_io_concurrency(int n) override {
+        if (n <= 0) {
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid io concurrency: `", n);
+        }
+        LOG_INFO("`", n);
+        this->MAX_IO_CONCURRENCY = n;
+        return 0;
+    }
+
+    virtual int get_max_io_concurrency() override {
+        return this->MAX_IO_CONCURRENCY;
+    }
+
     virtual IMemoryIndex0 *index() const override {
         return (IMemoryIndex0 *)m_index;
     }
@@ -554,6 +825,10 @@ public:
         count /= ALIGNMENT;
         offset /= ALIGNMENT;
         Segment s{(uint64_t)offset, (uint32_t)count};
+        if (MAX_IO_CONCURRENCY > 1 && buf != nullptr) {
+            auto ret = parallel_pread(buf, s);
+            return (ret >= 0) ? nbytes : ret;
+        }
         auto ret = foreach_segments(
             m_index, s,
             [&](const Segment &m) __attribute__((always_inline)) {
@@ -585,6 +860,51 @@ public:
         return (ret >= 0) ? nbytes : ret;
     }
 
+    // collect the data segments of `s` (merging the physically adjacent ones of the same
+    // layer), and read them with at most MAX_IO_CONCURRENCY photon threads
+    int parallel_pread(void *buf, Segment s) {
+        parallel_read_task tm;
+        auto ret = foreach_segments(
+            m_index, s,
+            [&](const Segment &m) __attribute__((always_inline)) {
+                auto step = m.length * ALIGNMENT;
+                memset(buf, 0, step);
+                (char *&)buf += step;
+                return 0;
+            },
+            [&](const SegmentMapping &m) __attribute__((always_inline)) {
+                assert(m.tag < m_files.size());
+                size_t size = m.length * ALIGNMENT;
+                tm.add_job(m_files[m.tag], buf, size, m.moffset * ALIGNMENT, m.tag);
+                (char *&)buf += size;
+                return 0;
+            });
+        if (ret < 0)
+            return ret;
+
+        auto n = min(MAX_IO_CONCURRENCY, (int)tm.jobs.size());
+        if (n <= 1) {
+            do_parallel_read(&tm);
+        } else {
+            vector<photon::join_handle *> ths;
+            ths.reserve(n);
+            for (int i = 0; i < n; i++) {
+                ths.push_back(
+                    photon::thread_enable_join(photon::thread_create(&do_parallel_read, &tm)));
+            }
+            for (auto th : ths) {
+                photon::thread_join(th);
+            }
+        }
+        lsmt_io_size += tm.io_size;
+        lsmt_io_cnt += tm.io_cnt;
+        if (tm.eno != 0) {
+            errno = tm.eno;
+            return -1;
+        }
+        return 0;
+    }
+
     virtual IFile *front_file() {
         for (auto x : m_files)
             if (x)
@@ -664,8 +984,7 @@ public:
         return segs.size();
     }
 
-    virtual int flatten(IFile *as) override{
-        CommitArgs args(as);
+    virtual int flatten(const CommitArgs &args) override{
         vector<IFile*> files = m_files;
         reverse(files.begin(), files.end());
         return merge_files_ro(files, args);
@@ -985,10 +1304,9 @@ public:
         return data_stat;
     }
 
-    virtual int flatten(IFile *as) override {
+    virtual int flatten(const CommitArgs &args) override {
 
         unique_ptr<IComboIndex> pmi((IComboIndex*)(m_index->make_read_only_index()));
-        CommitArgs args(as);
         atomic_uint64_t _no_use_var(0);
         CompactOptions opts(&m_files, (SegmentMapping*)(pmi->buffer()), pmi->size(), m_vsize, &args);
         return compact(opts, _no_use_var);
@@ -1164,28 +1482,13 @@ public:
     size_t compact(CompactOptions &opts, size_t moffset, size_t &nindex) const {
 
         auto dest_file = opts.commit_args->as;
-        auto marray = ptr_array(&opts.raw_index[0], opts.index_size);
         vector<SegmentMapping> compact_index;
-        size_t compacted_idx_size = 0;
+        atomic_uint64_t compacted_idx_size(0);
         moffset /= ALIGNMENT;
-        for (auto &m : marray) {
-            if (m.tag == (uint8_t)SegmentType::remoteData) {
-                compact_index.push_back(m);
-                compacted_idx_size++;
-                continue;
-            }
-            compacted_idx_size++;
-            if (m.zeroed) {
-                m.moffset = moffset;
-                compact_index.push_back(m);
-                // there is no need do pcopy if current block is zero-marked.
-                continue;
-            }
-            auto ret = pcopy(opts, m, moffset, compact_index);
-            if (ret < 0)
-                return (int)ret;
-            moffset += ret;
-        }
+        auto ret = copy_segments(opts, moffset, compact_index, compacted_idx_size, true);
+        if (ret < 0)
+            return (int)ret;
+        moffset = ret;
         uint64_t index_offset = moffset * ALIGNMENT;
         auto index_size = compress_raw_index(&compact_index[0], compact_index.size());
         LOG_DEBUG("write index to dest_file `, offset: `, size: `*`", dest_file, index_offset,
@@ -1337,6 +1640,70 @@ static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer
     return p;
 }
 
+// map the index of a sealed data file from `fd` instead of reading it into
+// memory, where `fd` is expected to hold the same bytes as `file` (e.g. the
+// local file underneath); this is checked by comparing their trailers, and
+// nullptr is returned if it doesn't hold, so the caller can fall back to
+// do_load_index(); `raw_tags_zero` tells whether the mapped array can be
+// used as is, without the tag translation of the index
+static IMemoryIndex *do_map_index(IFile *file, int fd, HeaderTrailer *pheader_trailer,
+                                  bool *raw_tags_zero) {
+    struct stat st, fst;
+    if (file->fstat(&st) < 0 || ::fstat(fd, &fst) < 0)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to stat file.");
+    if (st.st_size != fst.st_size || st.st_size < 2 * HeaderTrailer::SPACE)
+        return nullptr;
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    auto pht = verify_ht(file, buf, true, st.st_size);
+    if (pht == nullptr)
+        return nullptr;
+    off_t trailer_offset = st.st_size - HeaderTrailer::SPACE;
+    uint64_t index_bytes = pht->index_size * sizeof(SegmentMapping);
+    if (pht->index_offset < HeaderTrailer::SPACE ||
+        index_bytes > (uint64_t)(trailer_offset - pht->index_offset))
+        LOG_ERROR_RETURN(0, nullptr, "invalid index bytes or size");
+
+    // map through the trailer, which is compared with the one read from `file`
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t map_offset = pht->index_offset / page * page;
+    size_t map_len = st.st_size - map_offset;
+    auto addr = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, map_offset);
+    if (addr == MAP_FAILED)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to mmap index of `", file);
+    auto base = (const char *)addr - map_offset;
+    if (memcmp(base + trailer_offset, buf, HeaderTrailer::SPACE) != 0) {
+        munmap(addr, map_len);
+        LOG_WARN("fd ` doesn't hold the same data as `, can't map the index", fd, file);
+        return nullptr;
+    }
+
+    // drop the padding at the tail, don't bother to map a sparse array
+    auto p = (const SegmentMapping *)(base + pht->index_offset);
+    size_t n = pht->index_size;
+    while (n > 0 && p[n - 1].offset == SegmentMapping::INVALID_OFFSET)
+        n--;
+    *raw_tags_zero = true;
+    for (auto &m : ptr_array(p, n)) {
+        if (m.offset == SegmentMapping::INVALID_OFFSET) {
+            munmap(addr, map_len);
+            LOG_WARN("invalid mappings within the index of `, can't map it", file);
+            return nullptr;
+        }
+        if (m.tag != 0)
+            *raw_tags_zero = false;
+    }
+    auto pi = create_mapped_index(p, n, HeaderTrailer::SPACE / ALIGNMENT,
+                                  pht->index_offset / ALIGNMENT, addr, map_len);
+    if (!pi) {
+        munmap(addr, map_len);
+        LOG_ERROR_RETURN(0, nullptr, "failed to create mapped index!");
+    }
+    pht->index_size = n;
+    if (pheader_trailer)
+        *pheader_trailer = *pht;
+    return pi;
+}
+
 static LSMTReadOnlyFile *open_file_ro(IFile *file, bool ownership, bool reserve_tag) {
     if (!file) {
         LOG_ERROR("invalid file ptr. file: `", file);
@@ -1544,7 +1911,10 @@ IFileRO *open_warpfile_ro(IFile *warpfile, IFile *target_file, bool ownership) {
 struct parallel_load_task {
 
     IFile **files;
-    vector<unique_ptr<IMemoryIndex>> indexes;
+    const int *index_fds = nullptr;
+    const LayerIndex *const *layer_indexes = nullptr;
+    vector<unique_ptr<IMemoryIndex>> indexes; // indexes loaded by the task
+    vector<const IMemoryIndex *> pindexes;    // indexes of all the layers
     int eno = 0;
 
     struct Job {
@@ -1552,11 +1922,13 @@ struct parallel_load_task {
         HeaderTrailer ht;
         size_t i;
         uint8_t eno = 0;
+        bool mapped = false; // index mapped with all raw tags being 0
         IFile *get_file() {
             return tm->files[i];
         }
         void set_index(IMemoryIndex *idx) {
             tm->indexes[i].reset(idx);
+            tm->pindexes[i] = idx;
         }
         void set_error(int eno) {
             tm->eno = this->eno = eno;
@@ -1580,10 +1952,14 @@ struct parallel_load_task {
         return &jobs[i];
     }
 
-    parallel_load_task(IFile **files, size_t nlayers) {
+    parallel_load_task(IFile **files, size_t nlayers, const int *index_fds = nullptr,
+                       const LayerIndex *const *layer_indexes = nullptr) {
         this->nlayers = nlayers;
         this->files = files;
+        this->index_fds = index_fds;
+        this->layer_indexes = layer_indexes;
         indexes.resize(nlayers);
+        pindexes.resize(nlayers);
         jobs.resize(nlayers);
     }
 };
@@ -1613,6 +1989,14 @@ void *do_parallel_load_index(void *param) {
             // error occured from another threads.
             return nullptr;
         }
+        auto li = tm->layer_indexes ? tm->layer_indexes[job->i] : nullptr;
+        if (li) {
+            LOG_INFO("use shared index of `-th file, count: `", job->i, li->index->size());
+            job->ht.set_uuid(li->uuid);
+            job->ht.virtual_size = li->vsize;
+            tm->pindexes[job->i] = li->index;
+            continue;
+        }
         auto file = job->get_file();
         LOG_INFO("check `-th file is normal file or LSMT file", job->i);
         IMemoryIndex *pi = nullptr;
@@ -1632,6 +2016,15 @@ void *do_parallel_load_index(void *param) {
             verify_begin = 0;
 
         } else {
+            auto fd = tm->index_fds ? tm->index_fds[job->i] : -1;
+            if (fd >= 0) {
+                pi = do_map_index(file, fd, &job->ht, &job->mapped);
+                if (pi) {
+                    LOG_INFO("map index of `-th file, count: `", job->i, job->ht.index_size);
+                    job->set_index(pi);
+                    continue;
+                }
+            }
             p = do_load_index(job->get_file(), &job->ht, true);
             if (!p) {
                 job->set_error(EIO);
@@ -1651,11 +2044,13 @@ void *do_parallel_load_index(void *param) {
     return NULL;
 }
 
-static IMemoryIndex *load_merge_index(vector<IFile *> &files, vector<UUID> &uuid, uint64_t &vsize) {
+static IMemoryIndex *load_merge_index(vector<IFile *> &files, vector<UUID> &uuid, uint64_t &vsize,
+                                      const int *index_fds = nullptr,
+                                      const LayerIndex *const *layer_indexes = nullptr) {
     photon::join_handle *ths[PARALLEL_LOAD_INDEX];
     auto n = min(PARALLEL_LOAD_INDEX, (int)files.size());
     LOG_DEBUG("create ` photon threads to merge index", n);
-    parallel_load_task tm((IFile **)&(files[0]), files.size());
+    parallel_load_task tm((IFile **)&(files[0]), files.size(), index_fds, layer_indexes);
     for (auto i = 0; i < n; ++i) {
         ths[i] = photon::thread_enable_join(photon::thread_create(&do_parallel_load_index, &tm));
     }
@@ -1679,14 +2074,35 @@ static IMemoryIndex *load_merge_index(vector<IFile *> &files, vector<UUID> &uuid
 
     std::reverse(files.begin(), files.end());
     std::reverse(tm.indexes.begin(), tm.indexes.end());
+    std::reverse(tm.pindexes.begin(), tm.pindexes.end());
     std::reverse(uuid.begin(), uuid.end());
-    auto pmi = merge_memory_indexes((const IMemoryIndex **)&tm.indexes[0], tm.indexes.size());
+    if (tm.indexes.size() == 1 && tm.jobs[0].mapped && tm.indexes[0]) {
+        // a single mapped layer is used as is, sharing its pages
+        return tm.indexes[0].release();
+    }
+    auto pmi = merge_memory_indexes(&tm.pindexes[0], tm.pindexes.size());
     if (!pmi)
         LOG_ERROR_RETURN(0, nullptr, "failed to merge indexes");
     return pmi;
 }
 
-IFileRO *open_files_ro(IFile **files, size_t n, bool ownership) {
+LayerIndex *load_layer_index(IFile *file, int index_fd) {
+    if (!file)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid file ptr.");
+    parallel_load_task tm(&file, 1, &index_fd);
+    do_parallel_load_index(&tm);
+    if (tm.eno != 0)
+        LOG_ERROR_RETURN(tm.eno, nullptr, "failed to load layer index");
+    auto job = tm.get_result(0);
+    auto li = new LayerIndex;
+    li->index = tm.indexes[0].release();
+    li->uuid.parse(job->ht.uuid);
+    li->vsize = job->ht.virtual_size;
+    return li;
+}
+
+IFileRO *open_files_ro(IFile **files, size_t n, bool ownership, const int *index_fds,
+                       const LayerIndex *const *layer_indexes) {
     if (n > MAX_STACK_LAYERS) {
         LOG_ERROR_RETURN(0, 0, "open too many files (` > `)", n, MAX_STACK_LAYERS);
     }
@@ -1696,7 +2112,7 @@ IFileRO *open_files_ro(IFile **files, size_t n, bool ownership) {
     uint64_t vsize;
     vector<IFile *> m_files(files, files + n);
     vector<UUID> m_uuid(n);
-    auto pmi = load_merge_index(m_files, m_uuid, vsize);
+    auto pmi = load_merge_index(m_files, m_uuid, vsize, index_fds, layer_indexes);
     if (!pmi)
         return nullptr;
 
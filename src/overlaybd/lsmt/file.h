@@ -37,6 +37,24 @@ static const int MAX_STACK_LAYERS = 255;
 
 static const uint32_t ALIGNMENT = 512; // same as trim block size.
 static const uint32_t ALIGNMENT4K = 4096;
+
+struct CommitArgs {
+    photon::fs::IFile *as = nullptr;
+    char *user_tag = nullptr; // commit_msg, at most 256B
+    size_t tag_len = 0;       // commit_msg length
+    UUID::String uuid;        // set uuid when commit
+    UUID::String parent_uuid; // set parent uuid when commit
+    size_t compact_block_size = 32 * 1024; // max size of each read from source layers
+    int compact_concurrency = 1;           // number of reads in flight during compaction
+    size_t get_tag_len() const {
+        if (tag_len == 0 && user_tag != nullptr) {
+            return strlen(user_tag);
+        }
+        return tag_len;
+    }
+    CommitArgs(photon::fs::IFile *as) : as(as){};
+};
+
 class IFileRO : public photon::fs::VirtualReadOnlyFile {
 public:
     static const int GetType = 12;
@@ -44,6 +62,11 @@ public:
     virtual int set_max_io_size(size_t) = 0;
     virtual size_t get_max_io_size() = 0;
 
+    // set the max number of segment reads dispatched concurrently by one pread();
+    // 1 (the default) means segments are read one after another.
+    virtual int set_max_io_concurrency(int) = 0;
+    virtual int get_max_io_concurrency() = 0;
+
     virtual IMemoryIndex *index() const = 0;
 
     // return uuid of  m_files[layer_idx];
@@ -53,25 +76,11 @@ public:
 
     virtual ssize_t seek_data(off_t begin, off_t end, std::vector<Segment> &segs) = 0;
 
-    virtual int flatten(IFile *as) = 0;
+    // merge all layers into `args.as`
+    virtual int flatten(const CommitArgs &args) = 0;
 
 };
 
-struct CommitArgs {
-    photon::fs::IFile *as = nullptr;
-    char *user_tag = nullptr; // commit_msg, at most 256B
-    size_t tag_len = 0;       // commit_msg length
-    UUID::String uuid;        // set uuid when commit
-    UUID::String parent_uuid; // set parent uuid when commit
-    size_t get_tag_len() const {
-        if (tag_len == 0 && user_tag != nullptr) {
-            return strlen(user_tag);
-        }
-        return tag_len;
-    }
-    CommitArgs(photon::fs::IFile *as) : as(as){};
-};
-
 class IFileRW : public IFileRO {
 public:
     virtual IMemoryIndex0 *index() const override = 0;
@@ -152,11 +161,35 @@ extern "C" IFileRW *open_file_rw(photon::fs::IFile *fdata, photon::fs::IFile *fi
 // thus it will be destructed automatically.
 extern "C" IFileRO *open_file_ro(photon::fs::IFile *file, bool ownership = false);
 
+// the index of a single sealed layer, along with its identity,
+// which can be shared by the open_files_ro() of multiple images
+struct LayerIndex {
+    IMemoryIndex *index = nullptr;
+    UUID uuid;
+    uint64_t vsize = 0;
+    ~LayerIndex() {
+        delete index;
+    }
+};
+
+// load the index of a single sealed layer `file`,
+// with `index_fd` being as in open_files_ro()
+extern "C" LayerIndex *load_layer_index(photon::fs::IFile *file, int index_fd = -1);
+
 // open a read-only (sealed) LSMT file constituted by multiple layers,
 // with `files[0]` being the lowest layer, and vice versa
 // optionally obtaining the ownerships of the underlying files,
 // thus they will be destructed automatically.
-extern "C" IFileRO *open_files_ro(photon::fs::IFile **files, size_t n, bool ownership = false);
+// `index_fds`, if not null, gives for each layer a local fd holding the same
+// bytes as `files[i]` (or -1), from which the index is memory-mapped rather
+// than loaded into memory; the fds may be closed after the function returns,
+// and the files must not be modified while they are opened.
+// `layer_indexes`, if not null, gives for each layer an index loaded by
+// load_layer_index() (or null), which is used instead of loading it again;
+// they are only read during the merge, and may be released after return.
+extern "C" IFileRO *open_files_ro(photon::fs::IFile **files, size_t n, bool ownership = false,
+                                  const int *index_fds = nullptr,
+                                  const LayerIndex *const *layer_indexes = nullptr);
 
 extern "C" IFileRW *create_warpfile(WarpFileArgs &args, bool ownership = false);
 
@@ -16,7 +16,9 @@
 
 #include "index.h"
 #include <vector>
-#include <set>
+#include <iterator>
+#include <string.h>
+#include <sys/mman.h>
 #include <algorithm>
 #include <memory>
 #include <photon/common/alog.h>
@@ -120,7 +122,7 @@ public:
     virtual size_t lookup(Segment s, /* OUT */ SegmentMapping *pm, size_t n) const override {
         if (s.length == 0)
             return 0;
-        auto lb = std::lower_bound(pbegin, pend, s);
+        auto lb = lower_bound(s.offset);
         auto m = copy_n(lb, pend, s.end(), pm, n);
         trim_edge_mappings(pm, m, s);
         return m;
@@ -132,7 +134,8 @@ public:
     virtual SegmentMapping back() const override {
         return (pbegin != pend) ? *(pend - 1) : SegmentMapping::invalid_mapping();
     }
-    const SegmentMapping *lower_bound(uint64_t offset) const {
+    // the first mapping that ends after `offset`
+    virtual const SegmentMapping *lower_bound(uint64_t offset) const {
         return std::lower_bound(pbegin, pend, Segment{offset, 1});
     }
     const SegmentMapping *begin() const {
@@ -157,6 +160,132 @@ public:
     UNIMPLEMENTED_POINTER(IMemoryIndex  *make_read_only_index() const override);
 };
 
+// A read-only index with a cache-friendly search layout. The mappings stay
+// in the sorted array (so buffer(), merging and dumping work as usual), and
+// are grouped by cache line; the end offset of the last mapping of each
+// group is stored as a separator key in an eytzinger (BFS) ordered array,
+// aligned to cache line. A lookup descends the implicit tree touching one
+// key per level, prefetching the line of the descendants 3 levels below,
+// and finishes with a short linear scan inside one group of mappings.
+class EytzingerIndex : public Index {
+public:
+    static const size_t CACHE_LINE = 64;
+    static const size_t GROUP_SIZE = CACHE_LINE / sizeof(SegmentMapping);
+    static const size_t KEYS_PER_LINE = CACHE_LINE / sizeof(uint64_t);
+    uint64_t *m_keys = nullptr;    // [1..m_nkeys] in eytzinger order, [0] unused
+    uint32_t *m_groups = nullptr;  // group number of each key
+    size_t m_nkeys = 0;
+
+    EytzingerIndex(const SegmentMapping *pmappings = nullptr, size_t n = 0,
+                   bool ownership = true, uint64_t vsize = 0)
+        : Index(pmappings, n, ownership, vsize) {
+        build();
+    }
+    EytzingerIndex(vector<SegmentMapping> &&m, uint64_t vsize = 0)
+        : Index(std::move(m), vsize) {
+        build();
+    }
+    ~EytzingerIndex() {
+        free(m_keys);
+        free(m_groups);
+    }
+
+    void build() {
+        auto ngroups = (size() + GROUP_SIZE - 1) / GROUP_SIZE;
+        if (ngroups == 0 || ngroups > UINT32_MAX)
+            return;
+        void *keys = nullptr, *groups = nullptr;
+        if (posix_memalign(&keys, CACHE_LINE, (ngroups + 1) * sizeof(uint64_t)) != 0 ||
+            posix_memalign(&groups, CACHE_LINE, (ngroups + 1) * sizeof(uint32_t)) != 0) {
+            free(keys);
+            LOG_WARN("failed to allocate eytzinger layout for ` mappings, use binary search",
+                     size());
+            return;
+        }
+        m_keys = (uint64_t *)keys;
+        m_groups = (uint32_t *)groups;
+        m_nkeys = ngroups;
+        m_keys[0] = m_groups[0] = 0;
+        fill(1, 0);
+        LOG_DEBUG("eytzinger layout built, ` mappings in ` groups", size(), m_nkeys);
+    }
+
+    // in-order traversal of the implicit tree, assigning groups in order
+    size_t fill(size_t k, size_t g) {
+        if (k > m_nkeys)
+            return g;
+        g = fill(2 * k, g);
+        auto last = min((g + 1) * GROUP_SIZE, size()) - 1;
+        m_keys[k] = pbegin[last].end();
+        m_groups[k] = g++;
+        return fill(2 * k + 1, g);
+    }
+
+    virtual const SegmentMapping *lower_bound(uint64_t offset) const override {
+        if (!m_keys)
+            return Index::lower_bound(offset);
+        size_t k = 1;
+        while (k <= m_nkeys) {
+            __builtin_prefetch(m_keys + k * KEYS_PER_LINE);
+            k = 2 * k + (m_keys[k] <= offset);
+        }
+        // strip the trailing right turns, k is then the first key > offset
+        k >>= __builtin_ffsll(~k);
+        if (k == 0)
+            return pend;
+        auto it = pbegin + (size_t)m_groups[k] * GROUP_SIZE;
+        while (it->end() <= offset)
+            ++it;
+        return it;
+    }
+};
+
+// A read-only index directly on top of a memory-mapped array of mappings,
+// e.g. the index region of a sealed layer file, so the pages are shared
+// through page cache by all the devices using the layer. The array is never
+// written: tags are translated through a per-index table on the way out,
+// instead of being edited in place.
+class MappedIndex : public Index {
+public:
+    void *m_addr;
+    size_t m_len;
+    uint8_t m_tags[256];
+
+    MappedIndex(const SegmentMapping *pmappings, size_t n, void *addr, size_t len, uint8_t tag,
+                uint64_t vsize)
+        : Index(pmappings, n, false, vsize), m_addr(addr), m_len(len) {
+        memset(m_tags, tag, sizeof(m_tags));
+        for (auto &m : ptr_array(pmappings, n))
+            alloc_blk += m.length * (!m.zeroed);
+    }
+    ~MappedIndex() {
+        munmap(m_addr, m_len);
+    }
+
+    virtual size_t lookup(Segment s, /* OUT */ SegmentMapping *pm, size_t n) const override {
+        auto m = Index::lookup(s, pm, n);
+        for (size_t i = 0; i < m; ++i)
+            pm[i].tag = m_tags[pm[i].tag];
+        return m;
+    }
+    virtual SegmentMapping front() const override {
+        auto m = Index::front();
+        m.tag = m_tags[m.tag];
+        return m;
+    }
+    virtual SegmentMapping back() const override {
+        auto m = Index::back();
+        m.tag = m_tags[m.tag];
+        return m;
+    }
+    int increase_tag(int delta) override {
+        LOG_DEBUG("mapped index tag add `", delta);
+        for (auto &t : m_tags)
+            t += delta;
+        return 0;
+    }
+};
+
 class LevelIndex : public Index {
 public:
     vector<vector<uint64_t>> level_mapping;
@@ -237,10 +366,363 @@ public:
     }
 };
 
+// An in-memory B+tree of non-overlapping SegmentMappings, ordered by offset,
+// used as the memtable of writable layers. Leaves are cache-line friendly
+// arrays of mappings chained in both directions; inner nodes hold separator
+// keys. For a separator `k` between subtrees A and B, every mapping in A
+// ends at or before `k`, and every mapping in B starts at or after `k`, so
+// a lookup lands on the leaf holding the first mapping that ends after the
+// target offset, or the one just before it.
+// Nodes come from a per-tree pool allocated in slabs. Erasure doesn't
+// rebalance, a node is released only when it becomes empty, which suits
+// the write-mostly workload of an upper layer.
+class MappingTree {
+public:
+    static const uint32_t LEAF_CAPACITY = 62;
+    static const uint32_t INNER_CAPACITY = 32;
+
+    struct Inner;
+    struct Leaf {
+        Leaf *prev, *next;
+        Inner *parent;
+        uint32_t n;
+        SegmentMapping e[LEAF_CAPACITY];
+    };
+    struct Inner {
+        Inner *parent;
+        uint32_t n;     // # of children
+        uint32_t level; // level of children, 0 for leaves
+        uint64_t key[INNER_CAPACITY - 1];
+        void *child[INNER_CAPACITY];
+    };
+
+    template <typename T>
+    struct NodePool {
+        static const size_t MAX_SLAB = 64;
+        vector<unique_ptr<T[]>> slabs;
+        vector<T *> free_nodes;
+        size_t allocated = 0;
+        T *get() {
+            if (free_nodes.empty()) {
+                size_t n = allocated < MAX_SLAB ? allocated + 1 : MAX_SLAB;
+                slabs.emplace_back(new T[n]);
+                for (size_t i = 0; i < n; ++i)
+                    free_nodes.push_back(&slabs.back()[n - 1 - i]);
+                allocated += n;
+            }
+            auto p = free_nodes.back();
+            free_nodes.pop_back();
+            return p;
+        }
+        void put(T *p) {
+            free_nodes.push_back(p);
+        }
+        void clear() {
+            free_nodes.clear();
+            slabs.clear();
+            allocated = 0;
+        }
+    };
+
+    class iterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef SegmentMapping value_type;
+        typedef ptrdiff_t difference_type;
+        typedef SegmentMapping *pointer;
+        typedef SegmentMapping &reference;
+
+        const MappingTree *tree = nullptr;
+        Leaf *leaf = nullptr;
+        uint32_t pos = 0;
+
+        iterator() = default;
+        iterator(const MappingTree *tree, Leaf *leaf, uint32_t pos)
+            : tree(tree), leaf(leaf), pos(pos) {
+        }
+        reference operator*() const {
+            return leaf->e[pos];
+        }
+        pointer operator->() const {
+            return &leaf->e[pos];
+        }
+        iterator &operator++() {
+            if (++pos == leaf->n) {
+                leaf = leaf->next;
+                pos = 0;
+            }
+            return *this;
+        }
+        iterator &operator--() {
+            if (!leaf) {
+                leaf = tree->m_tail;
+                pos = leaf->n - 1;
+            } else if (pos == 0) {
+                leaf = leaf->prev;
+                pos = leaf->n - 1;
+            } else {
+                --pos;
+            }
+            return *this;
+        }
+        iterator operator++(int) {
+            auto it = *this;
+            ++*this;
+            return it;
+        }
+        iterator operator--(int) {
+            auto it = *this;
+            --*this;
+            return it;
+        }
+        bool operator==(const iterator &rhs) const {
+            return leaf == rhs.leaf && pos == rhs.pos;
+        }
+        bool operator!=(const iterator &rhs) const {
+            return !(*this == rhs);
+        }
+    };
+
+    MappingTree() = default;
+    MappingTree(const MappingTree &rhs) {
+        *this = rhs;
+    }
+    MappingTree &operator=(const MappingTree &rhs) {
+        if (this == &rhs)
+            return *this;
+        clear();
+        for (auto it = rhs.begin(); it != rhs.end(); ++it)
+            push_back(*it);
+        return *this;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+    bool empty() const {
+        return m_size == 0;
+    }
+    iterator begin() const {
+        return iterator(this, m_head, 0);
+    }
+    iterator end() const {
+        return iterator(this, nullptr, 0);
+    }
+
+    void clear() {
+        m_leaves.clear();
+        m_inners.clear();
+        m_root = nullptr;
+        m_head = m_tail = nullptr;
+        m_height = 0;
+        m_size = 0;
+    }
+
+    // the first mapping that ends after `offset`
+    iterator lower_bound(uint64_t offset) const {
+        if (!m_root)
+            return end();
+        void *node = m_root;
+        for (auto h = m_height; h > 0; --h) {
+            auto in = (Inner *)node;
+            node = in->child[route(in, offset)];
+        }
+        auto leaf = (Leaf *)node;
+        auto it = std::lower_bound(leaf->e, leaf->e + leaf->n, offset,
+                                   [](const SegmentMapping &m, uint64_t x) { return m.end() <= x; });
+        uint32_t pos = it - leaf->e;
+        if (pos == leaf->n)
+            return iterator(this, leaf->next, 0);
+        return iterator(this, leaf, pos);
+    }
+
+    // insert a mapping that doesn't overlap with any existing one
+    void insert(const SegmentMapping &m) {
+        if (!m_root) {
+            auto leaf = m_leaves.get();
+            leaf->prev = leaf->next = nullptr;
+            leaf->parent = nullptr;
+            leaf->n = 0;
+            m_root = m_head = m_tail = leaf;
+        }
+        void *node = m_root;
+        for (auto h = m_height; h > 0; --h) {
+            auto in = (Inner *)node;
+            auto i = route(in, m.offset);
+            if (i < in->n - 1 && in->key[i] < m.end())
+                in->key[i] = m.end();
+            node = in->child[i];
+        }
+        auto leaf = (Leaf *)node;
+        uint32_t pos = std::upper_bound(leaf->e, leaf->e + leaf->n, m.offset,
+                                        [](uint64_t x, const SegmentMapping &e) {
+                                            return x < e.offset;
+                                        }) -
+                       leaf->e;
+        if (leaf->n == LEAF_CAPACITY) {
+            // appending to the last leaf leaves it full, for sequential inserts
+            bool append = (pos == leaf->n && !leaf->next);
+            uint32_t mid = append ? leaf->n : leaf->n / 2;
+            auto right = split_leaf(leaf, mid, append ? m.offset : leaf->e[mid].offset);
+            if (append || pos > mid) {
+                leaf = right;
+                pos -= mid;
+            }
+        }
+        memmove(leaf->e + pos + 1, leaf->e + pos, (leaf->n - pos) * sizeof(SegmentMapping));
+        leaf->e[pos] = m;
+        leaf->n++;
+        m_size++;
+    }
+
+    // append a mapping that lies after all existing ones
+    void push_back(const SegmentMapping &m) {
+        if (m_tail && m_tail->n < LEAF_CAPACITY) {
+            m_tail->e[m_tail->n++] = m;
+            m_size++;
+        } else {
+            insert(m);
+        }
+    }
+
+    // erase the mapping at `it`, returning the iterator to the next one
+    iterator erase(iterator it) {
+        auto leaf = it.leaf;
+        auto pos = it.pos;
+        memmove(leaf->e + pos, leaf->e + pos + 1, (leaf->n - pos - 1) * sizeof(SegmentMapping));
+        leaf->n--;
+        m_size--;
+        if (pos < leaf->n)
+            return it;
+        auto next = leaf->next;
+        if (leaf->n == 0) {
+            (leaf->prev ? leaf->prev->next : m_head) = leaf->next;
+            (leaf->next ? leaf->next->prev : m_tail) = leaf->prev;
+            remove_node(leaf, 0);
+        }
+        return iterator(this, next, 0);
+    }
+
+    SegmentMapping &front() const {
+        return m_head->e[0];
+    }
+    SegmentMapping &back() const {
+        return m_tail->e[m_tail->n - 1];
+    }
+
+    // copy all the mappings to `pm`, which must have room for size() of them
+    void copy_to(SegmentMapping *pm) const {
+        for (auto leaf = m_head; leaf; leaf = leaf->next) {
+            memcpy(pm, leaf->e, leaf->n * sizeof(SegmentMapping));
+            pm += leaf->n;
+        }
+    }
+
+protected:
+    void *m_root = nullptr;
+    Leaf *m_head = nullptr, *m_tail = nullptr;
+    uint32_t m_height = 0;
+    size_t m_size = 0;
+    NodePool<Leaf> m_leaves;
+    NodePool<Inner> m_inners;
+
+    static uint32_t route(const Inner *in, uint64_t x) {
+        return std::upper_bound(in->key, in->key + in->n - 1, x) - in->key;
+    }
+    static Inner *&parent_of(void *node, uint32_t level) {
+        return level ? ((Inner *)node)->parent : ((Leaf *)node)->parent;
+    }
+    static uint32_t child_index(const Inner *in, void *node) {
+        uint32_t i = 0;
+        while (in->child[i] != node)
+            ++i;
+        return i;
+    }
+
+    Leaf *split_leaf(Leaf *leaf, uint32_t mid, uint64_t key) {
+        auto right = m_leaves.get();
+        right->n = leaf->n - mid;
+        memcpy(right->e, leaf->e + mid, right->n * sizeof(SegmentMapping));
+        leaf->n = mid;
+        right->prev = leaf;
+        right->next = leaf->next;
+        (leaf->next ? leaf->next->prev : m_tail) = right;
+        leaf->next = right;
+        insert_child(leaf, right, key, 0);
+        return right;
+    }
+
+    // insert `right` next to its left sibling `left`, separated by `key`
+    void insert_child(void *left, void *right, uint64_t key, uint32_t level) {
+        auto parent = parent_of(left, level);
+        if (!parent) {
+            auto root = m_inners.get();
+            root->parent = nullptr;
+            root->n = 2;
+            root->level = level;
+            root->key[0] = key;
+            root->child[0] = left;
+            root->child[1] = right;
+            parent_of(left, level) = parent_of(right, level) = root;
+            m_root = root;
+            m_height++;
+            return;
+        }
+        if (parent->n == INNER_CAPACITY) {
+            auto sibling = m_inners.get();
+            auto h = parent->n / 2;
+            sibling->n = parent->n - h;
+            sibling->level = level;
+            memcpy(sibling->key, parent->key + h, (sibling->n - 1) * sizeof(uint64_t));
+            memcpy(sibling->child, parent->child + h, sibling->n * sizeof(void *));
+            for (uint32_t i = 0; i < sibling->n; ++i)
+                parent_of(sibling->child[i], level) = sibling;
+            parent->n = h;
+            insert_child(parent, sibling, parent->key[h - 1], level + 1);
+            parent = parent_of(left, level);
+        }
+        auto i = child_index(parent, left) + 1;
+        memmove(parent->key + i, parent->key + i - 1, (parent->n - i) * sizeof(uint64_t));
+        memmove(parent->child + i + 1, parent->child + i, (parent->n - i) * sizeof(void *));
+        parent->key[i - 1] = key;
+        parent->child[i] = right;
+        parent->n++;
+        parent_of(right, level) = parent;
+    }
+
+    void remove_node(void *node, uint32_t level) {
+        auto parent = parent_of(node, level);
+        if (level)
+            m_inners.put((Inner *)node);
+        else
+            m_leaves.put((Leaf *)node);
+        if (!parent) {
+            m_root = nullptr;
+            m_height = 0;
+            return;
+        }
+        auto i = child_index(parent, node);
+        if (parent->n > 1) {
+            auto k = i ? i - 1 : 0;
+            memmove(parent->key + k, parent->key + k + 1, (parent->n - 2 - k) * sizeof(uint64_t));
+        }
+        memmove(parent->child + i, parent->child + i + 1, (parent->n - 1 - i) * sizeof(void *));
+        if (--parent->n == 0)
+            return remove_node(parent, level + 1);
+        while (m_height && ((Inner *)m_root)->n == 1) {
+            auto root = (Inner *)m_root;
+            m_root = root->child[0];
+            parent_of(m_root, root->level) = nullptr;
+            m_inners.put(root);
+            m_height--;
+        }
+    }
+};
+
 class Index0 : public IComboIndex {
 public:
-    set<SegmentMapping> mapping;
-    typedef set<SegmentMapping>::iterator iterator;
+    MappingTree mapping;
+    typedef MappingTree::iterator iterator;
 
     struct block_usage {
         uint64_t m_alloc = 0;
@@ -256,7 +738,7 @@ public:
         }
     } alloc_blk;
 
-    // Index0(const set<SegmentMapping> &mapping) : mapping(mapping){};
+    // Index0(const MappingTree &mapping) : mapping(mapping){};
 
     Index0(const SegmentMapping *pmappings = nullptr, size_t n = 0) {
         if (pmappings == nullptr)
@@ -272,39 +754,6 @@ public:
     virtual const SegmentMapping *buffer() const override {
         return nullptr;
     }
-    iterator remove_partial_overlap(iterator it, uint64_t offset, uint32_t length) {
-        auto nx = next(it);
-        auto end = offset + length;
-        auto p = (SegmentMapping *)&*it;
-        if (p->offset < offset) // p->offset < offset < p->end() < end
-        {
-            assert(p->end() > offset);
-            alloc_blk -= *p;
-            if (p->end() <= end) {
-                p->backward_end_to(offset);
-                alloc_blk += *p;
-            } else // if (p->end() > end) // m lies in *p
-            {
-                SegmentMapping nm = *p;
-                nm.forward_offset_to(end);
-                p->backward_end_to(offset); // shrink first,
-                mapping.insert(it, nm);     // and then insert() !!!
-                alloc_blk += *p;
-                alloc_blk += nm;
-            }
-        } else if (/* p->offset >= m.offset && */ p->offset < end) {
-            alloc_blk -= *p;
-            if (p->end() <= end) // included by [offset, end)
-            {
-                mapping.erase(it);
-            } else // (p->end() > end)
-            {
-                p->forward_offset_to(end);
-                alloc_blk += *p;
-            }
-        }
-        return nx;
-    }
     iterator prev(iterator it) const {
         return --it;
     }
@@ -315,31 +764,42 @@ public:
         if (m.length == 0)
             return;
         alloc_blk += m;
-        auto it = mapping.lower_bound(m);
-        if (it == mapping.end()) {
-            mapping.insert(m);
-            return;
+        auto it = mapping.lower_bound(m.offset);
+        if (it != mapping.end() && it->offset < m.offset) {
+            // the first one, which starts before m
+            auto p = &*it;
+            alloc_blk -= *p;
+            if (p->end() > m.end()) { // m lies in *p
+                SegmentMapping nm = *p;
+                nm.forward_offset_to(m.end());
+                p->backward_end_to(m.offset);
+                alloc_blk += *p;
+                alloc_blk += nm;
+                mapping.insert(m);
+                mapping.insert(nm);
+                return;
+            }
+            p->backward_end_to(m.offset);
+            alloc_blk += *p;
+            ++it;
         }
-
-        it = remove_partial_overlap(it, m.offset, m.length); // first one (there must be)
-        assert(it == mapping.end() || it->offset > m.offset);
         while (it != mapping.end() && it->offset < m.end()) {
+            alloc_blk -= *it;
             if (it->end() <= m.end()) {
-                alloc_blk -= *it;
                 it = mapping.erase(it); // middle ones, if there are
             } else {
-                it = remove_partial_overlap(it, m.offset, m.length); // last one, if there is
+                it->forward_offset_to(m.end()); // the last one, if there is
+                alloc_blk += *it;
                 break;
             }
         }
-        mapping.insert(it, m);
+        mapping.insert(m);
     }
 
     virtual size_t lookup(Segment s, /* OUT */ SegmentMapping *pm, size_t n) const override {
         if (s.length == 0)
             return 0;
-        SegmentMapping ss(s.offset, s.length, 0);
-        auto lb = mapping.lower_bound(ss);
+        auto lb = mapping.lower_bound(s.offset);
         auto m = copy_n(lb, mapping.end(), s.end(), pm, n);
         trim_edge_mappings(pm, m, s);
         return m;
@@ -354,15 +814,14 @@ public:
         }
         LOG_INFO("index dump, size: ` ( mapping.size: ` )", size, mapping.size());
         auto rst = new SegmentMapping[size];
-        std::copy(mapping.begin(), mapping.end(), rst);
+        mapping.copy_to(rst);
         return rst;
     }
 
     virtual IMemoryIndex *make_read_only_index() const override {
-        auto rst = new Index();
-        rst->mapping.reserve(size());
-        rst->assign(mapping.begin(), mapping.end());
-        return rst;
+        vector<SegmentMapping> array(size());
+        mapping.copy_to(array.data());
+        return new Index(std::move(array));
     }
 
     virtual uint64_t block_count() const override {
@@ -372,16 +831,15 @@ public:
     // returns the first and last mapping in the index
     // the there's no one, return an invalid mapping: [INVALID_OFFSET, 0) ==> 0
     virtual SegmentMapping front() const override {
-        return !mapping.empty() ? *mapping.begin() : SegmentMapping::invalid_mapping();
+        return !mapping.empty() ? mapping.front() : SegmentMapping::invalid_mapping();
     }
     virtual SegmentMapping back() const override {
         printf("!mapping.empty()? :%d\n", mapping.empty());
-        return !mapping.empty() ? *prev(mapping.end()) : SegmentMapping::invalid_mapping();
+        return !mapping.empty() ? mapping.back() : SegmentMapping::invalid_mapping();
     }
 
     iterator lower_bound(uint64_t offset) const {
-        SegmentMapping ss(offset, 1, 0);
-        return mapping.lower_bound(ss);
+        return mapping.lower_bound(offset);
     }
     iterator end() const {
         return mapping.end();
@@ -438,7 +896,7 @@ public:
             return Index0::lookup(s, pm, n);
 
         auto pm_ = pm;
-        auto it = mapping.lower_bound({s.offset, s.length, 0});
+        auto it = mapping.lower_bound(s.offset);
         auto soffset = s.offset;
         auto send = s.end();
         while (it != mapping.end() && it->offset < send && n) {
@@ -567,10 +1025,23 @@ IMemoryIndex0 *create_memory_index0(const SegmentMapping *pmappings, size_t n,
 }
 
 IMemoryIndex *create_memory_index(const SegmentMapping *pmappings, size_t n, uint64_t moffset_begin,
-                                  uint64_t moffset_end, bool ownership, uint64_t vsize) {
+                                  uint64_t moffset_end, bool ownership, uint64_t vsize,
+                                  uint8_t layout) {
+    auto ok1 = verify_mapping_order(pmappings, n);
+    auto ok2 = verify_mapping_moffset(pmappings, n, moffset_begin, moffset_end);
+    if (!ok1 || !ok2)
+        return nullptr;
+    if (layout == INDEX_LAYOUT_EYTZINGER)
+        return new EytzingerIndex(pmappings, n, ownership, vsize);
+    return new Index(pmappings, n, ownership, vsize);
+}
+
+IMemoryIndex *create_mapped_index(const SegmentMapping *pmappings, size_t n,
+                                  uint64_t moffset_begin, uint64_t moffset_end, void *addr,
+                                  size_t len, uint8_t tag, uint64_t vsize) {
     auto ok1 = verify_mapping_order(pmappings, n);
     auto ok2 = verify_mapping_moffset(pmappings, n, moffset_begin, moffset_end);
-    return (ok1 && ok2) ? new Index(pmappings, n, ownership, vsize) : nullptr;
+    return (ok1 && ok2) ? new MappedIndex(pmappings, n, addr, len, tag, vsize) : nullptr;
 }
 
 IMemoryIndex *create_level_index(const SegmentMapping *pmappings, size_t n, uint64_t moffset_begin,
@@ -682,7 +1153,7 @@ size_t compress_raw_index_predict(const SegmentMapping *mapping, size_t n) {
     return i;
 }
 
-IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, size_t n) {
+IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, size_t n, uint8_t layout) {
     if (n > 255) {
         LOG_ERROR("too many indexes to merge, 255 at most!");
         return nullptr;
@@ -694,6 +1165,8 @@ IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, size_t n) {
     auto pi = (const Index **)pindexes;
     mapping.reserve(pi[0]->size());
     merge_indexes(0, mapping, pi, n, 0, UINT64_MAX);
+    if (layout == INDEX_LAYOUT_EYTZINGER)
+        return new EytzingerIndex(std::move(mapping), pindexes[0]->vsize());
     return new Index(std::move(mapping), pindexes[0]->vsize());
 }
 } // namespace LSMT
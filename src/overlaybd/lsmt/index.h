@@ -17,7 +17,7 @@
 /*
 VirualReadOnly -> IFileRO -> IFileRW -> LSMTReadOnlyFile -> LSMTFile
 
-IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> ComboIndex
+IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( b+tree of SegmentMap ) -> ComboIndex
          |
          | -> Index ( vector<SegmentMap> )
 */
@@ -168,6 +168,12 @@ inline IMemoryIndex0 *create_memory_index0() {
     return create_memory_index0(nullptr, 0, 0, UINT64_MAX);
 }
 
+// search layout of a read-only memory index
+enum IndexLayout : uint8_t {
+    INDEX_LAYOUT_SORTED = 0,    // binary search over the sorted array
+    INDEX_LAYOUT_EYTZINGER = 1, // cache-line aligned eytzinger tree of separator keys
+};
+
 // create a read-only memory index from an array of mappings;
 // the mappings should have been sorted and should not intersect with each other!!
 // the array buffer must remain valid as long as the index is valid, if copy_mode = 0 or 1.
@@ -175,12 +181,26 @@ inline IMemoryIndex0 *create_memory_index0() {
 // the mapped offset must be within [moffset_begin, moffset_end)
 extern "C" IMemoryIndex *create_memory_index(const SegmentMapping *pmappings, std::size_t n,
                                              uint64_t moffset_begin, uint64_t moffset_end,
-                                             bool ownership = true, uint64_t vsize = 0);
+                                             bool ownership = true, uint64_t vsize = 0,
+                                             uint8_t layout = INDEX_LAYOUT_SORTED);
+
+// create a read-only memory index directly on an array of mappings in a
+// read-only memory-mapped region [addr, addr + len), which is unmapped when
+// the index is destroyed (but not if the creation fails); the array is never
+// written, and the tags of the mappings looked up are translated through a
+// per-index table, initially mapping any tag to `tag`
+// the mapped offset must be within [moffset_begin, moffset_end)
+extern "C" IMemoryIndex *create_mapped_index(const SegmentMapping *pmappings, std::size_t n,
+                                             uint64_t moffset_begin, uint64_t moffset_end,
+                                             void *addr, std::size_t len, uint8_t tag = 0,
+                                             uint64_t vsize = 0);
 
 // merge multiple indexes into a single one index
 // the `tag` field of each element in the result is subscript of `pindexes`:
-// after creation, the sources can be safely destoryed
-extern "C" IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, std::size_t n);
+// after creation, the sources can be safely destoryed;
+// the merged index is built once, so it uses the eytzinger layout by default
+extern "C" IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, std::size_t n,
+                                              uint8_t layout = INDEX_LAYOUT_EYTZINGER);
 
 // combine an index0 and an index into a combo, which, when looked-up, behaves as if they
 // were one single index; inserting into a combo effectively inserting into the index0 part;
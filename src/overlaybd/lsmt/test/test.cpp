@@ -17,7 +17,7 @@
 /*
 VirualReadOnly -> IFileRO -> IFileRW -> LSMTReadOnlyFile -> LSMTFile
 
-IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> ComboIndex
+IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( b+tree of SegmentMap ) -> ComboIndex
          |
          | -> Index ( vector<SegmentMap> )
 
@@ -31,6 +31,7 @@ IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> Co
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <set>
 
 #define USE_PTH true // use pthread
 
@@ -110,6 +111,96 @@ TEST(Index0, insert) {
 
 #define RAND_RANGE (uint64_t)(rand() % ((32 << 20) - 128)), (uint32_t)(rand() % (1 << 6) + 1)
 
+// the std::set based memtable that Index0 used to be, as a reference
+struct SetIndex0 {
+    set<SegmentMapping> mapping;
+    typedef set<SegmentMapping>::iterator iterator;
+
+    iterator remove_partial_overlap(iterator it, uint64_t offset, uint32_t length) {
+        auto nx = next(it);
+        auto end = offset + length;
+        auto p = (SegmentMapping *)&*it;
+        if (p->offset < offset) {
+            if (p->end() <= end) {
+                p->backward_end_to(offset);
+            } else {
+                SegmentMapping nm = *p;
+                nm.forward_offset_to(end);
+                p->backward_end_to(offset);
+                mapping.insert(it, nm);
+            }
+        } else if (p->offset < end) {
+            if (p->end() <= end)
+                mapping.erase(it);
+            else
+                p->forward_offset_to(end);
+        }
+        return nx;
+    }
+    void insert(SegmentMapping m) {
+        auto it = mapping.lower_bound(m);
+        if (it == mapping.end()) {
+            mapping.insert(m);
+            return;
+        }
+        it = remove_partial_overlap(it, m.offset, m.length);
+        while (it != mapping.end() && it->offset < m.end()) {
+            if (it->end() <= m.end()) {
+                it = mapping.erase(it);
+            } else {
+                it = remove_partial_overlap(it, m.offset, m.length);
+                break;
+            }
+        }
+        mapping.insert(it, m);
+    }
+    size_t lookup(Segment s, SegmentMapping *pm, size_t n) const {
+        auto lb = mapping.lower_bound(SegmentMapping(s.offset, s.length, 0));
+        auto m = copy_n(lb, mapping.end(), s.end(), pm, n);
+        trim_edge_mappings(pm, m, s);
+        return m;
+    }
+};
+
+TEST(Index0, insert_vs_set) {
+    for (int range : {2000, 32 << 20}) {
+        Index0 idx;
+        SetIndex0 ref;
+        for (int i = 0; i < 200000; ++i) {
+            SegmentMapping m{(uint64_t)(rand() % range), (uint32_t)(rand() % 64 + 1),
+                             (uint64_t)(rand() % 10000000)};
+            if (rand() % 8 == 0)
+                m.discard();
+            idx.insert(m);
+            ref.insert(m);
+        }
+        ASSERT_EQ(idx.size(), ref.mapping.size());
+        auto p = idx.dump();
+        DEFER(delete[] p);
+        uint64_t blocks = 0;
+        size_t i = 0;
+        for (auto &m : ref.mapping) {
+            EXPECT_EQ(p[i++], m);
+            blocks += m.length * (!m.zeroed);
+        }
+        EXPECT_EQ(idx.block_count(), blocks);
+        SegmentMapping pm0[16], pm1[16];
+        for (int j = 0; j < 10000; ++j) {
+            auto s = Segment{(uint64_t)(rand() % range), (uint32_t)(rand() % 256 + 1)};
+            auto n0 = ref.lookup(s, pm0, LEN(pm0));
+            auto n1 = idx.lookup(s, pm1, LEN(pm1));
+            ASSERT_EQ(n0, n1);
+            ASSERT_EQ(memcmp(pm0, pm1, n0 * sizeof(pm0[0])), 0);
+        }
+        // overwrite everything, leaving few mappings
+        for (uint64_t offset = 0; offset <= (uint64_t)range; offset += 8192)
+            idx.insert({offset, 8192, offset});
+        EXPECT_EQ(idx.size(), (size_t)range / 8192 + 1);
+        EXPECT_EQ((uint64_t)idx.front().offset, 0UL);
+        EXPECT_EQ((uint64_t)idx.back().moffset, (uint64_t)range / 8192 * 8192);
+    }
+}
+
 uint64_t max_offset = 0;
 static void do_randwrite(/* LSMT:: */ IComboIndex *idx0, uint32_t *moffsets) {
     SegmentMapping s{RAND_RANGE, /*moffset = */ (uint64_t)(rand() % 10000000 + 1)};
@@ -233,6 +324,89 @@ TEST(Perf, Index1_randread1M) {
     delete[] p;
 }
 
+TEST(Perf, IndexEytzinger_randread1M) {
+    auto p = idx0->dump();
+    auto idx = create_memory_index(p, idx0->size(), 0, UINT64_MAX, false, 0,
+                                   INDEX_LAYOUT_EYTZINGER);
+    test_randread1M(idx);
+    delete idx;
+    delete[] p;
+}
+
+TEST(Perf, IndexLayout_lookup) {
+    auto p = idx0->dump();
+    DEFER(delete[] p);
+    IMemoryIndex *sorted =
+        create_memory_index(p, idx0->size(), 0, UINT64_MAX, false, 0, INDEX_LAYOUT_SORTED);
+    IMemoryIndex *eytz =
+        create_memory_index(p, idx0->size(), 0, UINT64_MAX, false, 0, INDEX_LAYOUT_EYTZINGER);
+    DEFER(delete sorted);
+    DEFER(delete eytz);
+    const int N = 1000 * 1000;
+    vector<Segment> segs;
+    for (int i = 0; i < N; ++i)
+        segs.push_back(Segment{RAND_RANGE});
+    SegmentMapping pm0[16], pm1[16];
+    for (int i = 0; i < N; i += 97) {
+        auto n0 = sorted->lookup(segs[i], pm0, LEN(pm0));
+        auto n1 = eytz->lookup(segs[i], pm1, LEN(pm1));
+        ASSERT_EQ(n0, n1);
+        ASSERT_EQ(memcmp(pm0, pm1, n0 * sizeof(pm0[0])), 0);
+    }
+    for (auto idx : {sorted, eytz}) {
+        size_t found = 0;
+        struct timeval start_time, end_time;
+        gettimeofday(&start_time, 0);
+        for (auto &s : segs)
+            found += idx->lookup(s, pm0, LEN(pm0));
+        gettimeofday(&end_time, 0);
+        uint64_t elapsed = 1000000UL * (end_time.tv_sec - start_time.tv_sec) +
+                           end_time.tv_usec - start_time.tv_usec;
+        LOG_INFO("` lookups on ` mappings: ` found, ` us", N, idx->size(), found, elapsed);
+    }
+}
+
+TEST(Perf, Index0_vs_set) {
+    const int N = 1000 * 1000;
+    vector<SegmentMapping> writes;
+    vector<Segment> reads;
+    for (int i = 0; i < N; ++i) {
+        writes.push_back(SegmentMapping{RAND_RANGE, (uint64_t)i});
+        reads.push_back(Segment{RAND_RANGE});
+    }
+    auto elapsed = [](struct timeval &start_time) {
+        struct timeval end_time;
+        gettimeofday(&end_time, 0);
+        return 1000000UL * (end_time.tv_sec - start_time.tv_sec) + end_time.tv_usec -
+               start_time.tv_usec;
+    };
+    struct timeval start_time;
+    SegmentMapping pm[16];
+    size_t found = 0;
+
+    SetIndex0 ref;
+    gettimeofday(&start_time, 0);
+    for (auto &m : writes)
+        ref.insert(m);
+    LOG_INFO("std::set: ` inserts in ` us, ` mappings", N, elapsed(start_time), ref.mapping.size());
+    gettimeofday(&start_time, 0);
+    for (auto &s : reads)
+        found += ref.lookup(s, pm, LEN(pm));
+    LOG_INFO("std::set: ` lookups in ` us, ` found", N, elapsed(start_time), found);
+
+    Index0 idx;
+    found = 0;
+    gettimeofday(&start_time, 0);
+    for (auto &m : writes)
+        idx.insert(m);
+    LOG_INFO("b+tree: ` inserts in ` us, ` mappings", N, elapsed(start_time), idx.size());
+    gettimeofday(&start_time, 0);
+    for (auto &s : reads)
+        found += idx.lookup(s, pm, LEN(pm));
+    LOG_INFO("b+tree: ` lookups in ` us, ` found", N, elapsed(start_time), found);
+    EXPECT_EQ(idx.size(), ref.mapping.size());
+}
+
 void test_combo(const IMemoryIndex *indexes[], size_t ni, const SegmentMapping stdrst[],
                 size_t nrst) {
     auto i0 = create_memory_index0(indexes[0]->buffer(), indexes[0]->size(), 0, 1000000);
@@ -551,6 +725,55 @@ TEST_F(FileTest2, commit) {
     DEFER(lfs->unlink(fn_c1));
 }
 
+TEST(ZeroBlock, detect) {
+    ALIGNED_MEM4K(block, 4096);
+    memset(block, 0, 4096);
+    EXPECT_EQ(is_zero_block(block, 4096), 0);
+    EXPECT_EQ(is_zero_block(block, ALIGNMENT), 0);
+    EXPECT_EQ(is_zero_block(block, 100), -1);
+    for (int i = 0; i < 4096; i++) {
+        block[i] = 1;
+        EXPECT_EQ(is_zero_block(block, 4096), 1);
+        EXPECT_EQ(is_zero_block(block + i / ALIGNMENT * ALIGNMENT, ALIGNMENT), 1);
+        block[i] = 0;
+    }
+}
+
+TEST_F(FileTest2, commit_zero_blocks) {
+    reset_verify_file();
+    auto file = create_file_rw();
+    const size_t WRITE_LEN = 64 * 1024;
+    ALIGNED_MEM4K(data, WRITE_LEN);
+    // every other 4K block carries data, the rest are zero sectors
+    for (off_t offset = 0; offset < (off_t)vsize / 2; offset += WRITE_LEN) {
+        memset(data, 0, WRITE_LEN);
+        for (size_t i = 0; i < WRITE_LEN; i += 8192)
+            memset(data + i, rand() % 255 + 1, 4096);
+        EXPECT_EQ(file->pwrite(data, WRITE_LEN, offset), (ssize_t)WRITE_LEN);
+        fcheck->pwrite(data, WRITE_LEN, offset);
+    }
+    auto fn_c0 = "commit0";
+    auto fcommit0 = lfs->open(fn_c0, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args0(fcommit0);
+    EXPECT_EQ(file->commit(args0), 0);
+    delete file;
+    struct stat st;
+    fcommit0->fstat(&st);
+    EXPECT_LT((uint64_t)st.st_size, vsize / 4 + (1 << 20));
+    delete fcommit0;
+    DEFER(lfs->unlink(fn_c0));
+
+    auto fro = open_file_ro(fn_c0);
+    auto p = fro->index()->buffer();
+    size_t nzeroed = 0;
+    for (size_t i = 0; i < fro->index()->size(); i++) {
+        nzeroed += p[i].zeroed;
+    }
+    EXPECT_GT(nzeroed, 0UL);
+    verify_file(fro);
+    delete fro;
+}
+
 TEST_F(FileTest2, commit_zfile) {
     reset_verify_file();
 
@@ -628,6 +851,160 @@ TEST_F(FileTest3, stack_files) {
     delete merged;
 }
 
+TEST_F(FileTest3, mmap_index) {
+    CleanUp();
+    int fds[255];
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+        auto path = string("/tmp/") + layer_name.back();
+        fds[i] = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        ASSERT_GE(fds[i], 0);
+    }
+    auto loaded = open_files_ro(files, FLAGS_layers);
+    auto mapped = open_files_ro(files, FLAGS_layers, false, fds);
+    ASSERT_NE(mapped, nullptr);
+    // the mappings stay valid after the fds are closed
+    for (int i = 0; i < FLAGS_layers; ++i)
+        ::close(fds[i]);
+    auto idx0 = loaded->index(), idx1 = mapped->index();
+    ASSERT_EQ(idx0->size(), idx1->size());
+    for (size_t i = 0; i < idx0->size(); ++i) {
+        auto &a = idx0->buffer()[i], &b = idx1->buffer()[i];
+        EXPECT_EQ((uint64_t)a.offset, (uint64_t)b.offset);
+        EXPECT_EQ((uint64_t)a.length, (uint64_t)b.length);
+        EXPECT_EQ((uint64_t)a.moffset, (uint64_t)b.moffset);
+        EXPECT_EQ((uint64_t)a.tag, (uint64_t)b.tag);
+    }
+    verify_file(mapped);
+    delete mapped;
+
+    // a single layer is used as-is, with tags going through the table
+    fds[0] = ::open((string("/tmp/") + layer_name[0]).c_str(), O_RDONLY | O_CLOEXEC);
+    auto single = open_files_ro(files, 1, false, fds);
+    ::close(fds[0]);
+    ASSERT_NE(single, nullptr);
+    auto single_loaded = open_files_ro(files, 1);
+    EXPECT_EQ(single->index()->size(), single_loaded->index()->size());
+    char b0[4096], b1[4096];
+    for (int i = 0; i < 256; ++i) {
+        off_t off = (rand() % (vsize / 4096)) * 4096;
+        EXPECT_EQ(single->pread(b0, 4096, off), 4096);
+        EXPECT_EQ(single_loaded->pread(b1, 4096, off), 4096);
+        EXPECT_EQ(memcmp(b0, b1, 4096), 0);
+    }
+    delete single;
+
+    // an fd of some other file is rejected, falling back to loading the index
+    int fd = ::open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    auto fallback = open_files_ro(files, 1, false, &fd);
+    ::close(fd);
+    ASSERT_NE(fallback, nullptr);
+    EXPECT_EQ(fallback->index()->size(), single_loaded->index()->size());
+    delete fallback;
+    delete single_loaded;
+    delete loaded;
+}
+
+TEST_F(FileTest3, shared_layer_index) {
+    CleanUp();
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    // share the indexes of all layers but the top one
+    LayerIndex *shared[255]{};
+    for (int i = 0; i < FLAGS_layers - 1; ++i) {
+        shared[i] = load_layer_index(files[i]);
+        ASSERT_NE(shared[i], nullptr);
+        UUID uu;
+        auto lower = open_file_ro(files[i]);
+        lower->get_uuid(uu);
+        EXPECT_EQ(uu, shared[i]->uuid);
+        EXPECT_EQ(lower->index()->size(), shared[i]->index->size());
+        delete lower;
+    }
+    auto loaded = open_files_ro(files, FLAGS_layers);
+    for (int k = 0; k < 2; ++k) {
+        auto lower = open_files_ro(files, FLAGS_layers, false, nullptr, shared);
+        ASSERT_NE(lower, nullptr);
+        ASSERT_EQ(lower->index()->size(), loaded->index()->size());
+        EXPECT_EQ(memcmp(lower->index()->buffer(), loaded->index()->buffer(),
+                         loaded->index()->size() * sizeof(SegmentMapping)), 0);
+        for (int i = 0; i < FLAGS_layers; ++i) {
+            UUID u0, u1;
+            loaded->get_uuid(u0, i);
+            lower->get_uuid(u1, i);
+            EXPECT_EQ(u0, u1);
+        }
+        verify_file(lower);
+        delete lower;
+    }
+    for (int i = 0; i < FLAGS_layers - 1; ++i)
+        delete shared[i];
+    delete loaded;
+}
+
+TEST_F(FileTest3, parallel_compact) {
+    CleanUp();
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    auto lower = open_files_ro(files, FLAGS_layers);
+    verify_file(lower);
+    auto fn_serial = "merged.serial";
+    auto fn_parallel = "merged.parallel";
+    auto serial = lfs->open(fn_serial, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    EXPECT_EQ(lower->flatten(serial), 0);
+    auto parallel = lfs->open(fn_parallel, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args(parallel);
+    args.compact_block_size = 100;
+    EXPECT_EQ(lower->flatten(args), -1);
+    parallel->ftruncate(0);
+    parallel->lseek(0, SEEK_SET);
+    args.compact_block_size = 4096;
+    args.compact_concurrency = 8;
+    EXPECT_EQ(lower->flatten(args), 0);
+    DEFER(lfs->unlink(fn_serial));
+    DEFER(lfs->unlink(fn_parallel));
+
+    // both layers keep the same amount of data
+    auto fserial = ::open_file_ro(serial, true);
+    auto fparallel = ::open_file_ro(parallel, true);
+    ASSERT_NE(fserial, nullptr);
+    ASSERT_NE(fparallel, nullptr);
+    auto data_blocks = [](IFileRO *file) {
+        uint64_t n = 0;
+        auto p = file->index()->buffer();
+        for (size_t i = 0; i < file->index()->size(); i++) {
+            n += p[i].length * (!p[i].zeroed);
+        }
+        return n;
+    };
+    EXPECT_EQ(data_blocks(fserial), data_blocks(fparallel));
+    verify_file(fparallel);
+    delete fserial;
+    delete fparallel;
+
+    // compact into a multi-processor zfile builder
+    auto fn_zfile = "merged.zfile";
+    auto fzfile = lfs->open(fn_zfile, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    DEFER(lfs->unlink(fn_zfile));
+    ZFile::CompressOptions opt;
+    opt.verify = 1;
+    ZFile::CompressArgs zfile_args(opt);
+    zfile_args.workers = 4;
+    auto builder = ZFile::new_zfile_builder(fzfile, &zfile_args, false);
+    CommitArgs zargs(builder);
+    zargs.compact_concurrency = 4;
+    EXPECT_EQ(lower->flatten(zargs), 0);
+    builder->close();
+    delete builder;
+    auto zfile = ZFile::zfile_open_ro(fzfile, true, true);
+    auto fro = ::open_file_ro(zfile, true);
+    verify_file(fro);
+    delete fro;
+    delete lower;
+}
+
 TEST_F(FileTest3, seek_data) {
     CleanUp();
     cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
@@ -798,6 +1175,27 @@ TEST_F(FileTest3, photon_verify) {
         thread_join((photon::join_handle *)thd);
 }
 
+TEST_F(FileTest3, parallel_pread) {
+    CleanUp();
+    cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    auto lower = open_files_ro(files, FLAGS_layers);
+    EXPECT_EQ(lower->get_max_io_concurrency(), 1);
+    EXPECT_EQ(lower->set_max_io_concurrency(0), -1); // invalid
+    EXPECT_EQ(lower->set_max_io_concurrency(8), 0);
+    EXPECT_EQ(lower->get_max_io_concurrency(), 8);
+    cout << "verifying stacked RO layers file with concurrent segment reads" << endl;
+    verify_file(lower);
+    cout << "generating a RW layer by randwrite()" << endl;
+    auto upper = create_file_rw();
+    unique_ptr<IFileRW> file(stack_files(upper, lower, 0, true));
+    file->set_max_io_concurrency(8);
+    randwrite(file.get(), FLAGS_nwrites);
+    verify_file(file.get());
+}
+
 void WarpFileTest::randwrite_warpfile(IFile *file, size_t nwrites) {
     LOG_INFO("start randwrite ` times", nwrites);
     ALIGNED_MEM4K(buf, 1 << 20)
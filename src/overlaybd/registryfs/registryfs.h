@@ -15,6 +15,7 @@
 */
 
 #pragma once
+#include <errno.h>
 #include <stdint.h>
 #include <string>
 #include <photon/common/callback.h>
@@ -23,8 +24,58 @@
 class RegistryFS : public photon::fs::IFileSystem {
 public:
     virtual int setAccelerateAddress(const char* addr = "") = 0;
+
+    // Ranges of a batched read no more than `gap` bytes apart are fetched as one range, and
+    // the rest in a single multipart/byteranges request if `multipart` is enabled, falling back
+    // to a request per range when the backend doesn't support it.
+    virtual int setRangeOptions(size_t gap, bool multipart) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Data requests are served by keep-alive clients pooled by host, with at most `max_per_host`
+    // connections to a host at a time, instead of the single shared client if it's not 0.
+    virtual int setConnectionPool(uint32_t max_per_host) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Gets the numbers of data requests served by a pooled connection, and of the connections
+    // opened, each of which takes a handshake.
+    virtual int getConnectionStats(uint64_t *pool_hits, uint64_t *handshakes) {
+        errno = ENOSYS;
+        return -1;
+    }
+};
+
+// A range of a batched read. On return, `count` is the number of bytes read, which is less than
+// requested only at the end of file.
+struct RegistryRange {
+    void *buf;
+    size_t count;
+    off_t offset;
 };
 
+// IFile::ioctl() request of registry files, reading several ranges at once,
+// with arguments of (RegistryRange *ranges, int n). Files without batched reads
+// fail it with ENOSYS, even if `n` is 0, which probes for the support.
+const int REGISTRY_PREAD_RANGES = 0x52460001;
+
+// reads `n` ranges of `file`, in a batch if it's a registry file, returns 0 on success
+inline int registry_pread_ranges(photon::fs::IFile *file, RegistryRange *ranges, int n) {
+    if (file->ioctl(REGISTRY_PREAD_RANGES, ranges, n) == 0)
+        return 0;
+    if (errno != ENOSYS)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        auto ret = file->pread(ranges[i].buf, ranges[i].count, ranges[i].offset);
+        if (ret < 0)
+            return -1;
+        ranges[i].count = ret;
+    }
+    return 0;
+}
+
 using PasswordCB = Delegate<std::pair<std::string, std::string>, const char *>;
 
 extern "C" {
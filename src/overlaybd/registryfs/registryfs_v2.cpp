@@ -22,11 +22,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <photon/photon.h>
+#include <photon/thread/thread.h>
 #include <photon/common/utility.h>
 #include <photon/common/timeout.h>
 #include <photon/common/iovector.h>
@@ -95,6 +99,117 @@ enum class AuthType {
     Bearer
 };
 
+// Keep-alive HTTP clients of data requests, pooled by host. A client serves a request at a time,
+// so the next request to the host reuses its connection instead of handshaking again, and there
+// are at most `max_per_host` connections to a host. Requests beyond wait for an idle client.
+class ClientPool {
+public:
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+        ~Lease() {
+            if (m_pool)
+                m_pool->put(m_host, m_client, m_reuse);
+        }
+        Client *client() const {
+            return m_client;
+        }
+        // the connection is broken, so the client is not pooled again
+        void drop() {
+            m_reuse = false;
+        }
+
+    private:
+        friend class ClientPool;
+        ClientPool *m_pool = nullptr;
+        Client *m_client = nullptr;
+        std::string m_host;
+        bool m_reuse = true;
+    };
+
+    ClientPool(photon::net::TLSContext *ctx, const estring &ua, uint32_t max_per_host)
+        : m_tls_ctx(ctx), m_useragent(ua), m_max_per_host(max_per_host) {
+    }
+
+    ~ClientPool() {
+        for (auto &h : m_hosts) {
+            for (auto c : h.second.idle)
+                delete c;
+        }
+    }
+
+    // leases a client for the host of `url`, returns -1 if timed out
+    int get(const estring &url, uint64_t timeout, Lease &lease) {
+        auto host = host_of(url);
+        Timeout tmo(timeout);
+        photon::scoped_lock lock(m_mutex);
+        auto &h = m_hosts[host];
+        while (h.idle.empty() && h.in_use >= m_max_per_host) {
+            if (h.cond.wait(lock, tmo.timeout()) < 0)
+                LOG_ERRNO_RETURN(0, -1, "no idle connection to `", host);
+        }
+        if (!h.idle.empty()) {
+            lease.m_client = h.idle.back();
+            h.idle.pop_back();
+            m_hits++;
+        } else {
+            lease.m_client = new_http_client(nullptr, m_tls_ctx);
+            lease.m_client->set_user_agent(m_useragent);
+            m_handshakes++;
+        }
+        h.in_use++;
+        lease.m_pool = this;
+        lease.m_host = std::move(host);
+        return 0;
+    }
+
+    uint64_t hits() const {
+        return m_hits.load(std::memory_order_relaxed);
+    }
+
+    uint64_t handshakes() const {
+        return m_handshakes.load(std::memory_order_relaxed);
+    }
+
+protected:
+    struct Host {
+        std::vector<Client *> idle;
+        uint32_t in_use = 0;
+        photon::condition_variable cond;
+    };
+    // leases are taken from multiple vcpus, so the hosts are guarded by `m_mutex`;
+    // references to the elements stay valid as the map grows
+    photon::mutex m_mutex;
+    std::unordered_map<std::string, Host> m_hosts;
+    photon::net::TLSContext *m_tls_ctx;
+    estring m_useragent;
+    uint32_t m_max_per_host;
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_handshakes{0};
+
+    static std::string host_of(estring_view url) {
+        auto pos = url.find("://");
+        if (pos != url.npos)
+            url = url.substr(pos + 3);
+        return std::string(url.substr(0, url.find('/')));
+    }
+
+    void put(const std::string &host, Client *client, bool reuse) {
+        {
+            photon::scoped_lock lock(m_mutex);
+            auto &h = m_hosts[host];
+            h.in_use--;
+            if (reuse)
+                h.idle.push_back(client);
+            h.cond.notify_one();
+        }
+        if (!reuse)
+            delete client;
+    }
+};
+
 class RegistryFSImpl_v2 : public RegistryFS {
 public:
     UNIMPLEMENTED_POINTER(IFile *creat(const char *, mode_t) override);
@@ -142,11 +257,20 @@ public:
     }
 
     ~RegistryFSImpl_v2() {
+        delete m_pool;
         if (m_client) delete m_client;
         if (m_tls_ctx) delete m_tls_ctx;
     }
 
-    long get_data(const estring &url, off_t offset, size_t count, uint64_t timeout, HTTP_OP &op) {
+    // `lease` holds the pooled client of `op`, so it must outlive `op`
+    long get_data(const estring &url, off_t offset, size_t count, uint64_t timeout, HTTP_OP &op,
+                  ClientPool::Lease &lease) {
+        return get_data(url, {{offset, count}}, timeout, op, lease);
+    }
+
+    // More than one range of (offset, count) expects a multipart/byteranges response
+    long get_data(const estring &url, const std::vector<std::pair<off_t, size_t>> &ranges,
+                  uint64_t timeout, HTTP_OP &op, ClientPool::Lease &lease) {
         Timeout tmo(timeout);
         long ret = 0;
         UrlInfo *actual_info = m_url_info.acquire(url, [&]() -> UrlInfo * {
@@ -172,12 +296,32 @@ public:
         if (actual_info->mode == UrlMode::Self && !actual_info->info.empty()) {
             op.req.headers.insert(kAuthHeaderKey, actual_info->info);
         }
-        op.req.headers.range(offset, offset + count - 1);
-        op.set_enable_proxy(m_client->has_proxy());
+        if (ranges.size() == 1) {
+            op.req.headers.range(ranges[0].first, ranges[0].first + ranges[0].second - 1);
+        } else {
+            std::string value = "bytes=";
+            for (auto &r : ranges) {
+                if (&r != &ranges[0])
+                    value += ",";
+                value += std::to_string(r.first) + "-" + std::to_string(r.first + r.second - 1);
+            }
+            op.req.headers.insert("Range", value);
+        }
+        auto client = m_client;
+        if (m_pool) {
+            if (m_pool->get(*actual_url, tmo.timeout(), lease) < 0) {
+                m_url_info.release(url);
+                return -1;
+            }
+            client = lease.client();
+        }
+        op.set_enable_proxy(client->has_proxy());
         op.retry = 0;
         op.timeout = tmo.timeout();
-        m_client->call(&op);
+        client->call(&op);
         ret = op.status_code;
+        if (ret < 0)
+            lease.drop();
         if (ret == 200 || ret == 206) {
             m_url_info.release(url);
             return ret;
@@ -285,6 +429,39 @@ public:
         return 0;
     }
 
+    virtual int setRangeOptions(size_t gap, bool multipart) override {
+        m_range_gap = gap;
+        m_multipart = multipart;
+        return 0;
+    }
+
+    virtual int setConnectionPool(uint32_t max_per_host) override {
+        delete m_pool;
+        m_pool = max_per_host ? new ClientPool(m_tls_ctx, m_useragent, max_per_host) : nullptr;
+        return 0;
+    }
+
+    virtual int getConnectionStats(uint64_t *pool_hits, uint64_t *handshakes) override {
+        *pool_hits = m_pool ? m_pool->hits() : 0;
+        *handshakes = m_pool ? m_pool->handshakes() : 0;
+        return 0;
+    }
+
+    size_t range_gap() const {
+        return m_range_gap;
+    }
+
+    bool multipart_enabled() const {
+        return m_multipart;
+    }
+
+    void disable_multipart(const estring &url) {
+        if (m_multipart) {
+            LOG_WARN("multipart/byteranges is not supported by the backend of `, disabled", url);
+            m_multipart = false;
+        }
+    }
+
     photon::net::http::Client* get_client() {
         return m_client;
     }
@@ -323,9 +500,12 @@ protected:
     uint64_t m_timeout;
     photon::net::TLSContext *m_tls_ctx;
     photon::net::http::Client *m_client;
+    ClientPool *m_pool = nullptr;
     ObjectCache<estring, size_t *> m_meta_size;
     ObjectCache<estring, estring *> m_scope_token;
     ObjectCache<estring, UrlInfo *> m_url_info;
+    size_t m_range_gap = 64 * 1024;
+    bool m_multipart = true;
 
     AuthType get_scope_auth(const estring &url, estring *authurl, estring *scope, uint64_t timeout,
                        bool push = false) {
@@ -464,8 +644,9 @@ public:
             count = filesize - offset;
         LOG_DEBUG("pulling blob from registry: ", VALUE(m_url), VALUE(offset), VALUE(count));
 
+        ClientPool::Lease lease;
         HTTP_OP op;
-        auto code = m_fs->get_data(m_url, offset, count, tmo.timeout(), op);
+        auto code = m_fs->get_data(m_url, offset, count, tmo.timeout(), op, lease);
         if (code != 200 && code != 206) {
             ERRNO eno;
             if (tmo.expire() < photon::now) {
@@ -484,12 +665,187 @@ public:
         return op.resp.readv(iov, iovcnt);
     }
 
+    int vioctl(int request, va_list args) override {
+        if (request == REGISTRY_PREAD_RANGES) {
+            auto ranges = va_arg(args, RegistryRange *);
+            auto n = va_arg(args, int);
+            return pread_ranges(ranges, n);
+        }
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // ranges fetched as one, [begin, end) of the sorted ranges
+    struct Segment {
+        off_t offset;
+        size_t count;
+        size_t begin, end;
+    };
+
+    int pread_ranges(RegistryRange *ranges, int n) {
+        if (m_filesize == 0) {
+            struct stat stat;
+            if (fstat(&stat) < 0)
+                return -1;
+            m_filesize = stat.st_size;
+        }
+        std::vector<RegistryRange *> sorted;
+        for (int i = 0; i < n; i++) {
+            auto &r = ranges[i];
+            if (r.offset < 0)
+                LOG_ERRNO_RETURN(EINVAL, -1, "invalid range offset ", VALUE(r.offset));
+            r.count = (size_t)r.offset >= m_filesize ? 0 : std::min(r.count, m_filesize - r.offset);
+            if (r.count)
+                sorted.push_back(&r);
+        }
+        std::sort(sorted.begin(), sorted.end(),
+                  [](RegistryRange *a, RegistryRange *b) { return a->offset < b->offset; });
+
+        std::vector<Segment> segs;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            auto r = sorted[i];
+            if (!segs.empty() &&
+                r->offset <= segs.back().offset + (off_t)(segs.back().count + m_fs->range_gap())) {
+                auto &seg = segs.back();
+                seg.count = std::max(seg.count, r->offset + r->count - seg.offset);
+                seg.end = i + 1;
+            } else {
+                segs.push_back({r->offset, r->count, i, i + 1});
+            }
+        }
+
+        if (segs.size() > 1 && m_fs->multipart_enabled() && pread_multipart(segs, sorted) == 0)
+            return 0;
+        if (segs.size() == 1)
+            return pread_segment(segs[0], sorted);
+        // fetch the segments concurrently, as separate reads of them would be
+        int failed = 0;
+        std::vector<photon::join_handle *> jhs;
+        for (auto &seg : segs) {
+            jhs.push_back(photon::thread_enable_join(photon::thread_create11(
+                &RegistryFileImpl_v2::pread_segment_of, this, &seg, &sorted, &failed)));
+        }
+        for (auto jh : jhs)
+            photon::thread_join(jh);
+        return failed ? -1 : 0;
+    }
+
+    void pread_segment_of(const Segment *seg, std::vector<RegistryRange *> *sorted, int *failed) {
+        if (pread_segment(*seg, *sorted) != 0)
+            (*failed)++;
+    }
+
+    static void copy_to_ranges(const char *data, off_t offset, size_t count,
+                               RegistryRange **begin, RegistryRange **end) {
+        for (auto it = begin; it != end; it++) {
+            auto r = *it;
+            auto lo = std::max(r->offset, offset);
+            auto hi = std::min(r->offset + r->count, offset + count);
+            if (lo < hi)
+                memcpy((char *)r->buf + (lo - r->offset), data + (lo - offset), hi - lo);
+        }
+    }
+
+    int pread_segment(const Segment &seg, std::vector<RegistryRange *> &sorted) {
+        auto r = sorted[seg.begin];
+        if (seg.end - seg.begin == 1)
+            return pread(r->buf, r->count, r->offset) == (ssize_t)r->count ? 0 : -1;
+        std::unique_ptr<char[]> buf(new char[seg.count]);
+        if (pread(buf.get(), seg.count, seg.offset) != (ssize_t)seg.count)
+            return -1;
+        copy_to_ranges(buf.get(), seg.offset, seg.count, &sorted[seg.begin], &sorted[seg.end]);
+        return 0;
+    }
+
+    int pread_multipart(const std::vector<Segment> &segs, std::vector<RegistryRange *> &sorted) {
+        std::vector<std::pair<off_t, size_t>> rs;
+        for (auto &seg : segs)
+            rs.emplace_back(seg.offset, seg.count);
+        LOG_DEBUG("pulling ` ranges of blob from registry: ", rs.size(), VALUE(m_url));
+
+        ClientPool::Lease lease;
+        HTTP_OP op;
+        auto code = m_fs->get_data(m_url, rs, m_timeout, op, lease);
+        if (code == 200) {
+            // ranges ignored by the backend, leaving the body unread
+            m_fs->disable_multipart(m_url);
+            return -1;
+        }
+        if (code != 206)
+            return -1;
+        estring_view ctype = op.resp.headers["Content-Type"];
+        auto pos = ctype.find("boundary=");
+        if (!ctype.starts_with("multipart/byteranges") || pos == ctype.npos) {
+            m_fs->disable_multipart(m_url);
+            return -1;
+        }
+        auto boundary = ctype.substr(pos + 9);
+        boundary = boundary.substr(0, boundary.find(';')).trim('\"');
+        auto delim = estring().appends("--", boundary);
+
+        std::string body;
+        size_t len = op.resp.headers.content_length();
+        body.resize(len ? len : 64 * 1024);
+        size_t n = 0;
+        for (;;) {
+            if (n == body.size()) {
+                if (len)
+                    break;
+                body.resize(n * 2);
+            }
+            auto ret = op.resp.read(&body[n], body.size() - n);
+            if (ret < 0)
+                LOG_ERRNO_RETURN(0, -1, "failed to read multipart body ", VALUE(m_url));
+            if (ret == 0)
+                break;
+            n += ret;
+        }
+        body.resize(n);
+
+        std::vector<bool> received(segs.size());
+        auto view = estring_view(body);
+        for (pos = view.find(delim.data(), 0, delim.size()); pos != view.npos;
+             pos = view.find(delim.data(), pos, delim.size())) {
+            pos += delim.size();
+            if (view.substr(pos, 2) == "--")
+                break;
+            auto data = view.find("\r\n\r\n", pos);
+            if (data == view.npos)
+                break;
+            estring headers(view.substr(pos, data - pos));
+            data += 4;
+            for (auto &c : headers)
+                c = tolower(c);
+            auto cr = headers.find("content-range:");
+            unsigned long long first, last;
+            if (cr == headers.npos ||
+                sscanf(headers.c_str() + cr + 14, " bytes %llu-%llu", &first, &last) != 2 ||
+                last < first || data + (last - first + 1) > view.size())
+                LOG_ERROR_RETURN(EIO, -1, "invalid part of multipart body ", VALUE(m_url));
+            size_t count = last - first + 1;
+            copy_to_ranges(view.data() + data, first, count, &sorted[0],
+                           &sorted[0] + sorted.size());
+            for (size_t i = 0; i < segs.size(); i++) {
+                if ((off_t)first <= segs[i].offset &&
+                    segs[i].offset + segs[i].count <= first + count)
+                    received[i] = true;
+            }
+            pos = data + count;
+        }
+        for (auto x : received) {
+            if (!x)
+                LOG_ERROR_RETURN(EIO, -1, "incomplete multipart body ", VALUE(m_url));
+        }
+        return 0;
+    }
+
     int64_t get_length(uint64_t timeout = -1) {
         Timeout tmo(timeout);
         int retry = 3;
     again:
+        ClientPool::Lease lease;
         HTTP_OP op;
-        auto code = m_fs->get_data(m_url, 0, 1, tmo.timeout(), op);
+        auto code = m_fs->get_data(m_url, 0, 1, tmo.timeout(), op, lease);
         if (code != 200 && code != 206) {
             if (tmo.expire() < photon::now)
                 LOG_ERROR_RETURN(ETIMEDOUT, -1, "get meta timedout");
@@ -195,6 +195,89 @@ TEST_F(ZFileTest, verify_compression) {
     }
 }
 
+TEST_F(ZFileTest, block_cache) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    auto src = lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    unique_ptr<IFile> fsrc(src);
+    if (!fsrc) {
+        LOG_ERROR("err: `(`)", errno, strerror(errno));
+    }
+    randwrite(fsrc.get(), write_times);
+    auto dst = lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    unique_ptr<IFile> fdst(dst);
+    CompressOptions opt;
+    opt.verify = 1;
+    opt.block_size = 4096;
+    CompressArgs args(opt);
+    fsrc->lseek(0, SEEK_SET);
+    EXPECT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+    unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), true));
+    uint64_t hit = 0, miss = 0;
+    EXPECT_EQ(zfile_get_block_cache_stat(fzfile.get(), &hit, &miss), -1);
+    EXPECT_EQ(zfile_set_block_cache(fzfile.get(), 1024, 4), -1);
+    EXPECT_EQ(zfile_set_block_cache(fzfile.get(), 1 << 20, 0), -1);
+    EXPECT_EQ(zfile_set_block_cache(fsrc.get(), 1 << 20), -1);
+    // 256 blocks, smaller than the file so that eviction happens
+    EXPECT_EQ(zfile_set_block_cache(fzfile.get(), 1 << 20, 4), 0);
+    seqread(fsrc.get(), fzfile.get());
+    randread(fsrc.get(), fzfile.get());
+    EXPECT_EQ(zfile_get_block_cache_stat(fzfile.get(), &hit, &miss), 0);
+    EXPECT_GT(miss, 0UL);
+    auto prev_hit = hit;
+    char data0[16384]{}, data1[16384]{};
+    fsrc->pread(data0, sizeof(data0), 4096 + 100);
+    fzfile->pread(data1, sizeof(data1), 4096 + 100);
+    fzfile->pread(data1, sizeof(data1), 4096 + 100);
+    EXPECT_EQ(memcmp(data0, data1, sizeof(data0)), 0);
+    EXPECT_EQ(zfile_get_block_cache_stat(fzfile.get(), &hit, &miss), 0);
+    EXPECT_GE(hit, prev_hit + 5);
+    EXPECT_EQ(zfile_set_block_cache(fzfile.get(), 0), 0);
+    EXPECT_EQ(zfile_get_block_cache_stat(fzfile.get(), &hit, &miss), -1);
+    seqread(fsrc.get(), fzfile.get());
+}
+
+TEST_F(ZFileTest, parallel_decompress) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    auto src = lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    unique_ptr<IFile> fsrc(src);
+    if (!fsrc) {
+        LOG_ERROR("err: `(`)", errno, strerror(errno));
+    }
+    randwrite(fsrc.get(), write_times);
+    struct stat _st;
+    if (fsrc->fstat(&_st) != 0) {
+        LOG_ERROR("err: `(`)", errno, strerror(errno));
+        return;
+    }
+    EXPECT_EQ(zfile_set_decompress_workers(-1), -1);
+    EXPECT_EQ(zfile_set_decompress_workers(4), 0);
+    DEFER(zfile_set_decompress_workers(0));
+    auto size = _st.st_size;
+    size_t len = 1024 * 1024 + 12345;
+    unique_ptr<char[]> data0(new char[len]), data1(new char[len]);
+    for (auto algorithm = 1; algorithm <= 2; algorithm++) {
+        auto dst = lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        unique_ptr<IFile> fdst(dst);
+        CompressOptions opt;
+        opt.algo = algorithm;
+        opt.verify = 1;
+        opt.block_size = 4096;
+        CompressArgs args(opt);
+        fsrc->lseek(0, SEEK_SET);
+        EXPECT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+        unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), true));
+        seqread(fsrc.get(), fzfile.get());
+        for (int i = 0; i < 100; i++) {
+            auto offset = rand() % (size - len);
+            fsrc->pread(data0.get(), len, offset);
+            EXPECT_EQ(fzfile->pread(data1.get(), len, offset), (ssize_t)len);
+            EXPECT_EQ(memcmp(data0.get(), data1.get(), len), 0);
+        }
+    }
+}
+
 TEST_F(ZFileTest, validation_check) {
     // log_output_level = 1;
     auto fn_src = "verify.data";
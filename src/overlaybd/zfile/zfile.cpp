@@ -29,10 +29,13 @@
 #include <photon/fs/forwardfs.h>
 #include <photon/photon.h>
 #include <photon/thread/thread.h>
+#include <photon/thread/workerpool.h>
 #include "crc32/crc32c.h"
 #include "compressor.h"
 #include <atomic>
 #include <thread>
+#include <list>
+#include <unordered_map>
 #include "photon/thread/thread11.h"
 
 using namespace photon::fs;
@@ -52,9 +55,90 @@ const static uint8_t FLAG_VALID_FALSE = 0;
 const static uint8_t FLAG_VALID_TRUE = 1;
 const static uint8_t FLAG_VALID_CRC_CHECK = 2;
 
+// reads in this range are decompressed in parallel when decompress workers are set
+const static size_t PARALLEL_READ_MIN_SIZE = 128 * 1024;
+const static size_t PARALLEL_READ_MAX_SIZE = 16 * 1024 * 1024;
+
+static photon::WorkPool *g_decompress_pool = nullptr;
+static int g_decompress_workers = 0;
+
 inline uint32_t crc32c_salt(void *buf, size_t size) {
     return crc32::crc32c_extend(buf, size, NOI_WELL_KNOWN_PRIME);
 }
+// Cache of decompressed blocks keyed by block index. Blocks are spread over several
+// shards, each of which is an independent LRU guarded by its own lock, so that
+// concurrent readers rarely contend with each other.
+class BlockCache {
+public:
+    BlockCache(size_t capacity, uint32_t block_size, int nshards)
+        : m_block_size(block_size), m_shards(nshards) {
+        size_t nblocks = capacity / block_size;
+        for (auto &shard : m_shards) {
+            shard.capacity = std::max(nblocks / nshards, (size_t)1);
+        }
+    }
+
+    // copy `count` bytes starting at `offset` within block `idx` into `buf`,
+    // return false on cache miss.
+    bool get(size_t idx, void *buf, off_t offset, size_t count) {
+        auto &shard = m_shards[idx % m_shards.size()];
+        photon::scoped_lock lock(shard.mtx);
+        auto it = shard.map.find(idx);
+        if (it == shard.map.end()) {
+            m_miss++;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        memcpy(buf, it->second->data.get() + offset, count);
+        m_hit++;
+        return true;
+    }
+
+    // insert the decompressed content of block `idx`, evicting the least
+    // recently used block of the shard if it is full.
+    void put(size_t idx, const void *data) {
+        auto &shard = m_shards[idx % m_shards.size()];
+        photon::scoped_lock lock(shard.mtx);
+        if (shard.map.find(idx) != shard.map.end())
+            return;
+        std::unique_ptr<unsigned char[]> block;
+        if (shard.lru.size() >= shard.capacity) {
+            auto &victim = shard.lru.back();
+            shard.map.erase(victim.idx);
+            block = std::move(victim.data);
+            shard.lru.pop_back();
+        } else {
+            block.reset(new unsigned char[m_block_size]);
+        }
+        memcpy(block.get(), data, m_block_size);
+        shard.lru.push_front({idx, std::move(block)});
+        shard.map[idx] = shard.lru.begin();
+    }
+
+    uint64_t hit() const {
+        return m_hit.load(std::memory_order_relaxed);
+    }
+
+    uint64_t miss() const {
+        return m_miss.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry {
+        size_t idx;
+        std::unique_ptr<unsigned char[]> data;
+    };
+    struct Shard {
+        photon::mutex mtx;
+        size_t capacity = 1;
+        std::list<Entry> lru;
+        std::unordered_map<size_t, std::list<Entry>::iterator> map;
+    };
+    uint32_t m_block_size;
+    std::vector<Shard> m_shards;
+    std::atomic<uint64_t> m_hit{0}, m_miss{0};
+};
+
 /* ZFile Format:
     | Header (512B) | dict (optional) | compressed block 0 [checksum0] | compressed block 1
    [checksum1] | ... | compressed block N [checksumN] | jmp_table(index) | Trailer (512 B)|
@@ -243,12 +327,20 @@ public:
     HeaderTrailer m_ht;
     IFile *m_file = nullptr;
     std::unique_ptr<ICompressor> m_compressor;
+    std::unique_ptr<BlockCache> m_block_cache;
+    // idle compressor instances for parallel decompression, one per in-flight job
+    std::vector<std::unique_ptr<ICompressor>> m_decompressors;
+    photon::mutex m_decompressors_mtx;
     bool m_ownership = false;
     uint8_t valid = FLAG_VALID_TRUE;
 
     CompressionFile(IFile *file, bool ownership) : m_file(file), m_ownership(ownership){};
 
     ~CompressionFile() {
+        if (m_block_cache) {
+            LOG_INFO("block cache stat {hit: `, miss: `}", m_block_cache->hit(),
+                     m_block_cache->miss());
+        }
         if (m_ownership) {
             delete m_file;
         }
@@ -473,6 +565,28 @@ public:
             return 0;
         }
         ssize_t readn = 0; // final will equal to count
+        auto use_cache = (m_block_cache && buf != nullptr && valid != FLAG_VALID_CRC_CHECK);
+        if (use_cache) {
+            // serve the leading cached blocks without reading compressed data
+            readn = read_cached_blocks(buf, cnt, offset);
+            if (readn == cnt)
+                return readn;
+            buf = (unsigned char *)buf + readn;
+            offset += readn;
+            cnt -= readn;
+        }
+        if (g_decompress_pool && buf != nullptr && valid == FLAG_VALID_TRUE &&
+            (size_t)cnt >= PARALLEL_READ_MIN_SIZE && (size_t)cnt <= PARALLEL_READ_MAX_SIZE &&
+            m_compressor->nbatch() == 1) {
+            if (parallel_pread(buf, cnt, offset) == cnt) {
+                return readn + cnt;
+            }
+            // the serial path below reloads corrupted blocks and retries
+            LOG_WARN("parallel decompression failed, fall back to serial read {offset: `, count: `}",
+                     offset, cnt);
+        }
+        // the first block left has just missed the cache, don't look it up again
+        size_t missed_idx = offset / m_ht.opt.block_size;
         unsigned char raw[MAX_READ_SIZE];
         BlockReader br(this, offset, cnt);
         for (auto &block : br) {
@@ -481,6 +595,13 @@ public:
                 readn += block.cp_len;
                 continue;
             }
+            if (use_cache && block.m_reader->m_idx != missed_idx &&
+                m_block_cache->get(block.m_reader->m_idx, buf, block.cp_begin,
+                                                block.cp_len)) {
+                readn += block.cp_len;
+                buf = (unsigned char *)buf + block.cp_len;
+                continue;
+            }
             int retry = 3;
         again:
             if (m_ht.opt.verify) {
@@ -514,11 +635,16 @@ public:
             if (block.cp_len == m_ht.opt.block_size) {
                 dret = m_compressor->decompress(block.buffer(), block.compressed_size,
                                                 (unsigned char *)buf, m_ht.opt.block_size);
+                if (dret != -1 && use_cache)
+                    m_block_cache->put(block.m_reader->m_idx, buf);
             } else {
                 dret = m_compressor->decompress(block.buffer(), block.compressed_size, raw,
                                                 m_ht.opt.block_size);
-                if (dret != -1)
+                if (dret != -1) {
                     memcpy(buf, raw + block.cp_begin, block.cp_len);
+                    if (use_cache)
+                        m_block_cache->put(block.m_reader->m_idx, raw);
+                }
             }
             if (dret == -1) {
                 if (retry--) {
@@ -542,6 +668,158 @@ public:
         }
         return readn;
     }
+
+    struct decompress_job {
+        CompressionFile *zfile;
+        ICompressor *compressor;
+        const unsigned char *cbuf; // compressed data starting at block `cbuf_idx`
+        size_t cbuf_idx;
+        unsigned char *buf;
+        size_t count;
+        off_t offset;
+        int ret;
+        int eno;
+    };
+
+    // decompress the blocks covering [offset, offset + count) from the compressed data
+    // in `cbuf`. Runs on a worker of the decompress pool, so no I/O is allowed here.
+    int decompress_range(ICompressor *compressor, const unsigned char *cbuf, size_t cbuf_idx,
+                         unsigned char *buf, size_t count, off_t offset) {
+        auto bs = m_ht.opt.block_size;
+        auto cbuf_base = m_jump_table[cbuf_idx];
+        unsigned char raw[MAX_READ_SIZE];
+        while (count > 0) {
+            size_t idx = offset / bs;
+            size_t begin = offset % bs;
+            size_t len = std::min(bs - begin, count);
+            auto src = cbuf + (m_jump_table[idx] - cbuf_base);
+            size_t compressed_size = m_jump_table[idx + 1] - m_jump_table[idx];
+            if (m_ht.opt.verify) {
+                compressed_size -= sizeof(uint32_t);
+                if (crc32c_salt((void *)src, compressed_size) !=
+                    *(uint32_t *)(src + compressed_size)) {
+                    LOG_ERROR_RETURN(ECHECKSUM, -1, "checksum verification failed {block: `}",
+                                     idx);
+                }
+            }
+            if (len == bs) {
+                if (compressor->decompress(src, compressed_size, buf, bs) == -1)
+                    LOG_ERRNO_RETURN(0, -1, "decompression failed {block: `}", idx);
+            } else {
+                if (compressor->decompress(src, compressed_size, raw, bs) == -1)
+                    LOG_ERRNO_RETURN(0, -1, "decompression failed {block: `}", idx);
+                memcpy(buf, raw + begin, len);
+            }
+            buf += len;
+            offset += len;
+            count -= len;
+        }
+        return 0;
+    }
+
+    static void *do_decompress_job(void *arg) {
+        auto job = (decompress_job *)arg;
+        g_decompress_pool->call([job] {
+            job->ret = job->zfile->decompress_range(job->compressor, job->cbuf, job->cbuf_idx,
+                                                    job->buf, job->count, job->offset);
+            job->eno = errno;
+        });
+        return nullptr;
+    }
+
+    ICompressor *get_decompressor() {
+        photon::scoped_lock lock(m_decompressors_mtx);
+        if (m_decompressors.empty()) {
+            CompressArgs args(m_ht.opt);
+            return create_compressor(&args);
+        }
+        auto ret = m_decompressors.back().release();
+        m_decompressors.pop_back();
+        return ret;
+    }
+
+    void put_decompressor(ICompressor *compressor) {
+        photon::scoped_lock lock(m_decompressors_mtx);
+        m_decompressors.emplace_back(compressor);
+    }
+
+    // read the compressed data of the whole range with one I/O, then split its blocks
+    // into jobs decompressed concurrently by the decompress pool.
+    ssize_t parallel_pread(void *buf, size_t count, off_t offset) {
+        auto bs = m_ht.opt.block_size;
+        size_t begin_idx = offset / bs;
+        size_t end_idx = (offset + count - 1) / bs + 1;
+        auto cbuf_size = m_jump_table[end_idx] - m_jump_table[begin_idx];
+        std::unique_ptr<unsigned char[]> cbuf(new unsigned char[cbuf_size]);
+        auto readn = m_file->pread(cbuf.get(), cbuf_size, m_jump_table[begin_idx]);
+        if (readn != (ssize_t)cbuf_size) {
+            LOG_ERRNO_RETURN(0, -1, "read compressed blocks failed. (offset: `, len: `, ret: `)",
+                             m_jump_table[begin_idx], cbuf_size, readn);
+        }
+
+        auto nblocks = end_idx - begin_idx;
+        auto njobs = std::min((size_t)g_decompress_workers, nblocks);
+        auto blocks_per_job = (nblocks + njobs - 1) / njobs;
+        std::vector<decompress_job> jobs;
+        jobs.reserve(njobs);
+        off_t end = offset + count;
+        for (auto idx = begin_idx; idx < end_idx; idx += blocks_per_job) {
+            off_t job_begin = std::max((off_t)(idx * bs), offset);
+            off_t job_end = std::min((off_t)((idx + blocks_per_job) * bs), end);
+            auto compressor = get_decompressor();
+            if (compressor == nullptr) {
+                break;
+            }
+            jobs.push_back({this, compressor, cbuf.get(), begin_idx,
+                            (unsigned char *)buf + (job_begin - offset),
+                            (size_t)(job_end - job_begin), job_begin, -1, 0});
+        }
+        std::vector<photon::join_handle *> ths;
+        for (auto &job : jobs) {
+            auto th = photon::thread_create(&do_decompress_job, &job);
+            ths.push_back(photon::thread_enable_join(th));
+        }
+        for (auto th : ths) {
+            photon::thread_join(th);
+        }
+
+        int eno = 0;
+        size_t done = 0;
+        for (auto &job : jobs) {
+            put_decompressor(job.compressor);
+            if (job.ret != 0) {
+                eno = job.eno;
+            } else {
+                done += job.count;
+            }
+        }
+        if (done != count) {
+            LOG_ERRNO_RETURN(eno ? eno : EIO, -1, "parallel decompression failed");
+        }
+        if (m_block_cache) {
+            for (auto idx = begin_idx; idx < end_idx; idx++) {
+                off_t pos = idx * bs;
+                if (pos >= offset && pos + bs <= end)
+                    m_block_cache->put(idx, (unsigned char *)buf + (pos - offset));
+            }
+        }
+        return count;
+    }
+
+    // copy blocks from the block cache until the first miss, return bytes copied.
+    ssize_t read_cached_blocks(void *buf, size_t count, off_t offset) {
+        ssize_t readn = 0;
+        auto bs = m_ht.opt.block_size;
+        while ((size_t)readn < count) {
+            auto pos = offset + readn;
+            auto begin = pos % bs;
+            auto len = std::min((size_t)(bs - begin), count - readn);
+            if (!m_block_cache->get(pos / bs, (unsigned char *)buf + readn, begin, len))
+                break;
+            readn += len;
+        }
+        return readn;
+    }
 };
 
 static int write_header_trailer(IFile *file, bool is_header, bool is_sealed, bool is_data_file,
@@ -1084,6 +1362,57 @@ again:
     return zfile;
 }
 
+int zfile_set_block_cache(IFile *file, size_t capacity, int shards) {
+    auto zfile = dynamic_cast<CompressionFile *>(file);
+    if (zfile == nullptr) {
+        LOG_ERRNO_RETURN(EINVAL, -1, "not a zfile opened by zfile_open_ro");
+    }
+    if (shards <= 0) {
+        LOG_ERRNO_RETURN(EINVAL, -1, "invalid block cache shards: `", shards);
+    }
+    if (capacity == 0) {
+        zfile->m_block_cache.reset();
+        return 0;
+    }
+    auto block_size = zfile->m_ht.opt.block_size;
+    if (capacity < block_size) {
+        LOG_ERRNO_RETURN(EINVAL, -1, "block cache capacity ` < block size `", capacity,
+                         block_size);
+    }
+    zfile->m_block_cache.reset(new BlockCache(capacity, block_size, shards));
+    LOG_INFO("enable block cache {capacity: `, block_size: `, shards: `}", capacity, block_size,
+             shards);
+    return 0;
+}
+
+int zfile_set_decompress_workers(int n) {
+    if (n < 0) {
+        LOG_ERRNO_RETURN(EINVAL, -1, "invalid decompress workers: `", n);
+    }
+    delete g_decompress_pool;
+    g_decompress_pool = nullptr;
+    g_decompress_workers = 0;
+    if (n > 0) {
+        g_decompress_pool = new photon::WorkPool(n, photon::INIT_EVENT_DEFAULT,
+                                                 photon::INIT_IO_NONE);
+        g_decompress_workers = n;
+        LOG_INFO("zfile decompress workers: `", n);
+    }
+    return 0;
+}
+
+int zfile_get_block_cache_stat(IFile *file, uint64_t *hit, uint64_t *miss) {
+    auto zfile = dynamic_cast<CompressionFile *>(file);
+    if (zfile == nullptr || !zfile->m_block_cache) {
+        LOG_ERRNO_RETURN(EINVAL, -1, "block cache is not enabled");
+    }
+    if (hit)
+        *hit = zfile->m_block_cache->hit();
+    if (miss)
+        *miss = zfile->m_block_cache->miss();
+    return 0;
+}
+
 static int write_header_trailer(IFile *file, bool is_header, bool is_sealed, bool is_data_file,
                                 CompressionFile::HeaderTrailer *pht, off_t offset) {
 
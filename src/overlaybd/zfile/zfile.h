@@ -22,6 +22,17 @@ const static size_t MAX_READ_SIZE = 65536; // 64K
 extern "C" photon::fs::IFile *zfile_open_ro(photon::fs::IFile *file, bool verify = false,
                                             bool ownership = false);
 
+// enable a sharded LRU cache of decompressed blocks on a file returned by zfile_open_ro(),
+// `capacity` is in bytes and 0 disables the cache. Must be set before issuing I/O.
+extern "C" int zfile_set_block_cache(photon::fs::IFile *zfile, size_t capacity, int shards = 8);
+
+// get the hit / miss counters of the block cache, return -1 if it is not enabled.
+extern "C" int zfile_get_block_cache_stat(photon::fs::IFile *zfile, uint64_t *hit, uint64_t *miss);
+
+// set the number of worker threads shared by all zfiles to decompress the blocks of
+// large reads in parallel, 0 (the default) decompresses in the reading thread.
+extern "C" int zfile_set_decompress_workers(int n);
+
 extern "C" int zfile_compress(photon::fs::IFile *src_file, photon::fs::IFile *dst_file,
                               const CompressArgs *opt = nullptr);
 
@@ -36,7 +36,8 @@ using namespace photon::fs;
 
 
 // check if the `file` is zfile format
-static IFile *try_open_zfile(IFile *file, bool verify, const char *file_path) {
+static IFile *try_open_zfile(IFile *file, bool verify, const char *file_path,
+                             size_t block_cache_size) {
     auto is_zfile = ZFile::is_zfile(file);
     if (is_zfile == -1) {
         LOG_ERRNO_RETURN(0, nullptr, "check file type failed.");
@@ -47,6 +48,9 @@ static IFile *try_open_zfile(IFile *file, bool verify, const char *file_path) {
         if (!zf) {
             LOG_ERRNO_RETURN(0, nullptr, "zfile_open_ro failed, path: `", file_path);
         }
+        if (block_cache_size > 0 && ZFile::zfile_set_block_cache(zf, block_cache_size) != 0) {
+            LOG_WARN("failed to enable zfile block cache, path: `", file_path);
+        }
         LOG_INFO("open file as zfile format, path: `", file_path);
         return zf;
     }
@@ -59,8 +63,11 @@ public:
     IFile *m_file = nullptr;
     IFile *m_local_file = nullptr;
     std::string m_filepath;
+    size_t m_block_cache_size = 0;
 
-    SwitchFile(IFile *source, bool local = false, const char *filepath = nullptr) {
+    SwitchFile(IFile *source, bool local = false, const char *filepath = nullptr,
+               size_t block_cache_size = 0)
+        : m_block_cache_size(block_cache_size) {
         if (local)
             m_local_file = source;
         else m_file = source;
@@ -88,7 +95,7 @@ public:
             return;
         }
         file = tarfile;
-        auto zfile = try_open_zfile(file, false, m_filepath.c_str());
+        auto zfile = try_open_zfile(file, false, m_filepath.c_str(), m_block_cache_size);
         if (zfile == nullptr) {
             delete file;
             LOG_ERROR("failed to open commit file as zfile, path: `", m_filepath);
@@ -163,15 +170,16 @@ public:
     }
 };
 
-ISwitchFile *new_switch_file(IFile *source, bool local, const char *file_path) {
+ISwitchFile *new_switch_file(IFile *source, bool local, const char *file_path,
+                             size_t block_cache_size) {
     int retry = 1;
 again:
-    auto file = try_open_zfile(source, !local, file_path);
+    auto file = try_open_zfile(source, !local, file_path, block_cache_size);
     if (file == nullptr) {
         LOG_ERROR("failed to open source file as zfile, path: `, retry: `", file_path, retry);
         if (retry--) // may retry after cache evict
             goto again;
         return nullptr;
     }
-    return new SwitchFile(file, local, file_path);
+    return new SwitchFile(file, local, file_path, block_cache_size);
 };
@@ -23,6 +23,9 @@ public:
     virtual void set_switch_file(const char *filepath) = 0;
 };
 
+// `block_cache_size` is the capacity in bytes of the decompressed block cache enabled on
+// zfile, 0 means disabled.
 extern "C" ISwitchFile *new_switch_file(photon::fs::IFile *source, bool local = false,
-                                        const char *filepath = nullptr);
+                                        const char *filepath = nullptr,
+                                        size_t block_cache_size = 0);
 
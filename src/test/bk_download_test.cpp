@@ -0,0 +1,307 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/fs/forwardfs.h>
+#include <photon/fs/localfs.h>
+#include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
+#include "../bk_download.h"
+#include "../image_file.h"
+#include "../metrics_fs.h"
+#include "../switch_file.h"
+#include "../tools/sha256file.h"
+
+using namespace photon::fs;
+using namespace BKDL;
+
+static const std::string kRoot = "/tmp/overlaybd/bk_download_test/";
+static const size_t kBlock = 256 * 1024;
+// ends with a short block
+static const size_t kSize = 10 * kBlock + 1234;
+
+struct SourceStats {
+    size_t read_bytes = 0;
+    off_t slow_offset = -1; // delayed, so that the blocks after it are fetched first
+    off_t bad_offset = -1;  // always fails
+    bool started = false;
+    bool closed = false;
+};
+
+// a local blob standing for the registry
+class SourceFile : public ForwardFile_Ownership {
+public:
+    SourceStats *stats;
+    std::vector<SourceStats *> *started;
+
+    SourceFile(const std::string &blob, SourceStats *stats,
+               std::vector<SourceStats *> *started = nullptr)
+        : ForwardFile_Ownership(open_localfile_adaptor((kRoot + blob).c_str(), O_RDONLY), true),
+          stats(stats), started(started) {
+    }
+    ~SourceFile() {
+        stats->closed = true;
+    }
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        if (!stats->started) {
+            stats->started = true;
+            if (started)
+                started->push_back(stats);
+        }
+        if (offset == stats->slow_offset)
+            photon::thread_usleep(100 * 1000);
+        if (offset == stats->bad_offset) {
+            photon::thread_usleep(50 * 1000);
+            errno = EIO;
+            return -1;
+        }
+        auto ret = m_file->pread(buf, count, offset);
+        if (ret > 0)
+            stats->read_bytes += ret;
+        return ret;
+    }
+};
+
+// returns the digest of the new blob
+static std::string make_blob(const std::string &blob) {
+    std::vector<char> data(kSize);
+    for (auto &c : data)
+        c = rand();
+    auto file = open_localfile_adaptor((kRoot + blob).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    EXPECT_NE(nullptr, file);
+    EXPECT_EQ((ssize_t)kSize, file->pwrite(data.data(), kSize, 0));
+    delete file;
+    return sha256sum((kRoot + blob).c_str());
+}
+
+static std::string make_dir(const std::string &name) {
+    auto dir = kRoot + name;
+    system(("rm -rf " + dir + " && mkdir -p " + dir).c_str());
+    return dir;
+}
+
+static ISwitchFile *new_blob_switch_file(const std::string &blob) {
+    auto path = kRoot + blob;
+    return new_switch_file(open_localfile_adaptor(path.c_str(), O_RDONLY), false, path.c_str());
+}
+
+static BkDownload *new_task(ISwitchFile *sw, const std::string &blob, SourceStats *stats,
+                            const std::string &dir, const std::string &digest, int &running,
+                            const ImageFile *owner, int concurrency,
+                            std::vector<SourceStats *> *started = nullptr) {
+    return new BkDownload(sw, new SourceFile(blob, stats, started), kSize, dir, digest,
+                          kRoot + blob, running, owner, 0, 1, kBlock, concurrency);
+}
+
+static bool wait_downloaded(const std::string &dir) {
+    for (int i = 0; i < 1000 && !check_downloaded(dir); i++)
+        photon::thread_usleep(10 * 1000);
+    return check_downloaded(dir);
+}
+
+// owners are only compared, so any distinct addresses do
+static const ImageFile *owner_of(int &running) {
+    return reinterpret_cast<const ImageFile *>(&running);
+}
+
+TEST(BkDownload, hash_in_order) {
+    auto digest = make_blob("blob");
+    auto dir = make_dir("layer");
+    std::unique_ptr<ISwitchFile> sw(new_blob_switch_file("blob"));
+    int running = 1;
+    SourceStats stats;
+    // the first block completes last, so the others wait in the window to be hashed
+    stats.slow_offset = 0;
+    std::unique_ptr<BkDownload> dl(
+        new_task(sw.get(), "blob", &stats, dir, digest, running, nullptr, 4));
+    ASSERT_TRUE(dl->download());
+    EXPECT_EQ(digest, dl->get_streamed_digest());
+    EXPECT_EQ(kSize, stats.read_bytes);
+    EXPECT_TRUE(check_downloaded(dir));
+}
+
+TEST(BkDownload, resume) {
+    auto digest = make_blob("partial");
+    auto dir = make_dir("partial_layer");
+    // a .download file left with some of the blocks
+    std::vector<char> data(kSize);
+    auto blob = open_localfile_adaptor((kRoot + "partial").c_str(), O_RDONLY);
+    ASSERT_EQ((ssize_t)kSize, blob->pread(data.data(), kSize, 0));
+    delete blob;
+    auto part =
+        open_localfile_adaptor((dir + "/" + DOWNLOAD_TMP_NAME).c_str(), O_RDWR | O_CREAT, 0644);
+    ASSERT_EQ((ssize_t)(3 * kBlock), part->pwrite(data.data(), 3 * kBlock, 0));
+    ASSERT_EQ((ssize_t)kBlock, part->pwrite(&data[6 * kBlock], kBlock, 6 * kBlock));
+    ASSERT_EQ(0, part->ftruncate(kSize));
+    delete part;
+
+    std::unique_ptr<ISwitchFile> sw(new_blob_switch_file("partial"));
+    int running = 1;
+    SourceStats stats;
+    std::unique_ptr<BkDownload> dl(
+        new_task(sw.get(), "partial", &stats, dir, digest, running, nullptr, 3));
+    ASSERT_TRUE(dl->download());
+    // the blocks there are read back for hashing instead of fetched
+    EXPECT_EQ(digest, dl->get_streamed_digest());
+    EXPECT_EQ(kSize - 4 * kBlock, stats.read_bytes);
+}
+
+TEST(BkDownload, fail_with_pending_blocks) {
+    auto digest = make_blob("flaky");
+    auto dir = make_dir("flaky_layer");
+    std::unique_ptr<ISwitchFile> sw(new_blob_switch_file("flaky"));
+    int running = 1;
+    SourceStats stats;
+    // fails after the blocks behind it are fetched and pending
+    stats.bad_offset = 0;
+    std::unique_ptr<BkDownload> dl(
+        new_task(sw.get(), "flaky", &stats, dir, digest, running, nullptr, 4));
+    EXPECT_FALSE(dl->download());
+    EXPECT_FALSE(check_downloaded(dir));
+    auto fetched = stats.read_bytes;
+    EXPECT_GT(fetched, 0UL);
+    EXPECT_LT(fetched, kSize);
+
+    // the retry reuses the blocks fetched by the failed one
+    stats.bad_offset = -1;
+    stats.read_bytes = 0;
+    ASSERT_TRUE(dl->download());
+    EXPECT_EQ(digest, dl->get_streamed_digest());
+    EXPECT_EQ(kSize - fetched, stats.read_bytes);
+}
+
+TEST(DownloadScheduler, reuse_by_digest) {
+    auto digest = make_blob("shared");
+    auto dir_a = make_dir("shared_a"), dir_b = make_dir("shared_b");
+    std::unique_ptr<ISwitchFile> sw_a(new_blob_switch_file("shared"));
+    std::unique_ptr<ISwitchFile> sw_b(new_blob_switch_file("shared"));
+    int running_a = 1, running_b = 1;
+    SourceStats stats_a, stats_b;
+    DownloadScheduler scheduler(0, 0, nullptr);
+    std::list<BkDownload *> tasks = {
+        new_task(sw_a.get(), "shared", &stats_a, dir_a, digest, running_a, owner_of(running_a), 2),
+        new_task(sw_b.get(), "shared", &stats_b, dir_b, digest, running_b, owner_of(running_b), 2),
+    };
+    scheduler.submit(tasks, 0);
+    EXPECT_TRUE(tasks.empty());
+
+    ASSERT_TRUE(wait_downloaded(dir_a));
+    ASSERT_TRUE(wait_downloaded(dir_b));
+    // the second image links the layer downloaded by the first one
+    EXPECT_EQ(kSize, stats_a.read_bytes);
+    EXPECT_EQ(0UL, stats_b.read_bytes);
+    struct stat st;
+    ASSERT_EQ(0, ::stat((dir_b + "/" + COMMIT_FILE_NAME).c_str(), &st));
+    EXPECT_EQ(2UL, st.st_nlink);
+}
+
+TEST(DownloadScheduler, hottest_first) {
+    auto cold_digest = make_blob("cold");
+    auto hot_digest = make_blob("hot");
+    auto cold_dir = make_dir("cold_layer"), hot_dir = make_dir("hot_layer");
+    MetricMeta meta;
+    MetricFile cold_heat(open_localfile_adaptor((kRoot + "cold").c_str(), O_RDONLY), &meta);
+    MetricFile hot_heat(open_localfile_adaptor((kRoot + "hot").c_str(), O_RDONLY), &meta);
+    cold_heat.read_bytes = 4096;
+    hot_heat.read_bytes = 1024 * 1024;
+    std::unique_ptr<ISwitchFile> cold_sw(new_blob_switch_file("cold"));
+    std::unique_ptr<ISwitchFile> hot_sw(new_blob_switch_file("hot"));
+    int running = 1;
+    SourceStats cold_stats, hot_stats;
+    std::vector<SourceStats *> started;
+    DownloadScheduler scheduler(0, 0, nullptr);
+    auto cold = new_task(cold_sw.get(), "cold", &cold_stats, cold_dir, cold_digest, running,
+                         owner_of(running), 1, &started);
+    auto hot = new_task(hot_sw.get(), "hot", &hot_stats, hot_dir, hot_digest, running,
+                        owner_of(running), 1, &started);
+    cold->set_heat_source(&cold_heat);
+    hot->set_heat_source(&hot_heat);
+    EXPECT_EQ(4096UL, cold->heat());
+    std::list<BkDownload *> tasks = {cold, hot};
+    scheduler.submit(tasks, 0);
+
+    ASSERT_TRUE(wait_downloaded(cold_dir));
+    ASSERT_TRUE(wait_downloaded(hot_dir));
+    ASSERT_EQ(2UL, started.size());
+    EXPECT_EQ(&hot_stats, started[0]);
+    EXPECT_EQ(&cold_stats, started[1]);
+}
+
+static void feed_latency(MetricMeta *meta, bool *feeding) {
+    while (*feeding) {
+        SCOPE_LATENCY(meta->latency);
+        photon::thread_usleep(20 * 1000);
+    }
+}
+
+TEST(DownloadScheduler, pause_and_cancel) {
+    auto digest = make_blob("paused");
+    auto dir = make_dir("paused_layer"), queued_dir = make_dir("queued_layer");
+    std::unique_ptr<ISwitchFile> sw(new_blob_switch_file("paused"));
+    std::unique_ptr<ISwitchFile> queued_sw(new_blob_switch_file("paused"));
+    MetricMeta foreground;
+    bool feeding = true;
+    auto feeder =
+        photon::thread_enable_join(photon::thread_create11(&feed_latency, &foreground, &feeding));
+    DEFER({
+        feeding = false;
+        photon::thread_join(feeder);
+    });
+    photon::thread_usleep(50 * 1000);
+
+    int running = 1;
+    SourceStats stats, queued_stats;
+    DownloadScheduler scheduler(0, 1000, &foreground);
+    std::list<BkDownload *> tasks = {
+        new_task(sw.get(), "paused", &stats, dir, digest, running, owner_of(running), 2)};
+    scheduler.submit(tasks, 0);
+    tasks = {new_task(queued_sw.get(), "paused", &queued_stats, queued_dir, digest, running,
+                      owner_of(running), 2)};
+    scheduler.submit(tasks, 3600);
+
+    // foreground reads are slow, so the running download doesn't fetch anything
+    photon::thread_usleep(600 * 1000);
+    EXPECT_FALSE(stats.started);
+    EXPECT_FALSE(stats.closed);
+
+    // the running task exits before cancel() returns, and the queued one is dropped
+    running = -1;
+    scheduler.cancel(owner_of(running));
+    EXPECT_TRUE(stats.closed);
+    EXPECT_TRUE(queued_stats.closed);
+    EXPECT_EQ(0UL, stats.read_bytes);
+    EXPECT_FALSE(check_downloaded(dir));
+    EXPECT_FALSE(check_downloaded(queued_dir));
+}
+
+int main(int argc, char **argv) {
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini(););
+    system(("mkdir -p " + kRoot).c_str());
+    ::testing::InitGoogleTest(&argc, argv);
+    auto ret = RUN_ALL_TESTS();
+    return ret;
+}
@@ -29,6 +29,8 @@
 
 
 #include <fcntl.h>
+#include <atomic>
+#include <thread>
 
 #include "../image_service.cpp"
 
@@ -161,6 +163,205 @@ TEST(http_client, user_agent) {
 }
 
 
+struct RangeServer {
+    std::string blob;
+    bool multipart = true;
+    int multi_range_requests = 0;
+
+    int handler(photon::net::http::Request &req, photon::net::http::Response &resp,
+                std::string_view) {
+        estring_view range = req.headers["Range"];
+        std::vector<std::pair<size_t, size_t>> ranges;
+        if (range.starts_with("bytes=")) {
+            for (auto r : range.substr(6).split(',')) {
+                auto dash = r.find('-');
+                ranges.emplace_back(strtoul(r.data(), nullptr, 10),
+                                    strtoul(r.data() + dash + 1, nullptr, 10));
+            }
+        }
+        if (ranges.size() > 1)
+            multi_range_requests++;
+        if (ranges.empty() || (ranges.size() > 1 && !multipart)) {
+            resp.set_result(200);
+            resp.headers.content_length(blob.size());
+            resp.write((void *)blob.data(), blob.size());
+            return 0;
+        }
+        auto size = std::to_string(blob.size());
+        resp.set_result(206);
+        if (ranges.size() == 1) {
+            auto r = ranges[0];
+            resp.headers.insert("Content-Range", "bytes " + std::to_string(r.first) + "-" +
+                                                     std::to_string(r.second) + "/" + size);
+            resp.headers.content_length(r.second - r.first + 1);
+            resp.write((void *)(blob.data() + r.first), r.second - r.first + 1);
+            return 0;
+        }
+        std::string body;
+        for (auto r : ranges) {
+            body += "\r\n--BOUNDARY\r\nContent-Type: application/octet-stream\r\n";
+            body += "Content-Range: bytes " + std::to_string(r.first) + "-" +
+                    std::to_string(r.second) + "/" + size + "\r\n\r\n";
+            body += blob.substr(r.first, r.second - r.first + 1);
+        }
+        body += "\r\n--BOUNDARY--\r\n";
+        resp.headers.insert("Content-Type", "multipart/byteranges; boundary=BOUNDARY");
+        resp.headers.content_length(body.size());
+        resp.write((void *)body.data(), body.size());
+        return 0;
+    }
+};
+
+std::pair<std::string, std::string> no_auth(void *, const char *) {
+    return {};
+}
+
+TEST(registryfs_v2, pread_ranges) {
+    RangeServer rs;
+    rs.blob.resize(1024 * 1024);
+    for (size_t i = 0; i < rs.blob.size(); i++)
+        rs.blob[i] = rand() % 256;
+
+    auto tcpserver = photon::net::new_tcp_socket_server();
+    DEFER(delete tcpserver);
+    tcpserver->bind(18732);
+    tcpserver->listen();
+    auto server = photon::net::http::new_http_server();
+    DEFER(delete server);
+    server->add_handler({&rs, &RangeServer::handler});
+    tcpserver->set_handler(server->get_connection_handler());
+    tcpserver->start_loop();
+
+    auto fs = (RegistryFS *)new_registryfs_v2({nullptr, &no_auth}, nullptr, 10UL * 1000 * 1000);
+    ASSERT_NE(nullptr, fs);
+    DEFER(delete fs);
+    ASSERT_EQ(0, fs->setRangeOptions(4096, true));
+    auto file = fs->open("http://localhost:18732/blob", O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+
+    auto check = [&]() {
+        // the first two are fetched as one, and the last one is clipped by EOF
+        std::vector<std::pair<off_t, size_t>> reqs = {
+            {500000, 5000}, {0, 100}, {200, 100}, {100000, 1000}, {1024 * 1024 - 10, 100}};
+        std::vector<std::string> bufs;
+        std::vector<RegistryRange> ranges;
+        for (auto &r : reqs)
+            bufs.emplace_back(r.second, '\0');
+        for (size_t i = 0; i < reqs.size(); i++)
+            ranges.push_back({&bufs[i][0], reqs[i].second, reqs[i].first});
+        ASSERT_EQ(0, registry_pread_ranges(file, ranges.data(), ranges.size()));
+        EXPECT_EQ(10UL, ranges.back().count);
+        for (size_t i = 0; i < reqs.size(); i++) {
+            EXPECT_EQ(0, memcmp(ranges[i].buf, rs.blob.data() + ranges[i].offset,
+                                ranges[i].count));
+        }
+    };
+
+    // multipart/byteranges in a single request
+    check();
+    EXPECT_EQ(1, rs.multi_range_requests);
+
+    // falls back to a request per range, and never tries multipart again
+    rs.multipart = false;
+    check();
+    EXPECT_EQ(2, rs.multi_range_requests);
+    check();
+    EXPECT_EQ(2, rs.multi_range_requests);
+
+    // an empty batch probes for the support, and other requests fail quietly
+    EXPECT_EQ(0, file->ioctl(REGISTRY_PREAD_RANGES, (RegistryRange *)nullptr, 0));
+    errno = 0;
+    EXPECT_EQ(-1, file->ioctl(0x7fff));
+    EXPECT_EQ(ENOSYS, errno);
+}
+
+void pread_loop(photon::fs::IFile *file, size_t size, int n) {
+    char buf[4096];
+    for (int i = 0; i < n; i++) {
+        off_t offset = rand() % (size / sizeof(buf)) * sizeof(buf);
+        EXPECT_EQ((ssize_t)sizeof(buf), file->pread(buf, sizeof(buf), offset));
+    }
+}
+
+TEST(registryfs_v2, connection_pool) {
+    RangeServer rs;
+    rs.blob.resize(1024 * 1024, 'x');
+
+    auto tcpserver = photon::net::new_tcp_socket_server();
+    DEFER(delete tcpserver);
+    tcpserver->bind(18733);
+    tcpserver->listen();
+    auto server = photon::net::http::new_http_server();
+    DEFER(delete server);
+    server->add_handler({&rs, &RangeServer::handler});
+    tcpserver->set_handler(server->get_connection_handler());
+    tcpserver->start_loop();
+
+    const int kThreads = 16, kReads = 100;
+    // returns the requests per second of reading the blob concurrently
+    auto bench = [&](uint32_t max_per_host, uint64_t *hits, uint64_t *handshakes) -> uint64_t {
+        auto fs = (RegistryFS *)new_registryfs_v2({nullptr, &no_auth}, nullptr, 10UL * 1000 * 1000);
+        DEFER(delete fs);
+        EXPECT_EQ(0, fs->setConnectionPool(max_per_host));
+        auto file = fs->open("http://localhost:18733/blob", O_RDONLY);
+        EXPECT_NE(nullptr, file);
+        DEFER(delete file);
+        auto start = photon::now;
+        std::vector<photon::join_handle *> jhs;
+        for (int i = 0; i < kThreads; i++) {
+            jhs.push_back(photon::thread_enable_join(
+                photon::thread_create11(&pread_loop, file, rs.blob.size(), kReads)));
+        }
+        for (auto jh : jhs)
+            photon::thread_join(jh);
+        auto elapsed = std::max(photon::now - start, 1UL);
+        EXPECT_EQ(0, fs->getConnectionStats(hits, handshakes));
+        return kThreads * kReads * 1000UL * 1000 / elapsed;
+    };
+
+    uint64_t hits, handshakes;
+    auto shared = bench(0, &hits, &handshakes);
+    EXPECT_EQ(0UL, hits + handshakes);
+    auto pooled = bench(4, &hits, &handshakes);
+    // the length of the blob is fetched on open
+    EXPECT_EQ((uint64_t)kThreads * kReads + 1, hits + handshakes);
+    EXPECT_LE(handshakes, 4UL);
+    LOG_INFO("shared client: ` req/s, pooled clients: ` req/s, ` hits, ` handshakes", shared,
+             pooled, hits, handshakes);
+
+    // devices on their own vcpus lease from the same pool, while the server runs on this one
+    auto fs = (RegistryFS *)new_registryfs_v2({nullptr, &no_auth}, nullptr, 10UL * 1000 * 1000);
+    DEFER(delete fs);
+    ASSERT_EQ(0, fs->setConnectionPool(4));
+    auto file = fs->open("http://localhost:18733/blob", O_RDONLY);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete file);
+    const int kVcpus = 4;
+    std::atomic<int> done{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kVcpus; t++) {
+        threads.emplace_back([&] {
+            photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
+            DEFER(photon::fini());
+            std::vector<photon::join_handle *> jhs;
+            for (int i = 0; i < kThreads / kVcpus; i++) {
+                jhs.push_back(photon::thread_enable_join(
+                    photon::thread_create11(&pread_loop, file, rs.blob.size(), kReads)));
+            }
+            for (auto jh : jhs)
+                photon::thread_join(jh);
+            done++;
+        });
+    }
+    while (done < kVcpus)
+        photon::thread_usleep(1000);
+    for (auto &th : threads)
+        th.join();
+    EXPECT_EQ(0, fs->getConnectionStats(&hits, &handshakes));
+    EXPECT_EQ((uint64_t)kThreads * kReads + 1, hits + handshakes);
+    EXPECT_LE(handshakes, 4UL);
+}
 
 int main(int argc, char** argv) {
     photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
@@ -50,6 +50,7 @@ bool build_fastoci = false;
 bool tar = false, rm_old = false, seal = false, commit_sealed = false;
 bool verbose = false;
 int compress_threads = 1;
+int compact_bs = 32, compact_concurrency = 1;
 std::string upload_url, cred_file_path, tls_key_path, tls_cert_path;
 ssize_t upload_bs = 262144;
 
@@ -84,6 +85,8 @@ int main(int argc, char **argv) {
     app.add_flag("--seal", seal, "seal only, data_file is output itself")->default_val(false);
     app.add_flag("--commit_sealed", commit_sealed, "commit sealed, index_file is output")->default_val(false);
     app.add_option("--compress_threads", compress_threads, "compress threads")->default_val(1);
+    app.add_option("--compact_bs", compact_bs, "read block size of compaction, in KB")->default_val(32);
+    app.add_option("--compact_concurrency", compact_concurrency, "number of concurrent reads from source layers")->default_val(1);
     app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
     app.add_option("--upload", upload_url, "registry upload url");
     app.add_option("--upload_bs", upload_bs, "block size for upload, in KB");
@@ -202,6 +205,8 @@ int main(int argc, char **argv) {
     if (commit_msg != "") {
         args.user_tag = const_cast<char *>(commit_msg.c_str());
     }
+    args.compact_block_size = (size_t)compact_bs * 1024;
+    args.compact_concurrency = compact_concurrency;
     auto ret = fin->commit(args);
     if (ret < 0) {
         fprintf(stderr, "failed to perform commit(), %d: %s\n", errno, strerror(errno));
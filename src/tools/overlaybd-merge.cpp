@@ -42,6 +42,7 @@ using namespace photon::fs;
 
 std::string image_config_path, input_path, output, config_path, sha256_checksum;
 int upload_bs = 65536;
+int compress_threads = 1, compact_bs = 32, compact_concurrency = 1;
 bool zfile = false, verbose = false, tar = false;
 std::string upload_url, cred_file_path, tls_key_path, tls_cert_path;
 
@@ -90,6 +91,9 @@ int main(int argc, char **argv) {
     app.add_option("--service_config_path", config_path, "overlaybd image service config path")->type_name("FILEPATH")->check(CLI::ExistingFile)->default_val("/etc/overlaybd/overlaybd.json");
     app.add_flag("--compress", zfile, "do zfile compression for the output layer")->run_callback_for_default()->default_val(true);
     app.add_flag("-t", tar, "wrapper with tar")->default_val(false);
+    app.add_option("--compress_threads", compress_threads, "compress threads")->default_val(1);
+    app.add_option("--compact_bs", compact_bs, "read block size of compaction, in KB")->default_val(32);
+    app.add_option("--compact_concurrency", compact_concurrency, "number of concurrent reads from source layers")->default_val(1);
 
     app.add_option("--upload", upload_url, "upload to remote registry URL while generating merged layer.");
     app.add_option("--upload_bs", upload_bs, "block size for upload, in KB")->default_val(262144);
@@ -134,6 +138,7 @@ int main(int argc, char **argv) {
         ZFile::CompressOptions opt;
         opt.verify = 1;
         ZFile::CompressArgs zfile_args(opt);
+        zfile_args.workers = compress_threads;
         if (!upload_url.empty()) {
             LOG_INFO("enable upload. URL: `, upload_bs: `, tls_key_path: `, tls_cert_path: `", upload_url, upload_bs, tls_key_path, tls_cert_path);
             upload_builder = create_uploader(&zfile_args, rst, upload_url, cred_file_path, 2, upload_bs, tls_key_path, tls_cert_path);
@@ -145,7 +150,10 @@ int main(int argc, char **argv) {
             exit(-1);
         }
     }
-    if (((ImageFile*)imgfile)->compact(rst)!=0){
+    CommitArgs args(rst);
+    args.compact_block_size = (size_t)compact_bs * 1024;
+    args.compact_concurrency = compact_concurrency;
+    if (((ImageFile*)imgfile)->compact(args)!=0){
         fprintf(stderr, "failed to compact\n");
         exit(-1);
     }
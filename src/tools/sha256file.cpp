@@ -37,10 +37,17 @@ public:
     off_t lseek(off_t offset, int whence) override {
         return m_file->lseek(offset, whence);
     }
+    virtual int sha256_update(const void *buf, size_t count) override {
+        if (SHA256_Update(&ctx, buf, count) < 0) {
+            LOG_ERROR("sha256 calculate error");
+            return -1;
+        }
+        return 0;
+    }
     virtual std::string sha256_checksum() override{
         // read trailing data
         char buf[64*1024];
-        auto rc = m_file->read(buf, 64*1024);
+        auto rc = m_file ? m_file->read(buf, 64*1024) : 0;
         while (rc > 0) {
         // if (rc == 64*1024) {
         //     LOG_WARN("too much trailing data");
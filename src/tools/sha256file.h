@@ -7,8 +7,11 @@
 class SHA256File : public photon::fs::VirtualReadOnlyFile {
 public:
     virtual std::string sha256_checksum() = 0;
+    // hashes data that isn't read through the file, like a stream being written
+    virtual int sha256_update(const void *buf, size_t count) = 0;
 };
 
+// `file` can be nullptr, to hash only the data fed by sha256_update()
 SHA256File *new_sha256_file(photon::fs::IFile *file, bool ownership);
 
 std::string sha256sum(const char *fn);